@@ -0,0 +1,216 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Measures the throughput of very large messages. A client sends messages of
+// the given size to a server over local sockets, each side on its own
+// io_service thread, first as ordinary messages, then as streams copied from
+// and into the same buffers 64 KiB at a time, then chunked without a crypto
+// pool, and then chunked with crypto pools of increasing size.
+//
+// usage: chunked_bench [max pool threads] [messages] [message size]
+
+#include "asio_sodium/crypto_pool.hpp"
+#include "asio_sodium/crypto_stream.hpp"
+
+#include <asio/io_service.hpp>
+#include <asio/use_future.hpp>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/local/connect_pair.hpp>
+#include <asio/local/stream_protocol.hpp>
+#pragma clang diagnostic pop
+
+#include <sodium.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace asio_sodium;
+
+namespace {
+  using socket_type = asio::local::stream_protocol::socket;
+  using stream_type = crypto_stream<socket_type>;
+  using clock_type = std::chrono::steady_clock;
+
+  enum class mode {
+    plain
+  , stream
+  , chunked
+  };
+
+  // Sends the message as a stream, and copies it into target as it arrives
+  std::pair<std::future<uint64_t>, std::future<uint64_t>>
+  stream_message(
+    stream_type& client
+  , stream_type& server
+  , std::vector<byte> const& source
+  , std::vector<byte>& target
+  ) {
+    auto written = client.async_write_stream(
+      [&source, offset = std::size_t(0)](gsl::span<byte> chunk) mutable {
+        auto const size = std::min(
+          source.size() - offset
+        , static_cast<std::size_t>(chunk.size())
+        );
+        std::copy_n(source.data() + offset, size, chunk.data());
+        offset += size;
+        return size;
+      }
+    , asio::use_future
+    );
+    auto read = server.async_read_stream(
+      [&target, offset = std::size_t(0)](gsl::span<byte> chunk) mutable {
+        std::copy(chunk.begin(), chunk.end(), target.data() + offset);
+        offset += static_cast<std::size_t>(chunk.size());
+      }
+    , asio::use_future
+    );
+    return {std::move(written), std::move(read)};
+  }
+
+  void
+  run_round(
+    char const* name
+  , mode write_mode
+  , std::size_t pool_threads
+  , std::size_t messages
+  , std::size_t message_size
+  ) {
+    public_key server_pk;
+    private_key server_sk;
+    crypto_box_keypair(&server_pk[0], &server_sk[0]);
+    public_key client_pk;
+    private_key client_sk;
+    crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+    asio::io_service client_io;
+    asio::io_service server_io;
+    socket_type client_socket(client_io);
+    socket_type server_socket(server_io);
+    asio::local::connect_pair(client_socket, server_socket);
+
+    auto client_work = std::make_unique<asio::io_service::work>(client_io);
+    auto server_work = std::make_unique<asio::io_service::work>(server_io);
+    std::thread client_thread([&client_io] { client_io.run(); });
+    std::thread server_thread([&server_io] { server_io.run(); });
+
+    auto server_handshake = stream_type::async_server_handshake(
+      std::move(server_socket)
+    , make_identity(server_pk, server_sk)
+    , [](auto const) { return true; }
+    , asio::use_future
+    );
+    auto client_handshake = stream_type::async_client_handshake(
+      std::move(client_socket)
+    , server_pk
+    , make_identity(client_pk, client_sk)
+    , asio::use_future
+    );
+    auto server = server_handshake.get();
+    auto client = client_handshake.get();
+
+    std::unique_ptr<crypto_pool> client_pool;
+    std::unique_ptr<crypto_pool> server_pool;
+    if (pool_threads > 0) {
+      client_pool = std::make_unique<crypto_pool>(pool_threads);
+      server_pool = std::make_unique<crypto_pool>(pool_threads);
+      client.set_crypto_pool(client_pool.get());
+      server.set_crypto_pool(server_pool.get());
+    }
+
+    std::vector<byte> source(message_size);
+    std::vector<byte> target(message_size);
+
+    auto const start = clock_type::now();
+    for (std::size_t i = 0; i < messages; ++i) {
+      if (write_mode == mode::stream) {
+        auto futures = stream_message(client, server, source, target);
+        futures.first.get();
+        futures.second.get();
+        continue;
+      }
+      auto written =
+        write_mode == mode::plain
+        ? client.async_write_destructive(
+            gsl::as_span(source)
+          , asio::use_future
+          )
+        : client.async_write_chunked(
+            gsl::as_span(source)
+          , asio::use_future
+          )
+      ;
+      auto read = server.async_read(gsl::as_span(target), asio::use_future);
+      written.get();
+      read.get();
+    }
+    auto const elapsed = clock_type::now() - start;
+
+    std::printf(
+      "%-8s %7zu %16.0f\n"
+    , name
+    , pool_threads
+    , static_cast<double>(messages * message_size)
+      / (1024.0 * 1024.0)
+      / std::chrono::duration<double>(elapsed).count()
+    );
+
+    client_work.reset();
+    server_work.reset();
+    client_thread.join();
+    server_thread.join();
+  }
+}
+
+int
+main(int argc, char** argv) {
+  if (sodium_init() < 0) {
+    return 1;
+  }
+
+  auto const arg = [argc, argv](int index, std::size_t fallback) {
+    return
+      argc > index
+      ? static_cast<std::size_t>(std::strtoul(argv[index], nullptr, 10))
+      : fallback
+    ;
+  };
+  auto const max_threads = arg(1, crypto_pool::default_thread_count());
+  auto const messages = arg(2, 8);
+  auto const message_size = arg(3, 256 * 1024 * 1024);
+
+  std::printf("%-8s %7s %16s\n", "mode", "threads", "MiB/s");
+  run_round("plain", mode::plain, 0, messages, message_size);
+  run_round("stream", mode::stream, 0, messages, message_size);
+  run_round("chunked", mode::chunked, 0, messages, message_size);
+  for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+    run_round("chunked", mode::chunked, threads, messages, message_size);
+    if (threads < max_threads && threads * 2 > max_threads) {
+      run_round("chunked", mode::chunked, max_threads, messages, message_size);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Measures how the size of a completion handler affects the cost of reads and
+// writes. A pair of crypto_streams over local sockets echoes messages back and
+// forth, with every handler capturing a padding array of the given size. The
+// reader and writer keep their state in the session, so the rate should not
+// depend on the padding.
+//
+// usage: handler_size_bench [round trips] [message size]
+
+#include "asio_sodium/crypto_stream.hpp"
+
+#include <asio/io_service.hpp>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/local/connect_pair.hpp>
+#include <asio/local/stream_protocol.hpp>
+#pragma clang diagnostic pop
+
+#include <sodium.h>
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+using namespace asio_sodium;
+
+namespace {
+  using socket_type = asio::local::stream_protocol::socket;
+  using stream_type = crypto_stream<socket_type>;
+  using clock_type = std::chrono::steady_clock;
+
+  // Echoes every message back until the peer goes away
+  template <std::size_t Padding>
+  class echo_peer final {
+  public:
+    echo_peer(
+      stream_type&& stream
+    , std::size_t message_size
+    )
+      : stream_(std::move(stream))
+      , buffer_(message_size)
+    {}
+
+    void
+    read() {
+      stream_.async_read(
+        gsl::as_span(buffer_)
+      , [this, padding = padding_](std::error_code const& ec, std::size_t size) {
+          if (!ec && padding.size() == Padding) {
+            write(size);
+          }
+        }
+      );
+    }
+
+  private:
+    void
+    write(std::size_t size) {
+      stream_.async_write_destructive(
+        gsl::as_span(buffer_).first(static_cast<std::ptrdiff_t>(size))
+      , [this, padding = padding_](std::error_code const& ec, std::size_t) {
+          if (!ec && padding.size() == Padding) {
+            read();
+          }
+        }
+      );
+    }
+
+    stream_type stream_;
+    std::vector<byte> buffer_;
+    std::array<byte, Padding> padding_{};
+  };
+
+  // Sends round_trips messages, waiting for each echo, and then hangs up
+  template <std::size_t Padding>
+  class client_peer final {
+  public:
+    client_peer(
+      stream_type&& stream
+    , std::size_t message_size
+    , std::size_t round_trips
+    )
+      : stream_(std::move(stream))
+      , buffer_(message_size)
+      , remaining_(round_trips)
+    {}
+
+    void
+    write() {
+      if (remaining_-- == 0) {
+        stream_.next_layer().close();
+        return;
+      }
+      stream_.async_write_destructive(
+        gsl::as_span(buffer_)
+      , [this, padding = padding_](std::error_code const& ec, std::size_t) {
+          if (!ec && padding.size() == Padding) {
+            read();
+          }
+        }
+      );
+    }
+
+  private:
+    void
+    read() {
+      stream_.async_read(
+        gsl::as_span(buffer_)
+      , [this, padding = padding_](std::error_code const& ec, std::size_t) {
+          if (!ec && padding.size() == Padding) {
+            write();
+          }
+        }
+      );
+    }
+
+    stream_type stream_;
+    std::vector<byte> buffer_;
+    std::size_t remaining_;
+    std::array<byte, Padding> padding_{};
+  };
+
+  template <std::size_t Padding>
+  void
+  run_round(
+    std::size_t round_trips
+  , std::size_t message_size
+  ) {
+    public_key server_pk;
+    private_key server_sk;
+    crypto_box_keypair(&server_pk[0], &server_sk[0]);
+    public_key client_pk;
+    private_key client_sk;
+    crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+    asio::io_service io;
+    socket_type client_socket(io);
+    socket_type server_socket(io);
+    asio::local::connect_pair(client_socket, server_socket);
+
+    std::unique_ptr<echo_peer<Padding>> server;
+    std::unique_ptr<client_peer<Padding>> client;
+    stream_type::async_server_handshake(
+      std::move(server_socket)
+    , make_identity(server_pk, server_sk)
+    , [](auto const) { return true; }
+    , [&](stream_type&& stream) {
+        server = std::make_unique<echo_peer<Padding>>(
+          std::move(stream)
+        , message_size
+        );
+      }
+    , [](std::error_code const& ec, auto) {
+        std::fprintf(stderr, "handshake failed: %s\n", ec.message().c_str());
+        std::exit(1);
+      }
+    );
+    stream_type::async_client_handshake(
+      std::move(client_socket)
+    , server_pk
+    , make_identity(client_pk, client_sk)
+    , [&](stream_type&& stream) {
+        client = std::make_unique<client_peer<Padding>>(
+          std::move(stream)
+        , message_size
+        , round_trips
+        );
+      }
+    , [](std::error_code const& ec) {
+        std::fprintf(stderr, "handshake failed: %s\n", ec.message().c_str());
+        std::exit(1);
+      }
+    );
+    io.run();
+    io.reset();
+
+    server->read();
+    client->write();
+    auto const start = clock_type::now();
+    io.run();
+    auto const elapsed = clock_type::now() - start;
+
+    std::printf(
+      "%12zu %16.0f\n"
+    , Padding
+    , std::chrono::duration<double, std::nano>(elapsed).count()
+      / static_cast<double>(round_trips)
+    );
+
+    client.reset();
+    server.reset();
+  }
+}
+
+int
+main(int argc, char** argv) {
+  if (sodium_init() < 0) {
+    return 1;
+  }
+
+  auto const arg = [argc, argv](int index, std::size_t fallback) {
+    return
+      argc > index
+      ? static_cast<std::size_t>(std::strtoul(argv[index], nullptr, 10))
+      : fallback
+    ;
+  };
+  auto const round_trips = arg(1, 50000);
+  auto const message_size = arg(2, 64);
+
+  std::printf("%12s %16s\n", "handler pad", "ns/round trip");
+  run_round<0>(round_trips, message_size);
+  run_round<256>(round_trips, message_size);
+  run_round<1024>(round_trips, message_size);
+  run_round<4096>(round_trips, message_size);
+  run_round<16384>(round_trips, message_size);
+  return 0;
+}
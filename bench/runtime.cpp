@@ -0,0 +1,334 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Measures how server_runtime scales with worker count. For each worker count
+// it reports the rate at which the runtime completes handshakes and the rate
+// at which it echoes messages. The load generator runs one client io_service
+// thread per server worker, so on a machine with N cores the last rows share
+// cores with the clients. With handshake threads, the server's handshake
+// crypto runs on a crypto_pool of that size instead of on the workers.
+//
+// usage: runtime_bench [max workers] [connections per worker]
+//                      [round trips per connection] [message size]
+//                      [handshake threads]
+
+#include "asio_sodium/server_runtime.hpp"
+
+#include <asio/io_service.hpp>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/ip/tcp.hpp>
+#pragma clang diagnostic pop
+
+#include <sodium.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace asio_sodium;
+
+namespace {
+  using stream_type = crypto_stream<asio::ip::tcp::socket>;
+  using clock_type = std::chrono::steady_clock;
+
+  unsigned short const port = 58100;
+
+  // Echoes every message back until the peer goes away
+  class echo_connection final
+    : public std::enable_shared_from_this<echo_connection>
+  {
+  public:
+    echo_connection(
+      stream_type&& stream
+    , std::size_t message_size
+    )
+      : stream_(std::move(stream))
+      , buffer_(message_size)
+    {}
+
+    void
+    read() {
+      auto self = shared_from_this();
+      stream_.async_read(
+        gsl::as_span(buffer_)
+      , [self](std::error_code const& ec, std::size_t size) {
+          if (!ec) {
+            self->write(size);
+          }
+        }
+      );
+    }
+
+  private:
+    void
+    write(std::size_t size) {
+      auto self = shared_from_this();
+      stream_.async_write_destructive(
+        gsl::as_span(buffer_).first(static_cast<std::ptrdiff_t>(size))
+      , [self](std::error_code const& ec, std::size_t) {
+          if (!ec) {
+            self->read();
+          }
+        }
+      );
+    }
+
+    stream_type stream_;
+    std::vector<byte> buffer_;
+  };
+
+  // Connects, then sends round_trips messages and waits for each echo
+  class client_connection final
+    : public std::enable_shared_from_this<client_connection>
+  {
+  public:
+    client_connection(
+      stream_type&& stream
+    , std::size_t message_size
+    , std::size_t round_trips
+    , std::atomic<std::size_t>& finished
+    )
+      : stream_(std::move(stream))
+      , buffer_(message_size)
+      , remaining_(round_trips)
+      , finished_(finished)
+    {}
+
+    void
+    write() {
+      if (remaining_-- == 0) {
+        ++finished_;
+        return;
+      }
+      auto self = shared_from_this();
+      stream_.async_write_destructive(
+        gsl::as_span(buffer_)
+      , [self](std::error_code const& ec, std::size_t) {
+          if (!ec) {
+            self->read();
+          }
+        }
+      );
+    }
+
+  private:
+    void
+    read() {
+      auto self = shared_from_this();
+      stream_.async_read(
+        gsl::as_span(buffer_)
+      , [self](std::error_code const& ec, std::size_t) {
+          if (!ec) {
+            self->write();
+          }
+        }
+      );
+    }
+
+    stream_type stream_;
+    std::vector<byte> buffer_;
+    std::size_t remaining_;
+    std::atomic<std::size_t>& finished_;
+  };
+
+  void
+  wait_for(
+    std::atomic<std::size_t> const& counter
+  , std::size_t target
+  ) {
+    while (counter < target) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+  double
+  per_second(
+    std::size_t count
+  , clock_type::duration elapsed
+  ) {
+    return
+      static_cast<double>(count)
+      / std::chrono::duration<double>(elapsed).count()
+    ;
+  }
+
+  void
+  run_round(
+    std::size_t workers
+  , std::size_t connections_per_worker
+  , std::size_t round_trips
+  , std::size_t message_size
+  , std::size_t handshake_threads
+  ) {
+    public_key server_pk;
+    private_key server_sk;
+    crypto_box_keypair(&server_pk[0], &server_sk[0]);
+    public_key client_pk;
+    private_key client_sk;
+    crypto_box_keypair(&client_pk[0], &client_sk[0]);
+    auto const client_identity = make_identity(client_pk, client_sk);
+
+    std::unique_ptr<crypto_pool> handshake_pool;
+    server_runtime runtime{workers};
+    if (handshake_threads > 0) {
+      handshake_pool = std::make_unique<crypto_pool>(handshake_threads);
+      runtime.set_handshake_pool(handshake_pool.get());
+    }
+    auto const listen_ec = runtime.listen(
+      asio::ip::tcp::endpoint{asio::ip::tcp::v4(), port}
+    , make_identity(server_pk, server_sk)
+    , [](auto const) { return true; }
+    , [message_size](stream_type&& stream) {
+        std::make_shared<echo_connection>(std::move(stream), message_size)
+          ->read();
+      }
+    , [](std::error_code const&) {}
+    );
+    if (listen_ec) {
+      std::fprintf(
+        stderr, "listen failed: %s\n", listen_ec.message().c_str()
+      );
+      std::exit(1);
+    }
+    runtime.run();
+
+    auto const total = workers * connections_per_worker;
+    std::atomic<std::size_t> connected{0};
+    std::atomic<std::size_t> finished{0};
+    std::vector<std::unique_ptr<asio::io_service>> client_ios;
+    std::vector<std::vector<std::shared_ptr<client_connection>>> clients(
+      workers
+    );
+    for (std::size_t i = 0; i < workers; ++i) {
+      client_ios.push_back(std::make_unique<asio::io_service>());
+    }
+
+    auto const handshake_start = clock_type::now();
+    for (std::size_t i = 0; i < workers; ++i) {
+      auto& io = *client_ios[i];
+      auto& owned = clients[i];
+      for (std::size_t j = 0; j < connections_per_worker; ++j) {
+        stream_type::async_connect(
+          asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port)
+        , io
+        , server_pk
+        , client_identity
+        , [&, message_size, round_trips](stream_type&& stream) {
+            owned.push_back(
+              std::make_shared<client_connection>(
+                std::move(stream)
+              , message_size
+              , round_trips
+              , finished
+              )
+            );
+            ++connected;
+          }
+        , [](std::error_code const& ec) {
+            std::fprintf(stderr, "connect failed: %s\n", ec.message().c_str());
+            std::exit(1);
+          }
+        );
+      }
+    }
+    std::vector<std::thread> client_threads;
+    for (auto& io : client_ios) {
+      client_threads.emplace_back([&io] { io->run(); });
+    }
+    for (auto& thread : client_threads) {
+      thread.join();
+    }
+    wait_for(connected, total);
+    auto const handshake_elapsed = clock_type::now() - handshake_start;
+
+    auto const message_start = clock_type::now();
+    for (std::size_t i = 0; i < workers; ++i) {
+      client_ios[i]->reset();
+      for (auto& client : clients[i]) {
+        client->write();
+      }
+    }
+    client_threads.clear();
+    for (auto& io : client_ios) {
+      client_threads.emplace_back([&io] { io->run(); });
+    }
+    for (auto& thread : client_threads) {
+      thread.join();
+    }
+    wait_for(finished, total);
+    auto const message_elapsed = clock_type::now() - message_start;
+
+    std::printf(
+      "%7zu %16.0f %16.0f\n"
+    , workers
+    , per_second(total, handshake_elapsed)
+    , per_second(total * round_trips, message_elapsed)
+    );
+
+    clients.clear();
+    runtime.stop();
+    runtime.join();
+  }
+}
+
+int
+main(int argc, char** argv) {
+  if (sodium_init() < 0) {
+    return 1;
+  }
+
+  auto const arg = [argc, argv](int index, std::size_t fallback) {
+    return
+      argc > index
+      ? static_cast<std::size_t>(std::strtoul(argv[index], nullptr, 10))
+      : fallback
+    ;
+  };
+  auto const max_workers = arg(1, server_runtime::default_worker_count());
+  auto const connections_per_worker = arg(2, 200);
+  auto const round_trips = arg(3, 1000);
+  auto const message_size = arg(4, 64);
+  auto const handshake_threads = arg(5, 0);
+
+  std::printf("%7s %16s %16s\n", "workers", "handshakes/s", "messages/s");
+  for (std::size_t workers = 1; workers <= max_workers; workers *= 2) {
+    run_round(
+      workers
+    , connections_per_worker
+    , round_trips
+    , message_size
+    , handshake_threads
+    );
+    if (workers < max_workers && workers * 2 > max_workers) {
+      run_round(
+        max_workers
+      , connections_per_worker
+      , round_trips
+      , message_size
+      , handshake_threads
+      );
+    }
+  }
+  return 0;
+}
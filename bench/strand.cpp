@@ -0,0 +1,342 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+// Measures what binding a connection's continuations to a strand costs. Pairs
+// of crypto_streams over local sockets echo messages back and forth on one
+// io_service, first without a strand on a single thread (the baseline), then
+// on a strand with a single thread (pure strand overhead), then on a strand
+// with the io_service run from several threads.
+//
+// usage: strand_bench [threads] [connection pairs] [round trips per pair]
+//                     [message size]
+
+#include "asio_sodium/bound_stream.hpp"
+#include "asio_sodium/crypto_stream.hpp"
+
+#include <asio/io_service.hpp>
+#include <asio/post.hpp>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/local/connect_pair.hpp>
+#include <asio/local/stream_protocol.hpp>
+#pragma clang diagnostic pop
+
+#include <sodium.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace asio_sodium;
+
+namespace {
+  using socket_type = asio::local::stream_protocol::socket;
+  using plain_stream = crypto_stream<socket_type>;
+  using strand_stream_type = crypto_stream<strand_stream<socket_type>>;
+  using clock_type = std::chrono::steady_clock;
+
+  plain_stream::next_layer_type
+  make_next_layer(
+    plain_stream*
+  , asio::io_service&
+  , socket_type&& socket
+  ) {
+    return std::move(socket);
+  }
+
+  strand_stream_type::next_layer_type
+  make_next_layer(
+    strand_stream_type*
+  , asio::io_service& io
+  , socket_type&& socket
+  ) {
+    return
+      strand_stream_type::next_layer_type(
+        std::move(socket)
+      , strand_stream_type::next_layer_type::executor_type(io.get_executor())
+      )
+    ;
+  }
+
+  // Echoes every message back until the peer goes away
+  template <typename Stream>
+  class echo_peer final {
+  public:
+    echo_peer(
+      Stream&& stream
+    , std::size_t message_size
+    )
+      : stream_(std::move(stream))
+      , buffer_(message_size)
+    {}
+
+    // Operations have to be started from within the stream's executor
+    void
+    start() {
+      asio::post(stream_.next_layer().get_executor(), [this] { read(); });
+    }
+
+  private:
+    void
+    read() {
+      stream_.async_read(
+        gsl::as_span(buffer_)
+      , [this](std::error_code const& ec, std::size_t size) {
+          if (!ec) {
+            write(size);
+          }
+        }
+      );
+    }
+
+    void
+    write(std::size_t size) {
+      stream_.async_write_destructive(
+        gsl::as_span(buffer_).first(static_cast<std::ptrdiff_t>(size))
+      , [this](std::error_code const& ec, std::size_t) {
+          if (!ec) {
+            read();
+          }
+        }
+      );
+    }
+
+    Stream stream_;
+    std::vector<byte> buffer_;
+  };
+
+  // Sends round_trips messages, waiting for each echo, and then hangs up
+  template <typename Stream>
+  class client_peer final {
+  public:
+    client_peer(
+      Stream&& stream
+    , std::size_t message_size
+    , std::size_t round_trips
+    , std::atomic<std::size_t>& finished
+    )
+      : stream_(std::move(stream))
+      , buffer_(message_size)
+      , remaining_(round_trips)
+      , finished_(finished)
+    {}
+
+    void
+    start() {
+      asio::post(stream_.next_layer().get_executor(), [this] { write(); });
+    }
+
+  private:
+    void
+    write() {
+      if (remaining_-- == 0) {
+        ++finished_;
+        stream_.next_layer().lowest_layer().close();
+        return;
+      }
+      stream_.async_write_destructive(
+        gsl::as_span(buffer_)
+      , [this](std::error_code const& ec, std::size_t) {
+          if (!ec) {
+            read();
+          }
+        }
+      );
+    }
+
+    void
+    read() {
+      stream_.async_read(
+        gsl::as_span(buffer_)
+      , [this](std::error_code const& ec, std::size_t) {
+          if (!ec) {
+            write();
+          }
+        }
+      );
+    }
+
+    Stream stream_;
+    std::vector<byte> buffer_;
+    std::size_t remaining_;
+    std::atomic<std::size_t>& finished_;
+  };
+
+  double
+  per_second(
+    std::size_t count
+  , clock_type::duration elapsed
+  ) {
+    return
+      static_cast<double>(count)
+      / std::chrono::duration<double>(elapsed).count()
+    ;
+  }
+
+  void
+  run_threads(
+    asio::io_service& io
+  , std::size_t threads
+  ) {
+    std::vector<std::thread> pool;
+    for (std::size_t i = 1; i < threads; ++i) {
+      pool.emplace_back([&io] { io.run(); });
+    }
+    io.run();
+    for (auto& thread : pool) {
+      thread.join();
+    }
+  }
+
+  template <typename Stream>
+  void
+  run_round(
+    char const* name
+  , std::size_t threads
+  , std::size_t pairs
+  , std::size_t round_trips
+  , std::size_t message_size
+  ) {
+    public_key server_pk;
+    private_key server_sk;
+    crypto_box_keypair(&server_pk[0], &server_sk[0]);
+    public_key client_pk;
+    private_key client_sk;
+    crypto_box_keypair(&client_pk[0], &client_sk[0]);
+    auto const server_identity = make_identity(server_pk, server_sk);
+    auto const client_identity = make_identity(client_pk, client_sk);
+
+    asio::io_service io;
+    std::atomic<std::size_t> finished{0};
+    std::vector<std::unique_ptr<echo_peer<Stream>>> servers(pairs);
+    std::vector<std::unique_ptr<client_peer<Stream>>> clients(pairs);
+
+    for (std::size_t i = 0; i < pairs; ++i) {
+      socket_type client_socket(io);
+      socket_type server_socket(io);
+      asio::local::connect_pair(client_socket, server_socket);
+
+      Stream::async_server_handshake(
+        make_next_layer(
+          static_cast<Stream*>(nullptr)
+        , io
+        , std::move(server_socket)
+        )
+      , server_identity
+      , [](auto const) { return true; }
+      , [&, i](Stream&& stream) {
+          servers[i] = std::make_unique<echo_peer<Stream>>(
+            std::move(stream)
+          , message_size
+          );
+        }
+      , [](std::error_code const& ec, auto) {
+          std::fprintf(stderr, "handshake failed: %s\n", ec.message().c_str());
+          std::exit(1);
+        }
+      );
+      Stream::async_client_handshake(
+        make_next_layer(
+          static_cast<Stream*>(nullptr)
+        , io
+        , std::move(client_socket)
+        )
+      , server_pk
+      , client_identity
+      , [&, i](Stream&& stream) {
+          clients[i] = std::make_unique<client_peer<Stream>>(
+            std::move(stream)
+          , message_size
+          , round_trips
+          , finished
+          );
+        }
+      , [](std::error_code const& ec) {
+          std::fprintf(stderr, "handshake failed: %s\n", ec.message().c_str());
+          std::exit(1);
+        }
+      );
+    }
+    io.run();
+    io.reset();
+
+    for (std::size_t i = 0; i < pairs; ++i) {
+      servers[i]->start();
+      clients[i]->start();
+    }
+
+    auto const start = clock_type::now();
+    run_threads(io, threads);
+    auto const elapsed = clock_type::now() - start;
+
+    if (finished != pairs) {
+      std::fprintf(
+        stderr
+      , "%zu of %zu pairs finished\n"
+      , finished.load()
+      , pairs
+      );
+      std::exit(1);
+    }
+
+    std::printf(
+      "%-8s %7zu %16.0f\n"
+    , name
+    , threads
+    , per_second(pairs * round_trips, elapsed)
+    );
+
+    // Tear down the streams while the io_service is still alive
+    clients.clear();
+    servers.clear();
+  }
+}
+
+int
+main(int argc, char** argv) {
+  if (sodium_init() < 0) {
+    return 1;
+  }
+
+  auto const arg = [argc, argv](int index, std::size_t fallback) {
+    return
+      argc > index
+      ? static_cast<std::size_t>(std::strtoul(argv[index], nullptr, 10))
+      : fallback
+    ;
+  };
+  auto const hardware = std::thread::hardware_concurrency();
+  auto const threads = arg(1, hardware < 2 ? 2 : hardware);
+  auto const pairs = arg(2, 64);
+  auto const round_trips = arg(3, 2000);
+  auto const message_size = arg(4, 64);
+
+  std::printf("%-8s %7s %16s\n", "mode", "threads", "round trips/s");
+  run_round<plain_stream>("plain", 1, pairs, round_trips, message_size);
+  run_round<strand_stream_type>("strand", 1, pairs, round_trips, message_size);
+  run_round<strand_stream_type>(
+    "strand", threads, pairs, round_trips, message_size
+  );
+  return 0;
+}
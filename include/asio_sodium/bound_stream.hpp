@@ -0,0 +1,132 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#ifndef ASIO_SODIUM_13c5e97c_02db_494e_8f39_8fd4bc2b8c11
+#define ASIO_SODIUM_13c5e97c_02db_494e_8f39_8fd4bc2b8c11
+
+#include <asio/bind_executor.hpp>
+#include <asio/io_service.hpp>
+#include <asio/strand.hpp>
+
+#include <type_traits>
+#include <utility>
+
+namespace asio_sodium {
+  // Wraps an AsyncStream so that the completion of every operation started on
+  // it runs through Executor. Used as the next layer of a crypto_stream, this
+  // puts all of the stream's internal continuations (handshake steps, reads,
+  // queued writes, and the handlers they invoke) on one strand, so an
+  // io_service may be run from several threads without the caller wrapping
+  // each handler. Operations must still be started from within the executor,
+  // as with any asio object.
+  template <
+    typename NextLayer
+  , typename Executor
+  >
+  class bound_stream final {
+  public:
+    using next_layer_type = typename std::remove_reference<NextLayer>::type;
+    using lowest_layer_type = typename next_layer_type::lowest_layer_type;
+    using executor_type = Executor;
+
+    // Requires an Executor constructible from the io_service's executor, as a
+    // strand is
+    explicit
+    bound_stream(
+      asio::io_service& io
+    )
+      : next_layer_(io)
+      , executor_(io.get_executor())
+    {}
+
+    bound_stream(
+      next_layer_type&& next_layer
+    , Executor const& executor
+    )
+      : next_layer_(std::move(next_layer))
+      , executor_(executor)
+    {}
+
+    bound_stream(bound_stream&&) = default;
+    bound_stream& operator=(bound_stream&&) = default;
+
+    executor_type
+    get_executor() const noexcept { return executor_; }
+
+    next_layer_type&
+    next_layer() noexcept { return next_layer_; }
+
+    next_layer_type const&
+    next_layer() const noexcept { return next_layer_; }
+
+    lowest_layer_type&
+    lowest_layer() noexcept { return next_layer_.lowest_layer(); }
+
+    lowest_layer_type const&
+    lowest_layer() const noexcept { return next_layer_.lowest_layer(); }
+
+    template <
+      typename MutableBufferSequence
+    , typename ReadHandler
+    >
+    auto
+    async_read_some(
+      MutableBufferSequence const& buffers
+    , ReadHandler&& handler
+    ) {
+      return
+        next_layer_.async_read_some(
+          buffers
+        , asio::bind_executor(executor_, std::forward<ReadHandler>(handler))
+        )
+      ;
+    }
+
+    template <
+      typename ConstBufferSequence
+    , typename WriteHandler
+    >
+    auto
+    async_write_some(
+      ConstBufferSequence const& buffers
+    , WriteHandler&& handler
+    ) {
+      return
+        next_layer_.async_write_some(
+          buffers
+        , asio::bind_executor(executor_, std::forward<WriteHandler>(handler))
+        )
+      ;
+    }
+
+  private:
+    NextLayer next_layer_;
+    Executor executor_;
+  };
+
+  // The usual case: one strand per connection
+  template <typename NextLayer>
+  using strand_stream =
+    bound_stream<
+      NextLayer
+    , asio::strand<asio::io_service::executor_type>
+    >
+  ;
+}
+
+#endif
@@ -0,0 +1,375 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ASIO_SODIUM_f1f2dc79_49e2_4d50_8c7e_a6ba012a5199
+#define ASIO_SODIUM_f1f2dc79_49e2_4d50_8c7e_a6ba012a5199
+
+#include "crypto.hpp"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wreserved-id-macro"
+#pragma clang diagnostic ignored "-Wextra-semi"
+#pragma clang diagnostic ignored "-Wweak-vtables"
+#pragma clang diagnostic ignored "-Wpadded"
+#include <optional.hpp>
+#pragma clang diagnostic pop
+
+#include <sodium.h>
+
+#include <type_traits>
+
+// A cipher suite is the AEAD construction used for message traffic once the
+// handshake has derived the session keys. Each suite provides:
+//
+//   mac_size              - the size of the detached authentication tag
+//   key_state             - per-session key material (possibly expanded)
+//   proposal()            - the suite id (see ids) a client offers in its hello
+//   select(proposal)      - the suite id a server answers with, if any
+//   accepts(selection)    - whether a client can use the server's selection
+//   set_key(k, sel, key)  - prepares key_state from a session key
+//   encrypt(...)/decrypt(...) - detached AEAD using a crypto box sized nonce
+//
+// Suites with a shorter nonce use its leading bytes (which is where the
+// message counter is mixed in).
+namespace asio_sodium {
+namespace cipher_suites {
+  template <typename T>
+  using optional = std::experimental::optional<T>;
+
+  namespace ids {
+    constexpr byte xchacha20poly1305_ietf = 1;
+    constexpr byte aes256gcm = 2;
+  }
+
+  class xchacha20poly1305_ietf final {
+  public:
+    static constexpr std::size_t
+    mac_size = crypto_aead_xchacha20poly1305_ietf_ABYTES;
+
+    using key_state =
+      std::array<byte, crypto_aead_xchacha20poly1305_ietf_KEYBYTES>
+    ;
+
+    static_assert(
+      crypto_aead_xchacha20poly1305_ietf_NPUBBYTES <= crypto_box_NONCEBYTES
+    , "nonce too large"
+    );
+
+    static bool
+    is_available() noexcept { return true; }
+
+    static byte
+    proposal() noexcept { return ids::xchacha20poly1305_ietf; }
+
+    static optional<byte>
+    select(byte proposal) noexcept {
+      if (proposal == ids::xchacha20poly1305_ietf) {
+        return ids::xchacha20poly1305_ietf;
+      } else {
+        return {};
+      }
+    }
+
+    static bool
+    accepts(byte selection) noexcept {
+      return selection == ids::xchacha20poly1305_ietf;
+    }
+
+    static bool
+    set_key(
+      key_state& state
+    , byte selection
+    , session_key const& key
+    )
+    noexcept {
+      static_assert(sizeof(key_state) == sizeof(session_key), "key size mismatch");
+      if (selection != ids::xchacha20poly1305_ietf) {
+        return false;
+      }
+      std::copy(key.begin(), key.end(), state.begin());
+      return true;
+    }
+
+    static bool
+    encrypt(
+      key_state const& state
+    , byte* ciphertext
+    , byte* mac
+    , byte const* message
+    , std::size_t length
+    , nonce const& nonce
+    )
+    noexcept {
+      return
+        crypto_aead_xchacha20poly1305_ietf_encrypt_detached(
+          ciphertext
+        , mac
+        , nullptr
+        , message
+        , length
+        , nullptr
+        , 0
+        , nullptr
+        , &nonce[0]
+        , &state[0]
+        )
+        == 0
+      ;
+    }
+
+    static bool
+    decrypt(
+      key_state const& state
+    , byte* message
+    , byte const* ciphertext
+    , byte const* mac
+    , std::size_t length
+    , nonce const& nonce
+    )
+    noexcept {
+      return
+        crypto_aead_xchacha20poly1305_ietf_decrypt_detached(
+          message
+        , nullptr
+        , ciphertext
+        , length
+        , mac
+        , nullptr
+        , 0
+        , &nonce[0]
+        , &state[0]
+        )
+        == 0
+      ;
+    }
+  };
+
+  class aes256gcm final {
+  public:
+    static constexpr std::size_t
+    mac_size = crypto_aead_aes256gcm_ABYTES;
+
+    // The expanded key schedule, so that each message skips key expansion
+    using key_state = crypto_aead_aes256gcm_state;
+
+    static_assert(
+      crypto_aead_aes256gcm_NPUBBYTES <= crypto_box_NONCEBYTES
+    , "nonce too large"
+    );
+    static_assert(
+      crypto_aead_aes256gcm_KEYBYTES == crypto_kx_SESSIONKEYBYTES
+    , "key size mismatch"
+    );
+
+    // Requires hardware support (AES-NI and CLMUL)
+    static bool
+    is_available() noexcept {
+      static bool const available =
+        sodium_init() >= 0 && crypto_aead_aes256gcm_is_available() == 1
+      ;
+      return available;
+    }
+
+    static byte
+    proposal() noexcept { return ids::aes256gcm; }
+
+    static optional<byte>
+    select(byte proposal) noexcept {
+      if (proposal == ids::aes256gcm && is_available()) {
+        return ids::aes256gcm;
+      } else {
+        return {};
+      }
+    }
+
+    static bool
+    accepts(byte selection) noexcept { return selection == ids::aes256gcm; }
+
+    static bool
+    set_key(
+      key_state& state
+    , byte selection
+    , session_key const& key
+    )
+    noexcept {
+      if (selection != ids::aes256gcm || !is_available()) {
+        return false;
+      }
+      return crypto_aead_aes256gcm_beforenm(&state, &key[0]) == 0;
+    }
+
+    static bool
+    encrypt(
+      key_state const& state
+    , byte* ciphertext
+    , byte* mac
+    , byte const* message
+    , std::size_t length
+    , nonce const& nonce
+    )
+    noexcept {
+      return
+        crypto_aead_aes256gcm_encrypt_detached_afternm(
+          ciphertext
+        , mac
+        , nullptr
+        , message
+        , length
+        , nullptr
+        , 0
+        , nullptr
+        , &nonce[0]
+        , &state
+        )
+        == 0
+      ;
+    }
+
+    static bool
+    decrypt(
+      key_state const& state
+    , byte* message
+    , byte const* ciphertext
+    , byte const* mac
+    , std::size_t length
+    , nonce const& nonce
+    )
+    noexcept {
+      return
+        crypto_aead_aes256gcm_decrypt_detached_afternm(
+          message
+        , nullptr
+        , ciphertext
+        , length
+        , mac
+        , nullptr
+        , 0
+        , &nonce[0]
+        , &state
+        )
+        == 0
+      ;
+    }
+  };
+
+  // Uses AES-256-GCM when both peers have hardware support for it, and
+  // XChaCha20-Poly1305 otherwise.
+  class automatic final {
+  public:
+    static_assert(
+      xchacha20poly1305_ietf::mac_size == aes256gcm::mac_size
+    , "mac size mismatch"
+    );
+
+    static constexpr std::size_t
+    mac_size = aes256gcm::mac_size;
+
+    static_assert(
+      std::is_trivial<aes256gcm::key_state>::value
+      && std::is_trivial<xchacha20poly1305_ietf::key_state>::value
+    , "key states must be trivial to share storage"
+    );
+
+    // Only the selected suite's state is ever set, so the two share storage
+    // and selection says which one is live. Both are trivial, so setting a
+    // key simply overwrites whichever was there.
+    struct key_state {
+      union {
+        aes256gcm::key_state aes;
+        xchacha20poly1305_ietf::key_state xchacha;
+      };
+      byte selection;
+    };
+
+    static byte
+    proposal() noexcept {
+      if (aes256gcm::is_available()) {
+        return ids::aes256gcm;
+      } else {
+        return ids::xchacha20poly1305_ietf;
+      }
+    }
+
+    static optional<byte>
+    select(byte proposal) noexcept {
+      if (auto selection = aes256gcm::select(proposal)) {
+        return selection;
+      } else {
+        // Anything that can speak AES-256-GCM here can also fall back
+        return ids::xchacha20poly1305_ietf;
+      }
+    }
+
+    static bool
+    accepts(byte selection) noexcept {
+      return
+        xchacha20poly1305_ietf::accepts(selection)
+        || (aes256gcm::accepts(selection) && aes256gcm::is_available())
+      ;
+    }
+
+    static bool
+    set_key(
+      key_state& state
+    , byte selection
+    , session_key const& key
+    )
+    noexcept {
+      state.selection = selection;
+      if (selection == ids::aes256gcm) {
+        return aes256gcm::set_key(state.aes, selection, key);
+      } else {
+        return xchacha20poly1305_ietf::set_key(state.xchacha, selection, key);
+      }
+    }
+
+    static bool
+    encrypt(
+      key_state const& state
+    , byte* ciphertext
+    , byte* mac
+    , byte const* message
+    , std::size_t length
+    , nonce const& nonce
+    )
+    noexcept {
+      if (state.selection == ids::aes256gcm) {
+        return aes256gcm::encrypt(state.aes, ciphertext, mac, message, length, nonce);
+      } else {
+        return xchacha20poly1305_ietf::encrypt(state.xchacha, ciphertext, mac, message, length, nonce);
+      }
+    }
+
+    static bool
+    decrypt(
+      key_state const& state
+    , byte* message
+    , byte const* ciphertext
+    , byte const* mac
+    , std::size_t length
+    , nonce const& nonce
+    )
+    noexcept {
+      if (state.selection == ids::aes256gcm) {
+        return aes256gcm::decrypt(state.aes, message, ciphertext, mac, length, nonce);
+      } else {
+        return xchacha20poly1305_ietf::decrypt(state.xchacha, message, ciphertext, mac, length, nonce);
+      }
+    }
+  };
+}}
+
+#endif
@@ -30,6 +30,9 @@ namespace asio_sodium {
   using byte = unsigned char;
   using public_key = std::array<byte, crypto_box_PUBLICKEYBYTES>;
   using private_key = std::array<byte, crypto_box_SECRETKEYBYTES>;
+  using shared_key = std::array<byte, crypto_box_BEFORENMBYTES>;
+  using shared_point = std::array<byte, crypto_scalarmult_BYTES>;
+  using session_key = std::array<byte, crypto_kx_SESSIONKEYBYTES>;
   using nonce = std::array<byte, crypto_box_NONCEBYTES>;
   using message_authentication_code = std::array<byte, crypto_box_MACBYTES>;
   using public_key_span = gsl::span<byte, crypto_box_PUBLICKEYBYTES>;
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_6943d4f9_a34a_45fa_b5b6_d12061a2e9f9
+#define ASIO_SODIUM_6943d4f9_a34a_45fa_b5b6_d12061a2e9f9
+
+#include <asio/io_service.hpp>
+#include <asio/post.hpp>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace asio_sodium {
+  // Threads for crypto work that is too heavy to run on an io_service thread,
+  // such as the chunks of a large message (see
+  // crypto_stream::set_crypto_pool). Work runs in no particular order and
+  // reports back to the connection's executor. The pool must outlive every
+  // stream that uses it, and its destructor waits for queued work to finish.
+  class crypto_pool final {
+  public:
+    explicit
+    crypto_pool(
+      std::size_t thread_count = default_thread_count()
+    ) {
+      if (thread_count == 0) {
+        thread_count = 1;
+      }
+      threads_.reserve(thread_count);
+      for (std::size_t i = 0; i < thread_count; ++i) {
+        threads_.emplace_back([this] { io_.run(); });
+      }
+    }
+
+    crypto_pool(crypto_pool const&) = delete;
+    crypto_pool& operator=(crypto_pool const&) = delete;
+
+    ~crypto_pool() {
+      work_.reset();
+      for (auto& thread : threads_) {
+        thread.join();
+      }
+    }
+
+    static std::size_t
+    default_thread_count() noexcept {
+      auto const cores = std::thread::hardware_concurrency();
+      return cores == 0 ? 1 : cores;
+    }
+
+    std::size_t
+    size() const noexcept { return threads_.size(); }
+
+    // The number of functions posted so far
+    std::size_t
+    jobs_posted() const noexcept { return jobs_posted_; }
+
+    // Runs function() on one of the pool's threads. Its storage comes from the
+    // function's associated allocator.
+    template <typename Function>
+    void
+    post(Function&& function) {
+      ++jobs_posted_;
+      asio::post(io_, std::forward<Function>(function));
+    }
+
+  private:
+    std::atomic<std::size_t> jobs_posted_{0};
+    asio::io_service io_;
+    std::unique_ptr<asio::io_service::work> work_ =
+      std::make_unique<asio::io_service::work>(io_)
+    ;
+    std::vector<std::thread> threads_;
+  };
+}
+
+#endif
@@ -14,207 +14,39 @@
  * limitations under the License.
  */
 
+
 #ifndef ASIO_SODIUM_101d0035_8812_49b9_9964_c98446206ed3
 #define ASIO_SODIUM_101d0035_8812_49b9_9964_c98446206ed3
 
+#include "bound_stream.hpp"
+#include "crypto_stream.hpp"
 #include "detail/asio_types.hpp"
-#include "detail/client_handshake.hpp"
-#include "detail/message_reader.hpp"
-#include "detail/message_writer.hpp"
-#include "detail/server_handshake.hpp"
-#include "detail/session_data.hpp"
-#include "detail/tuple_index_sequence.hpp"
-
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-local-typedef"
-#include <asio/basic_socket_acceptor.hpp>
-#pragma clang diagnostic pop
-
-#include <asio/io_service.hpp>
 
 namespace asio_sodium {
-  class crypto_socket final {
-  public:
-    using socket_type = detail::socket_type;
-    using endpoint_type = detail::endpoint_type;
-
-    template <
-      typename OnError
-    , typename OnSuccess
+  // A crypto_stream over a generic stream socket, so one type serves TCP,
+  // local, and any other stream protocol. Use crypto_stream directly with a
+  // concrete socket type to avoid the generic endpoint indirection.
+  template <typename CipherSuite>
+  using basic_crypto_socket = crypto_stream<detail::socket_type, CipherSuite>;
+
+  // Negotiates AES-256-GCM when both peers support it in hardware, and
+  // XChaCha20-Poly1305 otherwise
+  using crypto_socket = basic_crypto_socket<cipher_suites::automatic>;
+
+  // Allocates connection state from a per-io_service slab (see storage.hpp)
+  using pooled_crypto_socket =
+    crypto_stream<
+      detail::socket_type
+    , cipher_suites::automatic
+    , pooled_storage
     >
-    static void
-    async_connect(
-      endpoint_type endpoint
-    , asio::io_service& io
-    , public_key const& remote_public_key
-    , public_key const& local_public_key
-    , private_key const& local_private_key
-    , OnSuccess on_success
-    , OnError on_error
-    ) {
-      auto movable = std::make_unique<movable_data>(
-        std::piecewise_construct
-      , socket_type(io)
-      , std::forward_as_tuple(
-          remote_public_key
-        , local_public_key
-        , local_private_key
-        )
-      );
-
-      auto& session = movable->session;
-      auto& socket = movable->socket;
-      auto on_handshake =
-        [ movable = std::move(movable)
-        , on_success = std::move(on_success)
-        ] ()
-        mutable {
-          on_success(crypto_socket(std::move(movable)));
-        }
-      ;
-      detail::client_handshake<decltype(on_handshake), OnError>(
-        std::move(endpoint)
-      , session
-      , socket
-      , std::move(on_handshake)
-      , std::move(on_error)
-      )();
-    }
-
-    template <
-      // TODO - need a concept to check that the protocol guarantees in-order
-      // delivery
-      typename AsioProtocol
-    , typename Authenticator
-    , typename OnSuccess
-    , typename OnError
-    >
-    static void
-    async_accept(
-      asio::io_service& io
-    , asio::basic_socket_acceptor<AsioProtocol>& acceptor
-    , public_key const& local_public_key
-    , private_key const& local_private_key
-    , Authenticator authenticator
-    , OnSuccess on_success
-    , OnError on_error
-    ) {
-      auto movable = std::make_unique<movable_data>(
-        std::piecewise_construct
-      , socket_type(io)
-      , std::forward_as_tuple(
-          local_public_key
-        , local_private_key
-        )
-      );
-
-      auto& session = movable->session;
-      auto& socket = movable->socket;
-      auto on_handshake =
-        [ movable = std::move(movable)
-        , on_success = std::move(on_success)
-        ] ()
-        mutable {
-          on_success(crypto_socket(std::move(movable)));
-        }
-      ;
-      auto on_accept =
-        detail::server_handshake<
-          Authenticator, decltype(on_handshake), OnError
-        >(
-          session
-        , socket
-        , std::move(authenticator)
-        , std::move(on_handshake)
-        , std::move(on_error)
-        )
-      ;
-      acceptor.async_accept(
-        socket
-      , std::move(on_accept)
-      );
-    }
-
-    template <
-      typename ReadHandler
-    >
-    void
-    async_read(
-      gsl::span<byte> buffer
-    , ReadHandler&& handler
-    ) {
-      detail::message_reader<ReadHandler>(
-        buffer
-      , movable_->socket
-      , movable_->session
-      , std::forward<ReadHandler>(handler)
-      )();
-    }
-
-    template <
-      typename WriteHandler
-    >
-    void
-    async_write_destructive(
-      gsl::span<byte> buffer
-    , WriteHandler&& handler
-    ) {
-      detail::message_writer<WriteHandler>(
-        buffer
-      , movable_->socket
-      , movable_->session
-      , std::forward<WriteHandler>(handler)
-      )();
-    }
-
-  private:
-    struct movable_data {
-      template <typename CryptoArgs>
-      explicit movable_data(
-        std::piecewise_construct_t
-      , socket_type&& socket_
-      , CryptoArgs&& crypto_args_
-      )
-        : movable_data(
-            std::move(socket_)
-          , std::move(crypto_args_)
-          , detail::tuple_index_sequence<CryptoArgs>()
-          )
-      {}
-
-      socket_type socket;
-      detail::session_data session;
-
-    private:
-      template <
-        typename ...CryptoArgs
-      , std::size_t ...CryptoIndices
-      >
-      explicit movable_data(
-        socket_type&& socket_
-      , std::tuple<CryptoArgs...>&& crypto_args_
-      , std::index_sequence<CryptoIndices...>
-      )
-        : socket(std::move(socket_))
-        , session(
-            std::forward<CryptoArgs>(
-              std::get<CryptoIndices>(crypto_args_)
-            )...
-          )
-      {}
-
-    };
-
-    crypto_socket(
-      std::unique_ptr<movable_data> movable
-    )
-      : movable_(std::move(movable))
-    {}
+  ;
 
-    // This is essential so that asio async callbacks don't end up with a
-    // dangling socket reference if this instance is moved.
-    std::unique_ptr<movable_data> movable_;
-  };
+  // Runs every continuation on a per-connection strand, for io_services run
+  // from several threads (see bound_stream.hpp)
+  using strand_crypto_socket =
+    crypto_stream<strand_stream<detail::socket_type>>
+  ;
 }
 
 #endif
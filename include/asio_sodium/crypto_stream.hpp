@@ -0,0 +1,1466 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_1a66d08b_1021_4cfb_a364_9eaad8fa37e3
+#define ASIO_SODIUM_1a66d08b_1021_4cfb_a364_9eaad8fa37e3
+
+
+#include "cipher_suites.hpp"
+#include "crypto_pool.hpp"
+#include "local_identity.hpp"
+#include "pooled_message.hpp"
+#include "resumption.hpp"
+#include "storage.hpp"
+#include "detail/chunked_writer.hpp"
+#include "detail/client_handshake.hpp"
+#include "detail/message_reader.hpp"
+#include "detail/message_writer.hpp"
+#include "detail/read_buffers.hpp"
+#include "detail/server_handshake.hpp"
+#include "detail/session_data.hpp"
+#include "detail/stream_reader.hpp"
+#include "detail/stream_writer.hpp"
+#include "detail/tuple_index_sequence.hpp"
+#include "detail/write_queue.hpp"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/basic_socket_acceptor.hpp>
+#pragma clang diagnostic pop
+
+#include <asio/async_result.hpp>
+#include <asio/bind_executor.hpp>
+#include <asio/io_service.hpp>
+
+#include <type_traits>
+
+namespace asio_sodium {
+  // An encrypted, authenticated message stream layered over any asio
+  // AsyncStream (a socket, a local socket, an in-process pipe, another stream
+  // wrapper...), in the same way as asio::ssl::stream. Streams come out of one
+  // of the handshake functions fully established. Storage decides where the
+  // per-connection state is allocated (see storage.hpp). Every continuation
+  // runs through the next layer's executor, so a bound_stream next layer (see
+  // bound_stream.hpp) makes the whole connection safe on a multi-threaded
+  // io_service.
+  //
+  // Each asynchronous operation accepts either a handler or any asio
+  // completion token (use_future, use_awaitable, ...). The handshake
+  // functions also have overloads taking separate success and error
+  // callbacks.
+  template <
+    typename NextLayer
+  , typename CipherSuite = cipher_suites::automatic
+  , typename Storage = heap_storage
+  >
+  class crypto_stream final {
+  public:
+    using next_layer_type = typename std::remove_reference<NextLayer>::type;
+    using cipher_suite_type = CipherSuite;
+    using storage_type = Storage;
+
+    // Connects the next layer (which must be constructible from the
+    // io_service, with a socket as its lowest layer) and then runs the client
+    // handshake. Completes with (error_code, crypto_stream); the stream is
+    // empty if the connection or the handshake failed.
+    template <
+      typename Endpoint
+    , typename ConnectToken
+    >
+    static auto
+    async_connect(
+      Endpoint const& endpoint
+    , asio::io_service& io
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , ConnectToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          ConnectToken, void(std::error_code, crypto_stream)
+        >(
+          [&io](
+            auto&& handler
+          , Endpoint const& endpoint_arg
+          , public_key const& remote_public_key_arg
+          , shared_identity identity_arg
+          ) {
+            start_connect(
+              endpoint_arg
+            , io
+            , remote_public_key_arg
+            , std::move(identity_arg)
+            , nullptr
+            , gsl::span<byte const>()
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , endpoint
+        , remote_public_key
+        , std::move(identity)
+        )
+      ;
+    }
+
+    // Accepts a connection into the next layer's lowest layer and then runs
+    // the server handshake. Completes with (error_code, crypto_stream).
+    template <
+      // TODO - need a concept to check that the protocol guarantees in-order
+      // delivery
+      typename AsioProtocol
+    , typename Authenticator
+    , typename AcceptToken
+    >
+    static auto
+    async_accept(
+      asio::io_service& io
+    , asio::basic_socket_acceptor<AsioProtocol>& acceptor
+    , shared_identity identity
+    , Authenticator authenticator
+    , AcceptToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          AcceptToken, void(std::error_code, crypto_stream)
+        >(
+          [&io, &acceptor](
+            auto&& handler
+          , shared_identity identity_arg
+          , Authenticator authenticator_arg
+          ) {
+            start_accept(
+              io
+            , acceptor
+            , std::move(identity_arg)
+            , std::move(authenticator_arg)
+            , nullptr
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , std::move(identity)
+        , std::move(authenticator)
+        )
+      ;
+    }
+
+    // Runs the client handshake over a stream that is already connected.
+    // Completes with (error_code, crypto_stream).
+    template <
+      typename HandshakeToken
+    >
+    static auto
+    async_client_handshake(
+      next_layer_type&& next_layer
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , HandshakeToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          HandshakeToken, void(std::error_code, crypto_stream)
+        >(
+          [](
+            auto&& handler
+          , next_layer_type&& next_layer_arg
+          , public_key const& remote_public_key_arg
+          , shared_identity identity_arg
+          ) {
+            start_client_handshake(
+              std::move(next_layer_arg)
+            , remote_public_key_arg
+            , std::move(identity_arg)
+            , nullptr
+            , gsl::span<byte const>()
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , std::move(next_layer)
+        , remote_public_key
+        , std::move(identity)
+        )
+      ;
+    }
+
+    // Like async_connect, but resumes the session that issued ticket (see
+    // get_resumption_ticket) instead of running a full key exchange. The
+    // client falls back to a full handshake if the ticket has expired; if the
+    // server rejects it, the operation fails with error::handshake_ticket and
+    // the caller should connect again without it. The ticket is only read
+    // while the operation starts.
+    template <
+      typename Endpoint
+    , typename ConnectToken
+    >
+    static auto
+    async_resume(
+      Endpoint const& endpoint
+    , asio::io_service& io
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , resumption_ticket const& ticket
+    , ConnectToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          ConnectToken, void(std::error_code, crypto_stream)
+        >(
+          [&io, &ticket](
+            auto&& handler
+          , Endpoint const& endpoint_arg
+          , public_key const& remote_public_key_arg
+          , shared_identity identity_arg
+          ) {
+            start_connect(
+              endpoint_arg
+            , io
+            , remote_public_key_arg
+            , std::move(identity_arg)
+            , &ticket
+            , gsl::span<byte const>()
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , endpoint
+        , remote_public_key
+        , std::move(identity)
+        )
+      ;
+    }
+
+    // Like async_client_handshake, but resumes a session (see async_resume)
+    template <
+      typename HandshakeToken
+    >
+    static auto
+    async_client_resume(
+      next_layer_type&& next_layer
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , resumption_ticket const& ticket
+    , HandshakeToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          HandshakeToken, void(std::error_code, crypto_stream)
+        >(
+          [&ticket](
+            auto&& handler
+          , next_layer_type&& next_layer_arg
+          , public_key const& remote_public_key_arg
+          , shared_identity identity_arg
+          ) {
+            start_client_handshake(
+              std::move(next_layer_arg)
+            , remote_public_key_arg
+            , std::move(identity_arg)
+            , &ticket
+            , gsl::span<byte const>()
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , std::move(next_layer)
+        , remote_public_key
+        , std::move(identity)
+        )
+      ;
+    }
+
+    // Like async_connect (or async_resume, given a ticket), but sends
+    // early_data in the same flight as the hello, so the server's first read
+    // returns it a round trip before the client could otherwise have sent it.
+    // Early data is at most 16 KiB and is copied when the operation starts.
+    // An attacker who captured the flight can replay it, so early data should
+    // only carry requests that are safe to repeat.
+    template <
+      typename Endpoint
+    , typename ConnectToken
+    >
+    static auto
+    async_connect_early(
+      Endpoint const& endpoint
+    , asio::io_service& io
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , resumption_ticket const* ticket
+    , gsl::span<byte const> early_data
+    , ConnectToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          ConnectToken, void(std::error_code, crypto_stream)
+        >(
+          [&io, ticket, early_data](
+            auto&& handler
+          , Endpoint const& endpoint_arg
+          , public_key const& remote_public_key_arg
+          , shared_identity identity_arg
+          ) {
+            start_connect(
+              endpoint_arg
+            , io
+            , remote_public_key_arg
+            , std::move(identity_arg)
+            , ticket
+            , early_data
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , endpoint
+        , remote_public_key
+        , std::move(identity)
+        )
+      ;
+    }
+
+    // Like async_client_handshake, but with a ticket (if not nullptr) and
+    // early data (see async_connect_early)
+    template <
+      typename HandshakeToken
+    >
+    static auto
+    async_client_handshake_early(
+      next_layer_type&& next_layer
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , resumption_ticket const* ticket
+    , gsl::span<byte const> early_data
+    , HandshakeToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          HandshakeToken, void(std::error_code, crypto_stream)
+        >(
+          [ticket, early_data](
+            auto&& handler
+          , next_layer_type&& next_layer_arg
+          , public_key const& remote_public_key_arg
+          , shared_identity identity_arg
+          ) {
+            start_client_handshake(
+              std::move(next_layer_arg)
+            , remote_public_key_arg
+            , std::move(identity_arg)
+            , ticket
+            , early_data
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , std::move(next_layer)
+        , remote_public_key
+        , std::move(identity)
+        )
+      ;
+    }
+
+    // Runs the server handshake over a stream that is already connected.
+    // Completes with (error_code, crypto_stream).
+    template <
+      typename Authenticator
+    , typename HandshakeToken
+    >
+    static auto
+    async_server_handshake(
+      next_layer_type&& next_layer
+    , shared_identity identity
+    , Authenticator authenticator
+    , HandshakeToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          HandshakeToken, void(std::error_code, crypto_stream)
+        >(
+          [](
+            auto&& handler
+          , next_layer_type&& next_layer_arg
+          , shared_identity identity_arg
+          , Authenticator authenticator_arg
+          ) {
+            start_server_handshake(
+              std::move(next_layer_arg)
+            , std::move(identity_arg)
+            , std::move(authenticator_arg)
+            , nullptr
+            , detail::no_responder()
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , std::move(next_layer)
+        , std::move(identity)
+        , std::move(authenticator)
+        )
+      ;
+    }
+
+    // Like async_server_handshake, but once the client is authenticated the
+    // responder is called on the stream's executor as
+    // responder(gsl::span<byte const> early_data), with whatever early data
+    // the client sent (possibly none), and returns a std::vector<byte>. If it
+    // is not empty, it becomes the stream's first message and goes out in the
+    // same write as the handshake response. Early data given to the responder
+    // is not returned by the stream's first read.
+    template <
+      typename Authenticator
+    , typename Responder
+    , typename HandshakeToken
+    >
+    static auto
+    async_server_handshake_early(
+      next_layer_type&& next_layer
+    , shared_identity identity
+    , Authenticator authenticator
+    , Responder responder
+    , HandshakeToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          HandshakeToken, void(std::error_code, crypto_stream)
+        >(
+          [](
+            auto&& handler
+          , next_layer_type&& next_layer_arg
+          , shared_identity identity_arg
+          , Authenticator authenticator_arg
+          , Responder responder_arg
+          ) {
+            start_server_handshake(
+              std::move(next_layer_arg)
+            , std::move(identity_arg)
+            , std::move(authenticator_arg)
+            , nullptr
+            , std::move(responder_arg)
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , std::move(next_layer)
+        , std::move(identity)
+        , std::move(authenticator)
+        , std::move(responder)
+        )
+      ;
+    }
+
+    // Like async_accept and async_server_handshake above, but the handshake's
+    // public-key crypto runs on the pool (see server_handshake), which must
+    // outlive the handshake
+    template <
+      typename AsioProtocol
+    , typename Authenticator
+    , typename AcceptToken
+    >
+    static auto
+    async_accept(
+      crypto_pool& pool
+    , asio::io_service& io
+    , asio::basic_socket_acceptor<AsioProtocol>& acceptor
+    , shared_identity identity
+    , Authenticator authenticator
+    , AcceptToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          AcceptToken, void(std::error_code, crypto_stream)
+        >(
+          [&pool, &io, &acceptor](
+            auto&& handler
+          , shared_identity identity_arg
+          , Authenticator authenticator_arg
+          ) {
+            start_accept(
+              io
+            , acceptor
+            , std::move(identity_arg)
+            , std::move(authenticator_arg)
+            , &pool
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , std::move(identity)
+        , std::move(authenticator)
+        )
+      ;
+    }
+
+    template <
+      typename Authenticator
+    , typename HandshakeToken
+    >
+    static auto
+    async_server_handshake(
+      crypto_pool& pool
+    , next_layer_type&& next_layer
+    , shared_identity identity
+    , Authenticator authenticator
+    , HandshakeToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          HandshakeToken, void(std::error_code, crypto_stream)
+        >(
+          [&pool](
+            auto&& handler
+          , next_layer_type&& next_layer_arg
+          , shared_identity identity_arg
+          , Authenticator authenticator_arg
+          ) {
+            start_server_handshake(
+              std::move(next_layer_arg)
+            , std::move(identity_arg)
+            , std::move(authenticator_arg)
+            , &pool
+            , detail::no_responder()
+            , make_handler_completion(std::forward<decltype(handler)>(handler))
+            );
+          }
+        , token
+        , std::move(next_layer)
+        , std::move(identity)
+        , std::move(authenticator)
+        )
+      ;
+    }
+
+    // The callback forms of the above. on_success receives the established
+    // crypto_stream, and on_error receives the error_code (plus the bytes
+    // transferred, on the server side).
+    template <
+      typename Endpoint
+    , typename OnError
+    , typename OnSuccess
+    >
+    static void
+    async_connect(
+      Endpoint const& endpoint
+    , asio::io_service& io
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      start_connect(
+        endpoint
+      , io
+      , remote_public_key
+      , std::move(identity)
+      , nullptr
+      , gsl::span<byte const>()
+      , make_callback_completion(std::move(on_success), std::move(on_error))
+      );
+    }
+
+    template <
+      typename AsioProtocol
+    , typename Authenticator
+    , typename OnSuccess
+    , typename OnError
+    >
+    static void
+    async_accept(
+      asio::io_service& io
+    , asio::basic_socket_acceptor<AsioProtocol>& acceptor
+    , shared_identity identity
+    , Authenticator authenticator
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      start_accept(
+        io
+      , acceptor
+      , std::move(identity)
+      , std::move(authenticator)
+      , nullptr
+      , make_callback_completion(std::move(on_success), std::move(on_error))
+      );
+    }
+
+    template <
+      typename OnError
+    , typename OnSuccess
+    >
+    static void
+    async_client_handshake(
+      next_layer_type&& next_layer
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      start_client_handshake(
+        std::move(next_layer)
+      , remote_public_key
+      , std::move(identity)
+      , nullptr
+      , gsl::span<byte const>()
+      , make_callback_completion(std::move(on_success), std::move(on_error))
+      );
+    }
+
+    template <
+      typename Authenticator
+    , typename OnSuccess
+    , typename OnError
+    >
+    static void
+    async_server_handshake(
+      next_layer_type&& next_layer
+    , shared_identity identity
+    , Authenticator authenticator
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      start_server_handshake(
+        std::move(next_layer)
+      , std::move(identity)
+      , std::move(authenticator)
+      , nullptr
+      , detail::no_responder()
+      , make_callback_completion(std::move(on_success), std::move(on_error))
+      );
+    }
+
+    template <
+      typename AsioProtocol
+    , typename Authenticator
+    , typename OnSuccess
+    , typename OnError
+    >
+    static void
+    async_accept(
+      crypto_pool& pool
+    , asio::io_service& io
+    , asio::basic_socket_acceptor<AsioProtocol>& acceptor
+    , shared_identity identity
+    , Authenticator authenticator
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      start_accept(
+        io
+      , acceptor
+      , std::move(identity)
+      , std::move(authenticator)
+      , &pool
+      , make_callback_completion(std::move(on_success), std::move(on_error))
+      );
+    }
+
+    template <
+      typename Authenticator
+    , typename OnSuccess
+    , typename OnError
+    >
+    static void
+    async_server_handshake(
+      crypto_pool& pool
+    , next_layer_type&& next_layer
+    , shared_identity identity
+    , Authenticator authenticator
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      start_server_handshake(
+        std::move(next_layer)
+      , std::move(identity)
+      , std::move(authenticator)
+      , &pool
+      , detail::no_responder()
+      , make_callback_completion(std::move(on_success), std::move(on_error))
+      );
+    }
+
+    // Each of these copies the keypair into a new identity for the connection.
+    // Prefer the shared_identity overloads when making many connections.
+    template <
+      typename Endpoint
+    , typename OnError
+    , typename OnSuccess
+    >
+    static void
+    async_connect(
+      Endpoint const& endpoint
+    , asio::io_service& io
+    , public_key const& remote_public_key
+    , public_key const& local_public_key
+    , private_key const& local_private_key
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      async_connect(
+        endpoint
+      , io
+      , remote_public_key
+      , make_identity(local_public_key, local_private_key)
+      , std::move(on_success)
+      , std::move(on_error)
+      );
+    }
+
+    template <
+      typename AsioProtocol
+    , typename Authenticator
+    , typename OnSuccess
+    , typename OnError
+    >
+    static void
+    async_accept(
+      asio::io_service& io
+    , asio::basic_socket_acceptor<AsioProtocol>& acceptor
+    , public_key const& local_public_key
+    , private_key const& local_private_key
+    , Authenticator authenticator
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      async_accept(
+        io
+      , acceptor
+      , make_identity(local_public_key, local_private_key)
+      , std::move(authenticator)
+      , std::move(on_success)
+      , std::move(on_error)
+      );
+    }
+
+    template <
+      typename OnError
+    , typename OnSuccess
+    >
+    static void
+    async_client_handshake(
+      next_layer_type&& next_layer
+    , public_key const& remote_public_key
+    , public_key const& local_public_key
+    , private_key const& local_private_key
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      async_client_handshake(
+        std::move(next_layer)
+      , remote_public_key
+      , make_identity(local_public_key, local_private_key)
+      , std::move(on_success)
+      , std::move(on_error)
+      );
+    }
+
+    template <
+      typename Authenticator
+    , typename OnSuccess
+    , typename OnError
+    >
+    static void
+    async_server_handshake(
+      next_layer_type&& next_layer
+    , public_key const& local_public_key
+    , private_key const& local_private_key
+    , Authenticator authenticator
+    , OnSuccess on_success
+    , OnError on_error
+    ) {
+      async_server_handshake(
+        std::move(next_layer)
+      , make_identity(local_public_key, local_private_key)
+      , std::move(authenticator)
+      , std::move(on_success)
+      , std::move(on_error)
+      );
+    }
+
+    // Occupancy of the io_service's connection slab when Storage is
+    // pooled_storage
+    static pool_statistics
+    statistics(asio::io_service& io) {
+      return Storage::template statistics<movable_data>(io);
+    }
+
+    next_layer_type&
+    next_layer() noexcept { return movable_->next_layer; }
+
+    next_layer_type const&
+    next_layer() const noexcept { return movable_->next_layer; }
+
+    // The ticket the server issued during the client handshake, or nullptr if
+    // it issued none. Pass it to async_resume to skip the key exchange on the
+    // next connection; it remains owned by the stream, so copy it out first
+    // if the stream will not outlive that call.
+    resumption_ticket const*
+    get_resumption_ticket() const noexcept {
+      return movable_->session.ticket.get();
+    }
+
+    // Sets the pool that encrypts the chunks of async_write_chunked and
+    // decrypts the chunks of incoming chunked messages (nullptr to do both on
+    // the stream's executor). The pool must outlive the stream's operations.
+    void
+    set_crypto_pool(crypto_pool* pool) noexcept {
+      movable_->session.read_state.pool = pool;
+      movable_->session.write_state.pool = pool;
+    }
+
+    // Completes with (error_code, bytes read)
+    template <
+      typename ReadToken
+    >
+    auto
+    async_read(
+      gsl::span<byte> buffer
+    , ReadToken&& token
+    ) {
+      return
+        asio::async_initiate<ReadToken, void(std::error_code, std::size_t)>(
+          initiate_read{movable_.get()}
+        , token
+        , detail::fixed_read_buffer(buffer)
+        )
+      ;
+    }
+
+    // Decrypts the next message into a buffer from the stream's receive pool
+    // and completes with (error_code, pooled_message). The storage is sized to
+    // the message once its header arrives, and it returns to the pool when the
+    // last copy of the pooled_message goes away.
+    template <
+      typename ReadToken
+    >
+    auto
+    async_read(
+      ReadToken&& token
+    ) {
+      if (!movable_->read_pool) {
+        movable_->read_pool = std::make_shared<detail::buffer_pool>();
+      }
+      return
+        asio::async_initiate<
+          ReadToken, void(std::error_code, pooled_message)
+        >(
+          initiate_read{movable_.get()}
+        , token
+        , detail::pooled_read_buffer(movable_->read_pool)
+        )
+      ;
+    }
+
+    // Calls provider(uint32_t length) for the message's storage once its
+    // header has been decrypted, then completes with (error_code,
+    // gsl::span<byte>) covering exactly the decrypted message. A span shorter
+    // than length fails the read with error::message_too_large.
+    template <
+      typename Provider
+    , typename ReadToken
+    >
+    auto
+    async_read_with_provider(
+      Provider provider
+    , ReadToken&& token
+    ) {
+      return
+        asio::async_initiate<
+          ReadToken, void(std::error_code, gsl::span<byte>)
+        >(
+          initiate_read{movable_.get()}
+        , token
+        , detail::provided_read_buffer<Provider>(std::move(provider))
+        )
+      ;
+    }
+
+    // Completes with (error_code, bytes written)
+    template <
+      typename WriteToken
+    >
+    auto
+    async_write_destructive(
+      gsl::span<byte> buffer
+    , WriteToken&& token
+    ) {
+      return
+        asio::async_initiate<WriteToken, void(std::error_code, std::size_t)>(
+          [movable = movable_.get()](
+            auto&& handler
+          , gsl::span<byte> buffer_arg
+          ) {
+            using handler_type =
+              typename std::decay<decltype(handler)>::type
+            ;
+            detail::message_writer<CipherSuite, next_layer_type, handler_type>(
+              buffer_arg
+            , movable->next_layer
+            , movable->session.write_state
+            , handler_type(std::forward<decltype(handler)>(handler))
+            )();
+          }
+        , token
+        , buffer
+        )
+      ;
+    }
+
+    // Like async_write_destructive, but may be called again before earlier
+    // writes complete. Messages queued while a write is in progress are
+    // encrypted and sent together in one gather write, and each operation
+    // completes once its message has been written. Don't mix this with
+    // async_write_destructive on the same stream.
+    template <
+      typename WriteToken
+    >
+    auto
+    async_queue_write_destructive(
+      gsl::span<byte> buffer
+    , WriteToken&& token
+    ) {
+      return
+        asio::async_initiate<WriteToken, void(std::error_code, std::size_t)>(
+          [movable = movable_.get()](
+            auto&& handler
+          , gsl::span<byte> buffer_arg
+          ) {
+            movable->write_queue.enqueue(
+              buffer_arg
+            , std::forward<decltype(handler)>(handler)
+            );
+          }
+        , token
+        , buffer
+        )
+      ;
+    }
+
+    // Leaves the buffer untouched by encrypting into a per-connection pooled
+    // buffer, which is recycled once the write completes. Like
+    // async_queue_write_destructive, this may be called while other queued
+    // writes are in progress.
+    template <
+      typename WriteToken
+    >
+    auto
+    async_write(
+      gsl::span<byte const> buffer
+    , WriteToken&& token
+    ) {
+      return
+        asio::async_initiate<WriteToken, void(std::error_code, std::size_t)>(
+          [movable = movable_.get()](
+            auto&& handler
+          , gsl::span<byte const> buffer_arg
+          ) {
+            movable->write_queue.enqueue_copy(
+              buffer_arg
+            , std::forward<decltype(handler)>(handler)
+            );
+          }
+        , token
+        , buffer
+        )
+      ;
+    }
+
+    // Like async_write_destructive, but sends the message as independently
+    // authenticated chunks, which are encrypted on the stream's crypto pool
+    // (if it has one) while earlier chunks are being sent. Any of the read
+    // operations can receive a chunked message, and a reading stream with a
+    // crypto pool decrypts its chunks there. Meant for very large messages;
+    // don't mix this with the queued writes on the same stream. Completes
+    // with (error_code, bytes written).
+    template <
+      typename WriteToken
+    >
+    auto
+    async_write_chunked(
+      gsl::span<byte> buffer
+    , WriteToken&& token
+    ) {
+      return
+        asio::async_initiate<WriteToken, void(std::error_code, std::size_t)>(
+          [movable = movable_.get()](
+            auto&& handler
+          , gsl::span<byte> buffer_arg
+          ) {
+            using handler_type =
+              typename std::decay<decltype(handler)>::type
+            ;
+            detail::chunked_writer<CipherSuite, next_layer_type, handler_type>(
+              buffer_arg
+            , movable->next_layer
+            , movable->session.write_state
+            , handler_type(std::forward<decltype(handler)>(handler))
+            )();
+          }
+        , token
+        , buffer
+        )
+      ;
+    }
+
+    // Sends a payload of any length without holding it in memory. The source
+    // is called as source(gsl::span<byte>) with at most 64 KiB to fill and
+    // returns how many bytes it filled (std::size_t); returning 0 ends the
+    // stream. Each chunk is encrypted while the previous one is being sent.
+    // The peer must receive it with async_read_stream. Like
+    // async_write_chunked, don't mix this with the queued writes on the same
+    // stream. Completes with (error_code, total bytes written).
+    template <
+      typename Source
+    , typename WriteToken
+    >
+    auto
+    async_write_stream(
+      Source source
+    , WriteToken&& token
+    ) {
+      return
+        asio::async_initiate<WriteToken, void(std::error_code, uint64_t)>(
+          [movable = movable_.get()](auto&& handler, Source source_arg) {
+            using handler_type =
+              typename std::decay<decltype(handler)>::type
+            ;
+            detail::stream_writer<
+              CipherSuite
+            , next_layer_type
+            , Source
+            , handler_type
+            >(
+              std::move(source_arg)
+            , movable->next_layer
+            , movable->session.write_state
+            , handler_type(std::forward<decltype(handler)>(handler))
+            )();
+          }
+        , token
+        , std::move(source)
+        )
+      ;
+    }
+
+    // Receives a stream sent with async_write_stream. The sink is called as
+    // sink(gsl::span<byte>) with each decrypted chunk in order; the span is
+    // only valid during the call. Fails with error::message_kind if the next
+    // message isn't a stream. Completes with (error_code, total bytes read).
+    //
+    // Any error leaves the connection unusable, error::message_kind included:
+    // by the time the header's kind is known, the header has been read and
+    // its nonce used, so the message behind it can't be read any other way.
+    // The one exception is early data still waiting from the handshake, which
+    // fails the call before anything is read and stays pending for async_read.
+    template <
+      typename Sink
+    , typename ReadToken
+    >
+    auto
+    async_read_stream(
+      Sink sink
+    , ReadToken&& token
+    ) {
+      return
+        asio::async_initiate<ReadToken, void(std::error_code, uint64_t)>(
+          [movable = movable_.get()](auto&& handler, Sink sink_arg) {
+            using handler_type =
+              typename std::decay<decltype(handler)>::type
+            ;
+            detail::stream_reader<
+              CipherSuite
+            , next_layer_type
+            , Sink
+            , handler_type
+            >(
+              std::move(sink_arg)
+            , movable->next_layer
+            , movable->session.read_state
+            , handler_type(std::forward<decltype(handler)>(handler))
+            )();
+          }
+        , token
+        , std::move(sink)
+        )
+      ;
+    }
+
+  private:
+    struct movable_data {
+      template <typename CryptoArgs>
+      explicit movable_data(
+        std::piecewise_construct_t
+      , next_layer_type&& next_layer_
+      , CryptoArgs&& crypto_args_
+      )
+        : movable_data(
+            std::move(next_layer_)
+          , std::move(crypto_args_)
+          , detail::tuple_index_sequence<CryptoArgs>()
+          )
+      {}
+
+      next_layer_type next_layer;
+      detail::session_data<CipherSuite> session;
+      detail::write_queue<CipherSuite, next_layer_type> write_queue;
+      // Created by the first pooled read
+      std::shared_ptr<detail::buffer_pool> read_pool;
+
+    private:
+      template <
+        typename ...CryptoArgs
+      , std::size_t ...CryptoIndices
+      >
+      explicit movable_data(
+        next_layer_type&& next_layer_
+      , std::tuple<CryptoArgs...>&& crypto_args_
+      , std::index_sequence<CryptoIndices...>
+      )
+        : next_layer(std::move(next_layer_))
+        , session(
+            std::forward<CryptoArgs>(
+              std::get<CryptoIndices>(crypto_args_)
+            )...
+          )
+        , write_queue(next_layer, session.write_state)
+      {}
+
+    };
+
+    using movable_pointer =
+      typename Storage::template pointer<movable_data>
+    ;
+
+    // A handshake reports to a single completion. These own the connection
+    // state while the handshake runs and hand it over as a crypto_stream once
+    // the session is established.
+    template <
+      typename OnSuccess
+    , typename OnError
+    >
+    class callback_completion final {
+    public:
+      callback_completion(
+        OnSuccess&& on_success
+      , OnError&& on_error
+      )
+        : on_success_(std::move(on_success))
+        , on_error_(std::move(on_error))
+      {}
+
+      void
+      operator()() {
+        on_success_(crypto_stream(std::move(movable)));
+      }
+
+      template <typename ...Details>
+      void
+      operator()(
+        std::error_code ec
+      , Details... details
+      ) {
+        on_error_(ec, details...);
+      }
+
+      movable_pointer movable;
+
+    private:
+      OnSuccess on_success_;
+      OnError on_error_;
+    };
+
+    template <typename Handler>
+    class handler_completion final {
+    public:
+      explicit
+      handler_completion(
+        Handler&& handler
+      )
+        : handler_(std::move(handler))
+      {}
+
+      void
+      operator()() {
+        handler_(std::error_code(), crypto_stream(std::move(movable)));
+      }
+
+      template <typename ...Details>
+      void
+      operator()(
+        std::error_code ec
+      , Details...
+      ) {
+        handler_(ec, crypto_stream(movable_pointer()));
+      }
+
+      movable_pointer movable;
+
+    private:
+      Handler handler_;
+    };
+
+    template <
+      typename OnSuccess
+    , typename OnError
+    >
+    static callback_completion<OnSuccess, OnError>
+    make_callback_completion(
+      OnSuccess&& on_success
+    , OnError&& on_error
+    ) {
+      return {std::move(on_success), std::move(on_error)};
+    }
+
+    template <typename Handler>
+    static auto
+    make_handler_completion(
+      Handler&& handler
+    ) {
+      using handler_type = typename std::decay<Handler>::type;
+      return
+        handler_completion<handler_type>(
+          handler_type(std::forward<Handler>(handler))
+        )
+      ;
+    }
+
+    // Reads the next message, with ReadBuffer deciding where it goes
+    struct initiate_read {
+      movable_data* movable;
+
+      template <
+        typename ReadHandler
+      , typename ReadBuffer
+      >
+      void
+      operator()(
+        ReadHandler&& handler
+      , ReadBuffer&& read_buffer
+      ) const {
+        using handler_type = typename std::decay<ReadHandler>::type;
+        using buffer_type = typename std::decay<ReadBuffer>::type;
+        detail::message_reader<
+          CipherSuite, next_layer_type, handler_type, buffer_type
+        >(
+          std::forward<ReadBuffer>(read_buffer)
+        , movable->next_layer
+        , movable->session.read_state
+        , handler_type(std::forward<ReadHandler>(handler))
+        )();
+      }
+    };
+
+    static asio::io_service&
+    io_service_of(next_layer_type& next_layer) noexcept {
+      return
+        static_cast<asio::io_service&>(
+          next_layer.lowest_layer().get_executor().context()
+        )
+      ;
+    }
+
+    template <
+      typename Endpoint
+    , typename Completion
+    >
+    static void
+    start_connect(
+      Endpoint const& endpoint
+    , asio::io_service& io
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , resumption_ticket const* ticket
+    , gsl::span<byte const> early_data
+    , Completion&& completion
+    ) {
+      completion.movable = Storage::template make<movable_data>(
+        io
+      , std::piecewise_construct
+      , next_layer_type(io)
+      , std::forward_as_tuple(
+          remote_public_key
+        , std::move(identity)
+        )
+      );
+
+      auto& next_layer = completion.movable->next_layer;
+      auto executor = next_layer.get_executor();
+      // The handshake reports a connect error the same way as its own
+      next_layer.lowest_layer().async_connect(
+        endpoint
+      , asio::bind_executor(
+          executor
+        , make_client_handshake(std::move(completion), ticket, early_data)
+        )
+      );
+    }
+
+    template <
+      typename AsioProtocol
+    , typename Authenticator
+    , typename Completion
+    >
+    static void
+    start_accept(
+      asio::io_service& io
+    , asio::basic_socket_acceptor<AsioProtocol>& acceptor
+    , shared_identity identity
+    , Authenticator authenticator
+    , crypto_pool* pool
+    , Completion&& completion
+    ) {
+      completion.movable = Storage::template make<movable_data>(
+        io
+      , std::piecewise_construct
+      , next_layer_type(io)
+      , std::forward_as_tuple(std::move(identity))
+      );
+
+      auto& next_layer = completion.movable->next_layer;
+      auto executor = next_layer.get_executor();
+      acceptor.async_accept(
+        next_layer.lowest_layer()
+      , asio::bind_executor(
+          executor
+        , make_server_handshake(
+            std::move(authenticator)
+          , pool
+          , std::move(completion)
+          )
+        )
+      );
+    }
+
+    template <typename Completion>
+    static void
+    start_client_handshake(
+      next_layer_type&& next_layer
+    , public_key const& remote_public_key
+    , shared_identity identity
+    , resumption_ticket const* ticket
+    , gsl::span<byte const> early_data
+    , Completion&& completion
+    ) {
+      auto& io = io_service_of(next_layer);
+      completion.movable = Storage::template make<movable_data>(
+        io
+      , std::piecewise_construct
+      , std::move(next_layer)
+      , std::forward_as_tuple(
+          remote_public_key
+        , std::move(identity)
+        )
+      );
+      make_client_handshake(std::move(completion), ticket, early_data)();
+    }
+
+    template <
+      typename Authenticator
+    , typename Responder
+    , typename Completion
+    >
+    static void
+    start_server_handshake(
+      next_layer_type&& next_layer
+    , shared_identity identity
+    , Authenticator authenticator
+    , crypto_pool* pool
+    , Responder responder
+    , Completion&& completion
+    ) {
+      auto& io = io_service_of(next_layer);
+      completion.movable = Storage::template make<movable_data>(
+        io
+      , std::piecewise_construct
+      , std::move(next_layer)
+      , std::forward_as_tuple(std::move(identity))
+      );
+      make_server_handshake(
+        std::move(authenticator)
+      , pool
+      , std::move(completion)
+      , std::move(responder)
+      )();
+    }
+
+    template <typename Completion>
+    static auto
+    make_client_handshake(
+      Completion&& completion
+    , resumption_ticket const* ticket
+    , gsl::span<byte const> early_data
+    ) {
+      using completion_type = typename std::decay<Completion>::type;
+      auto& session = completion.movable->session;
+      auto& next_layer = completion.movable->next_layer;
+      return
+        detail::client_handshake<
+          CipherSuite, next_layer_type, completion_type
+        >(
+          session
+        , next_layer
+        , std::move(completion)
+        , ticket
+        , early_data
+        )
+      ;
+    }
+
+    template <
+      typename Authenticator
+    , typename Completion
+    , typename Responder = detail::no_responder
+    >
+    static auto
+    make_server_handshake(
+      Authenticator authenticator
+    , crypto_pool* pool
+    , Completion&& completion
+    , Responder responder = Responder()
+    ) {
+      using completion_type = typename std::decay<Completion>::type;
+      auto& session = completion.movable->session;
+      auto& next_layer = completion.movable->next_layer;
+      return
+        detail::server_handshake<
+          CipherSuite
+        , next_layer_type
+        , Authenticator
+        , completion_type
+        , Responder
+        >(
+          session
+        , next_layer
+        , std::move(authenticator)
+        , std::move(completion)
+        , pool
+        , std::move(responder)
+        )
+      ;
+    }
+
+    crypto_stream(
+      movable_pointer movable
+    )
+      : movable_(std::move(movable))
+    {}
+
+    // This is essential so that asio async callbacks don't end up with a
+    // dangling stream reference if this instance is moved.
+    movable_pointer movable_;
+  };
+}
+
+#endif
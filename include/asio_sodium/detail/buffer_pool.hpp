@@ -0,0 +1,292 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ASIO_SODIUM_07efe63a_03b2_4d52_8b8e_0501ef9a8151
+#define ASIO_SODIUM_07efe63a_03b2_4d52_8b8e_0501ef9a8151
+
+#include "../crypto.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // Value-initializes nothing, so resizing a buffer that is about to be
+  // overwritten with ciphertext or read into doesn't zero it first
+  template <typename T>
+  class default_init_allocator : public std::allocator<T> {
+  public:
+    template <typename U>
+    struct rebind {
+      using other = default_init_allocator<U>;
+    };
+
+    default_init_allocator() noexcept = default;
+
+    template <typename U>
+    default_init_allocator(default_init_allocator<U> const&) noexcept {}
+
+    template <typename U>
+    void
+    construct(U* p) noexcept(std::is_nothrow_default_constructible<U>::value) {
+      ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void
+    construct(U* p, Args&&... args) {
+      ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+  };
+
+  // Recycles message-sized buffers so that steady-state traffic reuses the
+  // same few allocations. Released buffers keep their capacity, and acquire
+  // prefers the smallest retained buffer that is already large enough. The
+  // pool retains at most max_retained buffers holding at most
+  // max_retained_bytes between them, so one huge message isn't kept around.
+  //
+  // It also recycles fixed-size blocks for pool_allocator, which lets a shared
+  // buffer and its reference count live in one recycled allocation. Pooled
+  // messages can be dropped on any thread, so everything is synchronized.
+  //
+  // Nothing is allocated up front; the owners also create their pools lazily,
+  // so a connection that never copies a write or reads a pooled message pays
+  // for neither.
+  class buffer_pool final {
+  public:
+    using buffer = std::vector<byte, default_init_allocator<byte>>;
+
+    static constexpr std::size_t
+    default_max_retained = 16;
+
+    static constexpr std::size_t
+    default_max_retained_bytes = 4 * 1024 * 1024;
+
+    explicit
+    buffer_pool(
+      std::size_t max_retained = default_max_retained
+    , std::size_t max_retained_bytes = default_max_retained_bytes
+    )
+      : max_retained_(max_retained)
+      , max_retained_bytes_(max_retained_bytes)
+    {}
+
+    buffer_pool(buffer_pool const&) = delete;
+    buffer_pool& operator=(buffer_pool const&) = delete;
+
+    ~buffer_pool() {
+      for (auto const& kept : blocks_) {
+        ::operator delete(kept.memory);
+      }
+    }
+
+    buffer
+    acquire(std::size_t size) {
+      std::unique_lock<std::mutex> lock{mutex_};
+      if (retained_.empty()) {
+        lock.unlock();
+        buffer result;
+        result.resize(size);
+        return result;
+      }
+
+      auto best = retained_.end();
+      for (auto it = retained_.begin(); it != retained_.end(); ++it) {
+        if (
+          it->capacity() >= size
+          && (best == retained_.end() || it->capacity() < best->capacity())
+        ) {
+          best = it;
+        }
+      }
+      if (best == retained_.end()) {
+        // Nothing fits, so grow the largest one
+        best =
+          std::max_element(
+            retained_.begin()
+          , retained_.end()
+          , [](buffer const& a, buffer const& b) {
+              return a.capacity() < b.capacity();
+            }
+          )
+        ;
+      }
+
+      buffer result = std::move(*best);
+      if (best != retained_.end() - 1) {
+        *best = std::move(retained_.back());
+      }
+      retained_.pop_back();
+      retained_bytes_ -= result.capacity();
+      lock.unlock();
+      result.resize(size);
+      return result;
+    }
+
+    void
+    release(buffer&& released) noexcept {
+      std::lock_guard<std::mutex> lock{mutex_};
+      auto const capacity = released.capacity();
+      if (
+        retained_.size() < max_retained_
+        && capacity <= max_retained_bytes_ - retained_bytes_
+      ) {
+        try {
+          retained_.push_back(std::move(released));
+          retained_bytes_ += capacity;
+        } catch (...) {
+          // The buffer is simply freed instead
+        }
+      }
+    }
+
+    std::size_t
+    retained() const {
+      std::lock_guard<std::mutex> lock{mutex_};
+      return retained_.size();
+    }
+
+    std::size_t
+    retained_bytes() const {
+      std::lock_guard<std::mutex> lock{mutex_};
+      return retained_bytes_;
+    }
+
+    void*
+    allocate_block(std::size_t size) {
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (auto& kept : blocks_) {
+          if (kept.size == size) {
+            auto const memory = kept.memory;
+            kept = blocks_.back();
+            blocks_.pop_back();
+            return memory;
+          }
+        }
+      }
+      return ::operator new(size);
+    }
+
+    void
+    deallocate_block(void* memory, std::size_t size) noexcept {
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (blocks_.size() < max_retained_) {
+          try {
+            blocks_.push_back({memory, size});
+            return;
+          } catch (...) {
+            // Fall through and free it
+          }
+        }
+      }
+      ::operator delete(memory);
+    }
+
+  private:
+    struct block {
+      void* memory;
+      std::size_t size;
+    };
+
+    mutable std::mutex mutex_;
+    std::size_t max_retained_;
+    std::size_t max_retained_bytes_;
+    std::size_t retained_bytes_ = 0;
+    std::vector<buffer> retained_;
+    std::vector<block> blocks_;
+  };
+
+  // Allocates from a shared buffer_pool's blocks. Used with allocate_shared,
+  // it puts a buffer and its control block in one recycled allocation, and
+  // destroying the buffer hands its storage back to the pool.
+  template <typename T>
+  class pool_allocator final {
+  public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+      using other = pool_allocator<U>;
+    };
+
+    explicit
+    pool_allocator(
+      std::shared_ptr<buffer_pool> pool
+    ) noexcept
+      : pool_(std::move(pool))
+    {}
+
+    template <typename U>
+    pool_allocator(
+      pool_allocator<U> const& other
+    ) noexcept
+      : pool_(other.pool_)
+    {}
+
+    T*
+    allocate(std::size_t n) {
+      return static_cast<T*>(pool_->allocate_block(n * sizeof(T)));
+    }
+
+    void
+    deallocate(T* p, std::size_t n) noexcept {
+      pool_->deallocate_block(p, n * sizeof(T));
+    }
+
+    template <typename U, typename... Args>
+    void
+    construct(U* p, Args&&... args) {
+      ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    void
+    destroy(buffer_pool::buffer* p) noexcept {
+      using buffer = buffer_pool::buffer;
+      pool_->release(std::move(*p));
+      p->~buffer();
+    }
+
+    template <typename U>
+    void
+    destroy(U* p) noexcept { p->~U(); }
+
+    template <typename U>
+    bool
+    operator==(pool_allocator<U> const& other) const noexcept {
+      return pool_ == other.pool_;
+    }
+
+    template <typename U>
+    bool
+    operator!=(pool_allocator<U> const& other) const noexcept {
+      return pool_ != other.pool_;
+    }
+
+  private:
+    template <typename U>
+    friend class pool_allocator;
+
+    std::shared_ptr<buffer_pool> pool_;
+  };
+}}
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_7adc2a11_baef_4bb9_bfb0_b4adc1b32b88
+#define ASIO_SODIUM_7adc2a11_baef_4bb9_bfb0_b4adc1b32b88
+
+#include "../errors.hpp"
+
+#include "message_chunks.hpp"
+#include "message_header.hpp"
+#include "message_nonce.hpp"
+#include "session_data.hpp"
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/post.hpp>
+#include <asio/write.hpp>
+
+#include <array>
+#include <new>
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // Encrypts a message in place as independently authenticated chunks (see
+  // message_chunks.hpp) and writes it. With a crypto pool on the write half,
+  // every chunk is handed to the pool at once and each frame goes out as soon
+  // as it and the frames before it are ready, so the socket sends early chunks
+  // while later ones are still being encrypted. Without a pool, the next chunk
+  // is encrypted on this thread while the previous one is being written.
+  //
+  // Like message_writer, calling the writer moves it into the write half's
+  // operation memory. From then on it only runs on the stream's executor, and
+  // it completes once the last frame is written and no chunk is still on the
+  // pool.
+  template <
+    typename CipherSuite
+  , typename Stream
+  , typename Resumable
+  >
+  class chunked_writer final {
+    using mac_type = std::array<byte, CipherSuite::mac_size>;
+
+    struct step {
+      chunked_writer* writer;
+
+      using allocator_type = handler_allocator<void>;
+
+      allocator_type
+      get_allocator() const noexcept {
+        return writer->get_allocator();
+      }
+
+      void
+      operator()(
+        std::error_code ec
+      , std::size_t
+      ) const {
+        writer->written(ec);
+      }
+    };
+
+  public:
+    using allocator_type = handler_allocator<void>;
+
+    explicit
+    chunked_writer(
+      gsl::span<byte> message
+    , Stream& stream
+    , write_half<CipherSuite>& state
+    , Resumable&& resumable
+    )
+      : message_(message)
+      , stream_(stream)
+      , state_(state)
+      , resumable_(std::move(resumable))
+    {}
+
+    chunked_writer(chunked_writer&&) = default;
+
+    void
+    operator()() {
+      auto& memory = state_.operation;
+      auto const block = memory.allocate(sizeof(chunked_writer));
+      chunked_writer* writer;
+      try {
+        writer = new (block) chunked_writer(std::move(*this));
+      } catch (...) {
+        memory.deallocate(block);
+        throw;
+      }
+      // Everything else happens on the stream's executor, which is also where
+      // the pool reports back
+      asio::post(stream_.get_executor(), [writer] { writer->start(); });
+    }
+
+    allocator_type
+    get_allocator() const noexcept {
+      return allocator_type(state_.memory);
+    }
+
+  private:
+    void
+    start() {
+      result_ = prepare();
+      if (!result_ && state_.pool != nullptr) {
+        for (std::size_t i = 0; i < chunk_count_; ++i) {
+          encrypt_on_pool(i);
+        }
+      }
+      pump();
+    }
+
+    // Encrypts the header and reserves a nonce for every chunk
+    std::error_code
+    prepare() {
+      if (message_.size() > message_header<CipherSuite>::max_message_length) {
+        return error::message_too_large;
+      }
+
+      nonce header_nonce;
+      chunk_count_ = message_chunk_count(
+        static_cast<std::size_t>(message_.size())
+      );
+      if (
+        !next_message_nonce(
+          state_.base_nonce
+        , state_.counter
+        , header_nonce
+        )
+        ||
+        !reserve_message_nonces(
+          state_.counter
+        , chunk_count_
+        , first_chunk_counter_
+        )
+      ) {
+        return error::message_nonce_exhausted;
+      }
+
+      message_header<CipherSuite> header(state_.header_buffer);
+      header.set_message_length(
+        static_cast<uint32_t>(message_.size())
+      , message_kind::chunked
+      );
+      if (!header.encrypt_to(header_nonce, state_.key)) {
+        return error::message_header_encrypt;
+      }
+
+      macs_.resize(chunk_count_);
+      ready_.resize(chunk_count_);
+      return {};
+    }
+
+    void
+    encrypt_on_pool(std::size_t index) {
+      ++chunks_pending_;
+      typename CipherSuite::key_state const& key = state_.key;
+      // The work guard keeps the stream's io_service from running out of work
+      // while the chunk is away
+      state_.pool->post(make_allocated_job(
+        [ writer = this
+        , work = asio::make_work_guard(stream_.get_executor())
+        , &key
+        , &base_nonce = state_.base_nonce
+        , counter = first_chunk_counter_ + index
+        , chunk = message_chunk(message_, index)
+        , mac = &macs_[index][0]
+        , index
+        , &jobs = state_.jobs
+        ]() {
+          auto const encrypted = encrypt_message_chunk<CipherSuite>(
+            key
+          , base_nonce
+          , counter
+          , chunk
+          , mac
+          );
+          asio::post(
+            work.get_executor()
+          , make_allocated_job(
+              [writer, index, encrypted] {
+                writer->chunk_encrypted(index, encrypted);
+              }
+            , jobs
+            )
+          );
+        }
+      , state_.jobs
+      ));
+    }
+
+    void
+    chunk_encrypted(
+      std::size_t index
+    , bool encrypted
+    ) {
+      --chunks_pending_;
+      if (!encrypted && !result_) {
+        result_ = error::message_encrypt;
+      }
+      ready_[index] = true;
+      pump();
+    }
+
+    void
+    written(std::error_code ec) {
+      writing_ = false;
+      if (ec) {
+        if (!result_) {
+          result_ = ec;
+        }
+      } else {
+        header_sent_ = true;
+        next_frame_ = sending_end_;
+      }
+      pump();
+    }
+
+    // Starts the next write if the stream is free, and completes once
+    // nothing is left to do
+    void
+    pump() {
+      if (!result_) {
+        write_ready_frames();
+        if (state_.pool == nullptr && encrypted_ < chunk_count_) {
+          // Encrypt one chunk ahead, so that it overlaps the write in flight
+          auto const index = encrypted_++;
+          if (
+            encrypt_message_chunk<CipherSuite>(
+              state_.key
+            , state_.base_nonce
+            , first_chunk_counter_ + index
+            , message_chunk(message_, index)
+            , &macs_[index][0]
+            )
+          ) {
+            ready_[index] = true;
+            write_ready_frames();
+          } else {
+            result_ = error::message_encrypt;
+          }
+        }
+      }
+
+      auto const finished = result_ || next_frame_ == chunk_count_;
+      if (finished && !writing_ && chunks_pending_ == 0) {
+        complete(
+          result_
+        , result_ ? 0 : static_cast<std::size_t>(message_.size())
+        );
+      }
+    }
+
+    // Writes the header (if it hasn't gone out yet) and every consecutive
+    // ready frame in one gather write
+    void
+    write_ready_frames() {
+      if (writing_) {
+        return;
+      }
+      frames_.clear();
+      if (!header_sent_) {
+        frames_.push_back(asio::buffer(state_.header_buffer));
+      }
+      sending_end_ = next_frame_;
+      while (sending_end_ < chunk_count_ && ready_[sending_end_]) {
+        auto const chunk = message_chunk(message_, sending_end_);
+        frames_.push_back(asio::buffer(macs_[sending_end_]));
+        frames_.push_back(
+          asio::buffer(chunk.data(), static_cast<std::size_t>(chunk.size()))
+        );
+        ++sending_end_;
+      }
+      if (frames_.empty()) {
+        return;
+      }
+      writing_ = true;
+      asio::async_write(
+        stream_
+      , frames_
+      , step{this}
+      );
+    }
+
+    // Releases the operation memory before invoking the handler, so that the
+    // handler can start the next write in the same block
+    void
+    complete(
+      std::error_code ec
+    , std::size_t bytes
+    ) {
+      auto resumable = std::move(resumable_);
+      auto& memory = state_.operation;
+      this->~chunked_writer();
+      memory.deallocate(this);
+      resumable(ec, bytes);
+    }
+
+    gsl::span<byte> message_;
+    Stream& stream_;
+    write_half<CipherSuite>& state_;
+    Resumable resumable_;
+    std::vector<mac_type> macs_;
+    std::vector<bool> ready_;
+    std::vector<asio::const_buffer> frames_;
+    std::size_t chunk_count_ = 0;
+    uint64_t first_chunk_counter_ = 0;
+    std::size_t encrypted_ = 0;
+    std::size_t chunks_pending_ = 0;
+    std::size_t next_frame_ = 0;
+    std::size_t sending_end_ = 0;
+    std::error_code result_;
+    bool header_sent_ = false;
+    bool writing_ = false;
+  };
+}}
+
+#endif
@@ -18,9 +18,9 @@
 #define ASIO_SODIUM_46c5462e_db6a_4c1d_904f_9b6966425e8a
 
 #include "../errors.hpp"
-#include "asio_types.hpp"
 #include "handshake_hello.hpp"
 #include "handshake_response.hpp"
+#include "handshake_state.hpp"
 #include "session_data.hpp"
 
 #pragma clang diagnostic push
@@ -34,30 +34,60 @@
 #include <asio/write.hpp>
 #pragma clang diagnostic pop
 
+#include <array>
+#include <chrono>
+#include <memory>
+
 #include <asio/yield.hpp>
 
 namespace asio_sodium {
 namespace detail {
+  // Runs the client side of the handshake over an already connected stream.
+  // The completion is called with no arguments once the session is
+  // established, or with the error_code if the handshake fails.
+  //
+  // Given a resumption ticket that hasn't expired, the client resumes the
+  // session it came from instead of running the key exchange (see
+  // handshake_ticket.hpp). Either way, a ticket the server issues ends up in
+  // the session.
+  //
+  // Early data is sealed under a key derived from the response key and sent
+  // in the same write as the hello (see early_data.hpp), so the server can
+  // act on it a round trip sooner. It is copied, so the caller's buffer may go
+  // away once the handshake is constructed.
   template <
-    typename OnSuccess
-  , typename OnError
+    typename CipherSuite
+  , typename Stream
+  , typename Completion
   >
   class client_handshake : asio::coroutine {
   public:
     explicit
     client_handshake(
-      endpoint_type&& endpoint
-    , session_data& session
-    , socket_type& socket
-    , OnSuccess on_success
-    , OnError on_error
+      session_data<CipherSuite>& session
+    , Stream& stream
+    , Completion completion
+    , resumption_ticket const* ticket = nullptr
+    , gsl::span<byte const> early_data = {}
     )
-      : endpoint_(std::move(endpoint))
-      , session_(session)
-      , socket_(socket)
-      , on_success_(std::move(on_success))
-      , on_error_(std::move(on_error))
-    {}
+      : session_(session)
+      , stream_(stream)
+      , transient_(std::make_unique<handshake_state>())
+      , completion_(std::move(completion))
+    {
+      if (
+        ticket != nullptr
+        && ticket->expiry > std::chrono::system_clock::now()
+      ) {
+        transient_->hello_flags = static_cast<byte>(hello_kind::resume);
+        resume_hello(transient_->resume_buffer).set_ticket(ticket->sealed);
+        transient_->resumption_secret = ticket->secret;
+      }
+      if (!early_data.empty()) {
+        transient_->hello_flags |= early_data_flag;
+        transient_->early_frame.assign(early_data.begin(), early_data.end());
+      }
+    }
 
     void
     operator()(
@@ -65,40 +95,49 @@ namespace detail {
     , std::size_t = 0
     ) {
       if (ec) {
-        on_error_(ec);
+        completion_(ec);
         return;
       }
 
       reenter (this) {
-        yield connect();
-        ec = make_hello();
+        ec = transient_->resuming() ? make_resume_hello() : make_hello();
+        if (!ec && transient_->has_early_data()) {
+          ec = seal_early_data();
+        }
         if (ec) {
-          on_error_(ec);
+          completion_(ec);
           yield break;
         }
         yield send_hello();
         yield await_hello_response();
         ec = process_hello_response();
         if (ec) {
-          on_error_(ec);
+          completion_(ec);
           yield break;
         }
-        on_success_();
+        transient_.reset();
+        completion_();
       }
     }
 
   private:
-    void connect() {
-      socket_.async_connect(endpoint_, std::move(*this));
-    }
-
     std::error_code
     make_hello()
     noexcept {
-      handshake_hello hello(session_.hello_buffer);
-      hello.set_public_key(session_.local_public_key);
+      if (
+        !transient_->precompute_shared_key(
+          session_.remote_public_key
+        , session_.identity->get_private_key()
+        )
+      ) {
+        return error::handshake_shared_key;
+      }
+
+      handshake_hello hello(transient_->hello_buffer);
+      hello.set_public_key(session_.identity->get_public_key());
       hello.generate_reply_nonce();
-      hello.copy_reply_nonce(session_.decrypt_nonce);
+      hello.set_cipher_suite(CipherSuite::proposal());
+      hello.copy_reply_nonce(session_.read_state.base_nonce);
       if (!hello.encrypt_to(session_.remote_public_key)) {
         return error::handshake_hello_encrypt;
       } else {
@@ -106,52 +145,139 @@ namespace detail {
       }
     }
 
+    // Leaves the key for the response in the shared key's place
+    std::error_code
+    make_resume_hello()
+    noexcept {
+      auto& reply_nonce = session_.read_state.base_nonce;
+      randombytes_buf(&reply_nonce[0], reply_nonce.size());
+      resume_hello hello(transient_->resume_buffer);
+      if (!hello.encrypt(transient_->resumption_secret, reply_nonce)) {
+        return error::handshake_hello_encrypt;
+      }
+      if (
+        !derive_resumption_key(
+          transient_->resumption_secret
+        , resumption_subkey::response
+        , transient_->shared_key
+        )
+      ) {
+        return error::handshake_shared_key;
+      }
+      return {};
+    }
+
+    // Expects the response key to be in the shared key's place
+    std::error_code
+    seal_early_data() {
+      auto& frame = transient_->early_frame;
+      if (
+        frame.size() > max_early_data_size
+        || !detail::seal_early_data(
+              transient_->shared_key
+            , session_.read_state.base_nonce
+            , frame
+            )
+      ) {
+        return error::handshake_early_data;
+      }
+      return {};
+    }
+
+    // The hello and any early data go out as a single gather write
     void
     send_hello()
     noexcept {
+      std::array<asio::const_buffer, 3> const buffers{{
+        asio::buffer(&transient_->hello_flags, sizeof(transient_->hello_flags))
+      , transient_->resuming()
+        ? asio::buffer(transient_->resume_buffer)
+        : asio::buffer(transient_->hello_buffer)
+      , asio::buffer(transient_->early_frame)
+      }};
       asio::async_write(
-        socket_
-      , asio::buffer(session_.hello_buffer)
+        stream_
+      , buffers
       , std::move(*this)
       );
     }
 
+    // A resumed response is preceded by the server's nonce
     void
     await_hello_response()
     noexcept {
+      auto const resumed = transient_->resuming() ? ~std::size_t(0) : 0;
+      std::array<asio::mutable_buffer, 2> const buffers{{
+        asio::buffer(transient_->server_nonce, resumed)
+      , asio::buffer(transient_->hello_response_buffer)
+      }};
       asio::async_read(
-        socket_
-      , asio::buffer(session_.hello_response_buffer)
+        stream_
+      , buffers
       , std::move(*this)
       );
     }
 
     std::error_code
-    process_hello_response()
-    noexcept {
+    process_hello_response() {
       auto response = handshake_response::decrypt(
-        session_.hello_response_buffer
-      , session_.decrypt_nonce
-      , session_.remote_public_key
-      , session_.local_private_key
+        transient_->hello_response_buffer
+      , transient_->resuming()
+        ? transient_->server_nonce
+        : session_.read_state.base_nonce
+      , transient_->shared_key
       );
 
       if (!response) {
         return error::handshake_response_decrypt;
       }
 
-      response->copy_reply_nonce(session_.encrypt_nonce);
-      response->copy_followup_nonce(session_.decrypt_nonce);
+      auto const cipher_suite = response->cipher_suite();
+      if (!CipherSuite::accepts(cipher_suite)) {
+        return error::handshake_cipher_suite;
+      }
+
+      response->copy_reply_nonce(session_.write_state.base_nonce);
+      response->copy_followup_nonce(session_.read_state.base_nonce);
+
+      auto const keys =
+        transient_->resuming()
+        ? session_.derive_resumed_session_keys(
+            cipher_suite
+          , transient_->resumption_secret
+          , transient_->server_nonce
+          , true
+          )
+        : session_.derive_session_keys(
+            cipher_suite
+          , transient_->shared_point
+          , true
+          )
+      ;
+      if (!keys) {
+        return error::handshake_session_keys;
+      }
+
+      auto const lifetime = response->ticket_lifetime();
+      if (lifetime > 0) {
+        session_.ticket = std::make_unique<resumption_ticket>();
+        response->copy_ticket(session_.ticket->sealed);
+        response->copy_ticket_secret(session_.ticket->secret);
+        session_.ticket->expiry =
+          std::chrono::system_clock::now() + std::chrono::seconds(lifetime)
+        ;
+      }
 
       return {};
     }
 
-    endpoint_type endpoint_;
-    session_data& session_;
-    socket_type& socket_;
-    OnSuccess on_success_;
-    OnError on_error_;
+    session_data<CipherSuite>& session_;
+    Stream& stream_;
+    std::unique_ptr<handshake_state> transient_;
+    Completion completion_;
   };
 }}
 
+#include <asio/unyield.hpp>
+
 #endif
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ASIO_SODIUM_a288344f_6ade_4941_a11c_79c8a1c53f14
+#define ASIO_SODIUM_a288344f_6ade_4941_a11c_79c8a1c53f14
+
+#include "../crypto.hpp"
+
+#include "endianness.hpp"
+
+#include <sodium.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // Set in the hello's leading byte (alongside its hello_kind) when an early
+  // data frame follows the hello
+  constexpr byte early_data_flag = 0x80;
+
+  // The server buffers early data before the session exists, so it is
+  // limited to what the receive buffer holds by default
+  constexpr std::size_t max_early_data_size = 16 * 1024;
+
+  // An early data frame is the payload's length in the clear, followed by a
+  // secretbox of the length and the payload. The box is keyed from the key
+  // that encrypts the handshake response, which the client knows before it
+  // sends the hello, and from the hello's random reply nonce. A full
+  // handshake's response key depends only on the two static keys, so without
+  // the nonce a captured frame would open after any later hello from the same
+  // client.
+  using early_length_buffer = std::array<byte, sizeof(uint32_t)>;
+
+  constexpr std::size_t
+  early_box_offset =
+    crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES
+  ;
+
+  // The size of the frame after its leading length
+  inline std::size_t
+  early_frame_size(uint32_t length) noexcept {
+    return early_box_offset + sizeof(uint32_t) + length;
+  }
+
+  inline bool
+  derive_early_data_key(
+    shared_key const& response_key
+  , nonce const& reply_nonce
+  , shared_key& result
+  )
+  noexcept {
+    static_assert(
+      std::tuple_size<shared_key>::value == crypto_generichash_KEYBYTES
+    , "The early data subkey must be usable as a hash key"
+    );
+    shared_key subkey;
+    auto const derived =
+      crypto_kdf_derive_from_key(
+        &subkey[0]
+      , subkey.size()
+      , 1
+      , "earlydat"
+      , &response_key[0]
+      )
+      == 0
+      && crypto_generichash(
+           &result[0]
+         , result.size()
+         , &reply_nonce[0]
+         , reply_nonce.size()
+         , &subkey[0]
+         , subkey.size()
+         )
+         == 0
+    ;
+    sodium_memzero(&subkey[0], subkey.size());
+    return derived;
+  }
+
+  inline uint32_t
+  early_data_length(early_length_buffer const& buffer) noexcept {
+    uint32_t length;
+    std::memcpy(&length, &buffer[0], sizeof(length));
+    return byte_swap_if_big_endian(length);
+  }
+
+  // frame must hold the plaintext payload on entry; on exit it holds the whole
+  // frame, length included
+  inline bool
+  seal_early_data(
+    shared_key const& response_key
+  , nonce const& reply_nonce
+  , std::vector<byte>& frame
+  ) {
+    auto const length = static_cast<uint32_t>(frame.size());
+    auto const wire_length = byte_swap_if_big_endian(length);
+    auto const box_offset = sizeof(uint32_t) + early_box_offset;
+    frame.resize(sizeof(uint32_t) + early_frame_size(length));
+    // The box's plaintext is the length followed by the payload
+    std::memmove(
+      &frame[box_offset + sizeof(uint32_t)]
+    , &frame[0]
+    , length
+    );
+    std::memcpy(&frame[box_offset], &wire_length, sizeof(wire_length));
+    std::memcpy(&frame[0], &wire_length, sizeof(wire_length));
+    auto const nonce = &frame[sizeof(uint32_t)];
+    randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
+
+    shared_key key;
+    auto const result =
+      derive_early_data_key(response_key, reply_nonce, key)
+      && crypto_secretbox_easy(
+           &frame[box_offset - crypto_secretbox_MACBYTES]
+         , &frame[box_offset]
+         , sizeof(uint32_t) + length
+         , nonce
+         , &key[0]
+         )
+         == 0
+    ;
+    sodium_memzero(&key[0], key.size());
+    return result;
+  }
+
+  // sealed is the frame after its leading length. On success, result holds
+  // the payload.
+  inline bool
+  open_early_data(
+    shared_key const& response_key
+  , nonce const& reply_nonce
+  , uint32_t length
+  , std::vector<byte> const& sealed
+  , std::vector<byte>& result
+  ) {
+    if (sealed.size() != early_frame_size(length)) {
+      return false;
+    }
+    std::vector<byte> opened(sizeof(uint32_t) + length);
+    shared_key key;
+    auto const opened_box =
+      derive_early_data_key(response_key, reply_nonce, key)
+      && crypto_secretbox_open_easy(
+           &opened[0]
+         , &sealed[crypto_secretbox_NONCEBYTES]
+         , sealed.size() - crypto_secretbox_NONCEBYTES
+         , &sealed[0]
+         , &key[0]
+         )
+         == 0
+    ;
+    sodium_memzero(&key[0], key.size());
+    if (!opened_box) {
+      return false;
+    }
+    // The length sent in the clear must match the one in the box
+    early_length_buffer inner;
+    std::copy_n(opened.begin(), inner.size(), inner.begin());
+    if (early_data_length(inner) != length) {
+      return false;
+    }
+    result.assign(opened.begin() + sizeof(uint32_t), opened.end());
+    return true;
+  }
+}}
+
+#endif
@@ -0,0 +1,310 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_c04abf4d_048c_4c53_8d10_ba3c7bccd92a
+#define ASIO_SODIUM_c04abf4d_048c_4c53_8d10_ba3c7bccd92a
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // Storage for the reader's or writer's own state while a message is in
+  // progress. The block grows to the largest operation seen (the size depends
+  // on the user's handler) and is kept for the next one, so in steady state no
+  // message allocates, whatever the handler. The capacity is kept in 32 bits
+  // so the whole thing is two words; anything larger is simply not kept.
+  class operation_memory final {
+  public:
+    operation_memory() noexcept = default;
+    operation_memory(operation_memory const&) = delete;
+    operation_memory& operator=(operation_memory const&) = delete;
+
+    ~operation_memory() {
+      ::operator delete(block_);
+    }
+
+    void*
+    allocate(std::size_t size) {
+      if (in_use_ || size > std::numeric_limits<std::uint32_t>::max()) {
+        return ::operator new(size);
+      }
+      if (size > capacity_) {
+        auto const grown = ::operator new(size);
+        ::operator delete(block_);
+        block_ = grown;
+        capacity_ = static_cast<std::uint32_t>(size);
+      }
+      in_use_ = true;
+      return block_;
+    }
+
+    void
+    deallocate(void* pointer, std::size_t = 0) noexcept {
+      if (pointer == block_) {
+        in_use_ = false;
+      } else {
+        ::operator delete(pointer);
+      }
+    }
+
+  private:
+    void* block_ = nullptr;
+    std::uint32_t capacity_ = 0;
+    bool in_use_ = false;
+  };
+
+  // A recycled block for asio's per-operation storage. The reader and writer
+  // each have at most one operation outstanding, and asio frees an operation's
+  // storage before invoking its handler, so one block, allocated on first use
+  // and grown to the largest operation asio asks for, serves every step of the
+  // message path without the session carrying worst-case inline storage.
+  using handler_memory = operation_memory;
+
+  // Storage for operations that can be outstanding several at a time (the
+  // write queue's). A freed block is kept along with its size, and the next
+  // allocation takes the first kept block that is large enough, so once a
+  // connection has seen its deepest queue, queueing a message doesn't allocate.
+  class block_recycler final {
+  public:
+    struct block {
+      void* memory;
+      std::size_t size;
+    };
+
+    block_recycler() noexcept = default;
+    block_recycler(block_recycler const&) = delete;
+    block_recycler& operator=(block_recycler const&) = delete;
+
+    ~block_recycler() {
+      for (auto const& kept : free_) {
+        ::operator delete(kept.memory);
+      }
+    }
+
+    block
+    allocate(std::size_t size) {
+      for (auto& kept : free_) {
+        if (kept.size >= size) {
+          auto const result = kept;
+          kept = free_.back();
+          free_.pop_back();
+          return result;
+        }
+      }
+      return {::operator new(size), size};
+    }
+
+    void
+    deallocate(block released) noexcept {
+      try {
+        free_.push_back(released);
+      } catch (...) {
+        ::operator delete(released.memory);
+      }
+    }
+
+  private:
+    std::vector<block> free_;
+  };
+
+  // Storage for the jobs a chunked message posts to a crypto_pool and for
+  // their completions. Several are outstanding at once, and each is allocated
+  // on one thread and freed on another, so freed blocks are kept (up to
+  // max_retained of them) under a lock for the next job of the same size. The
+  // free list is only created by the first job, so a connection that never
+  // chunks a message carries a single pointer for it.
+  class job_memory final {
+  public:
+    static constexpr std::size_t
+    max_retained = 16;
+
+    job_memory() noexcept = default;
+    job_memory(job_memory const&) = delete;
+    job_memory& operator=(job_memory const&) = delete;
+
+    ~job_memory() {
+      auto const kept = free_list_.load(std::memory_order_acquire);
+      if (kept) {
+        for (std::size_t i = 0; i < kept->retained; ++i) {
+          ::operator delete(kept->blocks[i].memory);
+        }
+        delete kept;
+      }
+    }
+
+    void*
+    allocate(std::size_t size) {
+      auto& kept = get_free_list();
+      {
+        std::lock_guard<std::mutex> lock{kept.mutex};
+        for (std::size_t i = 0; i < kept.retained; ++i) {
+          if (kept.blocks[i].size == size) {
+            auto const memory = kept.blocks[i].memory;
+            kept.blocks[i] = kept.blocks[--kept.retained];
+            return memory;
+          }
+        }
+      }
+      return ::operator new(size);
+    }
+
+    void
+    deallocate(void* pointer, std::size_t size) noexcept {
+      // Every block came from allocate, which created the free list first
+      auto& kept = *free_list_.load(std::memory_order_acquire);
+      {
+        std::lock_guard<std::mutex> lock{kept.mutex};
+        if (kept.retained < max_retained) {
+          kept.blocks[kept.retained++] = {pointer, size};
+          return;
+        }
+      }
+      ::operator delete(pointer);
+    }
+
+  private:
+    struct block {
+      void* memory;
+      std::size_t size;
+    };
+
+    struct free_list {
+      std::mutex mutex;
+      std::array<block, max_retained> blocks;
+      std::size_t retained = 0;
+    };
+
+    // Jobs and completions are allocated on the stream's thread and the
+    // pool's, so the first of them to get here may race with another
+    free_list&
+    get_free_list() {
+      auto existing = free_list_.load(std::memory_order_acquire);
+      if (existing) {
+        return *existing;
+      }
+      std::unique_ptr<free_list> created{new free_list};
+      if (
+        free_list_.compare_exchange_strong(
+          existing
+        , created.get()
+        , std::memory_order_acq_rel
+        , std::memory_order_acquire
+        )
+      ) {
+        return *created.release();
+      }
+      return *existing;
+    }
+
+    std::atomic<free_list*> free_list_{nullptr};
+  };
+
+  // The associated allocator that routes a handler's operation storage to its
+  // handler_memory (or job_memory)
+  template <typename T, typename Memory = handler_memory>
+  class handler_allocator final {
+  public:
+    using value_type = T;
+
+    explicit
+    handler_allocator(
+      Memory& memory
+    ) noexcept
+      : memory_(&memory)
+    {}
+
+    template <typename U>
+    handler_allocator(
+      handler_allocator<U, Memory> const& other
+    ) noexcept
+      : memory_(other.memory_)
+    {}
+
+    T*
+    allocate(std::size_t count) const {
+      return static_cast<T*>(memory_->allocate(sizeof(T) * count));
+    }
+
+    void
+    deallocate(T* pointer, std::size_t count) const noexcept {
+      memory_->deallocate(pointer, sizeof(T) * count);
+    }
+
+    template <typename U>
+    bool
+    operator==(handler_allocator<U, Memory> const& other) const noexcept {
+      return memory_ == other.memory_;
+    }
+
+    template <typename U>
+    bool
+    operator!=(handler_allocator<U, Memory> const& other) const noexcept {
+      return memory_ != other.memory_;
+    }
+
+  private:
+    template <typename, typename> friend class handler_allocator;
+
+    Memory* memory_;
+  };
+
+  // A function object posted with its storage taken from a job_memory
+  template <typename Function>
+  class allocated_job final {
+  public:
+    using allocator_type = handler_allocator<void, job_memory>;
+
+    allocated_job(
+      Function function
+    , job_memory& memory
+    )
+      : function_(std::move(function))
+      , memory_(&memory)
+    {}
+
+    allocator_type
+    get_allocator() const noexcept { return allocator_type(*memory_); }
+
+    void
+    operator()() { function_(); }
+
+  private:
+    Function function_;
+    job_memory* memory_;
+  };
+
+  template <typename Function>
+  allocated_job<typename std::decay<Function>::type>
+  make_allocated_job(
+    Function&& function
+  , job_memory& memory
+  ) {
+    return {std::forward<Function>(function), memory};
+  }
+}}
+
+#endif
@@ -47,10 +47,15 @@ namespace detail {
       public_key_offset + crypto_box_PUBLICKEYBYTES
     ;
 
+    static constexpr std::size_t
+    cipher_suite_offset =
+      reply_nonce_offset + crypto_box_NONCEBYTES
+    ;
+
   public:
     static constexpr std::size_t
     buffer_size =
-      reply_nonce_offset + crypto_box_NONCEBYTES
+      cipher_suite_offset + sizeof(byte)
     ;
 
     static constexpr std::size_t
@@ -93,6 +98,16 @@ namespace detail {
       return const_cast<handshake_hello_view&>(*this).reply_nonce_field();
     }
 
+    byte&
+    cipher_suite_field() noexcept {
+      return view_[cipher_suite_offset];
+    }
+
+    byte const&
+    cipher_suite_field() const noexcept {
+      return const_cast<handshake_hello_view&>(*this).cipher_suite_field();
+    }
+
   private:
     gsl::span<byte, buffer_size> view_;
   };
@@ -162,6 +177,16 @@ namespace detail {
       randombytes_buf(&reply_nonce[0], static_cast<std::size_t>(reply_nonce.size()));
     }
 
+    void
+    set_cipher_suite(byte proposal) noexcept {
+      view_.cipher_suite_field() = proposal;
+    }
+
+    byte
+    cipher_suite() const noexcept {
+      return view_.cipher_suite_field();
+    }
+
     constexpr public_key_span const
     client_public_key_span() const noexcept {
       return view_.public_key_field();
@@ -18,6 +18,8 @@
 #define ASIO_SODIUM_8a4c094b_6c1f_40d5_acb8_7b1652a8fde6
 
 #include "../crypto.hpp"
+#include "../resumption.hpp"
+#include "endianness.hpp"
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wundef"
@@ -32,6 +34,9 @@
 #include <optional.hpp>
 #pragma clang diagnostic pop
 
+#include <algorithm>
+#include <cstring>
+
 namespace asio_sodium {
 namespace detail {
   class handshake_response_view final {
@@ -43,10 +48,31 @@ namespace detail {
       reply_nonce_offset + crypto_box_NONCEBYTES
     ;
 
+    static constexpr std::size_t
+    cipher_suite_offset =
+      followup_nonce_offset + crypto_box_NONCEBYTES
+    ;
+
+    // A lifetime of zero means that no ticket follows
+    static constexpr std::size_t
+    ticket_lifetime_offset =
+      cipher_suite_offset + sizeof(byte)
+    ;
+
+    static constexpr std::size_t
+    ticket_offset =
+      ticket_lifetime_offset + sizeof(uint32_t)
+    ;
+
+    static constexpr std::size_t
+    ticket_secret_offset =
+      ticket_offset + sealed_ticket_size
+    ;
+
   public:
     static constexpr std::size_t
     buffer_size =
-      followup_nonce_offset + crypto_box_NONCEBYTES
+      ticket_secret_offset + crypto_kdf_KEYBYTES
     ;
 
     static constexpr std::size_t
@@ -82,7 +108,7 @@ namespace detail {
 
     constexpr nonce_span
     followup_nonce_field() noexcept {
-      return view_.last<crypto_box_NONCEBYTES>();
+      return view_.subspan<followup_nonce_offset, crypto_box_NONCEBYTES>();
     }
 
     constexpr nonce_span const
@@ -90,6 +116,46 @@ namespace detail {
       return const_cast<handshake_response_view&>(*this).followup_nonce_field();
     }
 
+    byte&
+    cipher_suite_field() noexcept {
+      return view_[cipher_suite_offset];
+    }
+
+    byte const&
+    cipher_suite_field() const noexcept {
+      return const_cast<handshake_response_view&>(*this).cipher_suite_field();
+    }
+
+    constexpr gsl::span<byte, sizeof(uint32_t)>
+    ticket_lifetime_field() noexcept {
+      return view_.subspan<ticket_lifetime_offset, sizeof(uint32_t)>();
+    }
+
+    constexpr gsl::span<byte, sizeof(uint32_t)> const
+    ticket_lifetime_field() const noexcept {
+      return const_cast<handshake_response_view&>(*this).ticket_lifetime_field();
+    }
+
+    constexpr gsl::span<byte, sealed_ticket_size>
+    ticket_field() noexcept {
+      return view_.subspan<ticket_offset, sealed_ticket_size>();
+    }
+
+    constexpr gsl::span<byte, sealed_ticket_size> const
+    ticket_field() const noexcept {
+      return const_cast<handshake_response_view&>(*this).ticket_field();
+    }
+
+    constexpr gsl::span<byte, crypto_kdf_KEYBYTES>
+    ticket_secret_field() noexcept {
+      return view_.subspan<ticket_secret_offset, crypto_kdf_KEYBYTES>();
+    }
+
+    constexpr gsl::span<byte, crypto_kdf_KEYBYTES> const
+    ticket_secret_field() const noexcept {
+      return const_cast<handshake_response_view&>(*this).ticket_secret_field();
+    }
+
   private:
     gsl::span<byte, buffer_size> view_;
   };
@@ -121,8 +187,7 @@ namespace detail {
     decrypt(
       buffer& data
     , nonce const& nonce
-    , public_key const& remote_key
-    , private_key const& private_key
+    , shared_key const& key
     )
     noexcept {
       handshake_response_view view{gsl::as_span(data)};
@@ -130,13 +195,12 @@ namespace detail {
       auto data_span = view.data_span();
 
       if (
-        crypto_box_open_easy(
+        crypto_box_open_easy_afternm(
           &data_span[0]
         , &full_span[0]
         , static_cast<std::size_t>(full_span.size())
         , &nonce[0]
-        , &remote_key[0]
-        , &private_key[0]
+        , &key[0]
         )
         == 0
       ) {
@@ -156,6 +220,16 @@ namespace detail {
       randombytes_buf(&followup_nonce[0], static_cast<std::size_t>(followup_nonce.size()));
     }
 
+    void
+    set_cipher_suite(byte selection) noexcept {
+      view_.cipher_suite_field() = selection;
+    }
+
+    byte
+    cipher_suite() const noexcept {
+      return view_.cipher_suite_field();
+    }
+
     constexpr nonce_span const
     reply_nonce_span() const noexcept {
       return view_.reply_nonce_field();
@@ -186,23 +260,63 @@ namespace detail {
       );
     }
 
+    void
+    set_ticket(
+      uint32_t lifetime
+    , sealed_ticket const& ticket
+    , session_key const& secret
+    ) noexcept {
+      lifetime = byte_swap_if_big_endian(lifetime);
+      std::memcpy(&view_.ticket_lifetime_field()[0], &lifetime, sizeof(lifetime));
+      std::copy(ticket.begin(), ticket.end(), view_.ticket_field().begin());
+      std::copy(secret.begin(), secret.end(), view_.ticket_secret_field().begin());
+    }
+
+    void
+    clear_ticket() noexcept {
+      auto lifetime = view_.ticket_lifetime_field();
+      auto ticket = view_.ticket_field();
+      auto secret = view_.ticket_secret_field();
+      std::fill(lifetime.begin(), lifetime.end(), byte(0));
+      std::fill(ticket.begin(), ticket.end(), byte(0));
+      std::fill(secret.begin(), secret.end(), byte(0));
+    }
+
+    // In seconds, or zero if the response carries no ticket
+    uint32_t
+    ticket_lifetime() const noexcept {
+      uint32_t lifetime;
+      std::memcpy(&lifetime, &view_.ticket_lifetime_field()[0], sizeof(lifetime));
+      return byte_swap_if_big_endian(lifetime);
+    }
+
+    void
+    copy_ticket(sealed_ticket& result) const noexcept {
+      auto ticket = view_.ticket_field();
+      std::copy(ticket.begin(), ticket.end(), result.begin());
+    }
+
+    void
+    copy_ticket_secret(session_key& result) const noexcept {
+      auto secret = view_.ticket_secret_field();
+      std::copy(secret.begin(), secret.end(), result.begin());
+    }
+
     bool
     encrypt_to(
       nonce const& nonce
-    , public_key const& remote_key
-    , private_key const& private_key
+    , shared_key const& key
     ) noexcept {
       auto full_span = view_.span();
       auto data_span = view_.data_span();
 
       return
-        crypto_box_easy(
+        crypto_box_easy_afternm(
           &full_span[0]
         , &data_span[0]
         , static_cast<std::size_t>(data_span.size())
         , &nonce[0]
-        , &remote_key[0]
-        , &private_key[0]
+        , &key[0]
         )
         == 0
       ;
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_44aa5443_5683_4ac2_bf86_5918d036b6f6
+#define ASIO_SODIUM_44aa5443_5683_4ac2_bf86_5918d036b6f6
+
+#include "../crypto.hpp"
+
+#include "early_data.hpp"
+#include "handshake_hello.hpp"
+#include "handshake_response.hpp"
+#include "handshake_ticket.hpp"
+
+#include <sodium.h>
+
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // Buffers and keys that are only needed while the handshake runs. Each
+  // handshake allocates this on the heap and frees it as soon as it finishes,
+  // so established sessions don't carry it around.
+  struct handshake_state {
+    handshake_state() noexcept = default;
+    handshake_state(handshake_state const&) = delete;
+    handshake_state& operator=(handshake_state const&) = delete;
+
+    ~handshake_state() {
+      sodium_memzero(&shared_key[0], shared_key.size());
+      sodium_memzero(&shared_point[0], shared_point.size());
+      sodium_memzero(&resumption_secret[0], resumption_secret.size());
+      // A decrypted response may hold a ticket's secret
+      sodium_memzero(&hello_response_buffer[0], hello_response_buffer.size());
+    }
+
+    hello_kind
+    kind() const noexcept {
+      return static_cast<hello_kind>(hello_flags & ~early_data_flag);
+    }
+
+    bool
+    resuming() const noexcept {
+      return kind() == hello_kind::resume;
+    }
+
+    bool
+    has_early_data() const noexcept {
+      return (hello_flags & early_data_flag) != 0;
+    }
+
+    // Performs the full handshake's only X25519 key agreement. shared_key gets
+    // exactly what crypto_box_beforenm would derive from the shared point (its
+    // HSalsa20 step), so the response can use the _afternm crypto box calls,
+    // and the point is kept for session_data::derive_session_keys.
+    bool
+    precompute_shared_key(
+      public_key const& remote_public_key
+    , private_key const& local_private_key
+    )
+    noexcept {
+      static_assert(
+        crypto_core_hsalsa20_OUTPUTBYTES == crypto_box_BEFORENMBYTES
+      , "shared key size mismatch"
+      );
+      static byte const zero[crypto_core_hsalsa20_INPUTBYTES] = {};
+      return
+        crypto_scalarmult(
+          &shared_point[0]
+        , &local_private_key[0]
+        , &remote_public_key[0]
+        )
+        == 0
+        && crypto_core_hsalsa20(
+             &shared_key[0]
+           , zero
+           , &shared_point[0]
+           , nullptr
+           )
+           == 0
+      ;
+    }
+
+    // When resuming, shared_key holds the key derived from the resumption
+    // secret for the response instead
+    asio_sodium::shared_key shared_key;
+    // The X25519 point behind shared_key (full handshakes only)
+    asio_sodium::shared_point shared_point;
+    // The hello's leading byte: its hello_kind, plus early_data_flag if an
+    // early data frame follows the hello
+    byte hello_flags = static_cast<byte>(hello_kind::full);
+    handshake_hello::buffer hello_buffer;
+    resume_hello::buffer resume_buffer;
+    session_key resumption_secret;
+    handshake_response::buffer hello_response_buffer;
+    // A resumed handshake's response is preceded by this random nonce, which
+    // the response is encrypted with and which goes into the session keys.
+    // Anyone can replay a resume hello, and the response key only depends on
+    // the ticket, so without it a replay would reuse the key and nonce.
+    nonce server_nonce;
+    // The hello's reply nonce, which the server's response overwrites in the
+    // session before any early data is opened
+    nonce reply_nonce;
+    early_length_buffer early_length;
+    // The sealed early data frame (after its length, on the server side)
+    std::vector<byte> early_frame;
+    // The server's first message, sent along with the response
+    std::vector<byte> first_message;
+  };
+}}
+
+#endif
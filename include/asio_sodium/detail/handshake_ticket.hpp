@@ -0,0 +1,278 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_f70d1892_4ee9_439a_8e05_d54fb6b943fc
+#define ASIO_SODIUM_f70d1892_4ee9_439a_8e05_d54fb6b943fc
+
+#include "../crypto.hpp"
+#include "../resumption.hpp"
+
+#include "endianness.hpp"
+
+#include <sodium.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+
+namespace asio_sodium {
+namespace detail {
+  // The first byte a client sends says which hello follows it
+  enum class hello_kind : byte {
+    full = 0
+  , resume = 1
+  };
+
+  // A resumed session never runs a key exchange. Every key it needs is
+  // derived from the resumption secret the server issued with the ticket.
+  enum class resumption_subkey : uint64_t {
+    hello = 1
+  , response = 2
+  , client_to_server = 3
+  , server_to_client = 4
+  };
+
+  inline bool
+  derive_resumption_key(
+    session_key const& secret
+  , resumption_subkey subkey
+  , session_key& result
+  )
+  noexcept {
+    return
+      crypto_kdf_derive_from_key(
+        &result[0]
+      , result.size()
+      , static_cast<uint64_t>(subkey)
+      , "resumptn"
+      , &secret[0]
+      )
+      == 0
+    ;
+  }
+
+  inline uint64_t
+  ticket_clock_now() noexcept {
+    return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+      ).count()
+    );
+  }
+
+  // What a sealed ticket holds
+  struct ticket_contents {
+    public_key client_public_key;
+    session_key secret;
+    // Seconds since the system clock's epoch
+    uint64_t issued_at;
+    byte cipher_suite;
+
+    ~ticket_contents() {
+      sodium_memzero(&secret[0], secret.size());
+    }
+  };
+
+  // How far in the future a ticket's issue time may be, for servers sharing a
+  // ticket key whose clocks disagree slightly
+  constexpr std::chrono::seconds
+  ticket_clock_skew{60};
+
+  inline bool
+  ticket_is_current(
+    ticket_contents const& contents
+  , std::chrono::seconds lifetime
+  , uint64_t now
+  , std::chrono::seconds allowed_skew = ticket_clock_skew
+  )
+  noexcept {
+    if (now < contents.issued_at) {
+      return
+        contents.issued_at - now
+        <= static_cast<uint64_t>(allowed_skew.count())
+      ;
+    }
+    return
+      now - contents.issued_at < static_cast<uint64_t>(lifetime.count())
+    ;
+  }
+
+  inline bool
+  seal_ticket(
+    ticket_key const& key
+  , ticket_contents const& contents
+  , sealed_ticket& result
+  )
+  noexcept {
+    std::array<byte, ticket_data_size> data;
+    auto position = data.begin();
+    position = std::copy(
+      contents.client_public_key.begin()
+    , contents.client_public_key.end()
+    , position
+    );
+    position = std::copy(
+      contents.secret.begin()
+    , contents.secret.end()
+    , position
+    );
+    auto const issued_at = byte_swap_if_big_endian(contents.issued_at);
+    std::memcpy(&*position, &issued_at, sizeof(issued_at));
+    position += sizeof(issued_at);
+    *position = contents.cipher_suite;
+
+    randombytes_buf(&result[0], crypto_secretbox_NONCEBYTES);
+    auto const sealed =
+      crypto_secretbox_easy(
+        &result[crypto_secretbox_NONCEBYTES]
+      , &data[0]
+      , data.size()
+      , &result[0]
+      , &key.get_key()[0]
+      )
+      == 0
+    ;
+    sodium_memzero(&data[0], data.size());
+    return sealed;
+  }
+
+  inline bool
+  open_ticket(
+    ticket_key const& key
+  , sealed_ticket const& sealed
+  , ticket_contents& result
+  )
+  noexcept {
+    std::array<byte, ticket_data_size> data;
+    if (
+      crypto_secretbox_open_easy(
+        &data[0]
+      , &sealed[crypto_secretbox_NONCEBYTES]
+      , sealed.size() - crypto_secretbox_NONCEBYTES
+      , &sealed[0]
+      , &key.get_key()[0]
+      )
+      != 0
+    ) {
+      return false;
+    }
+
+    auto position = data.begin();
+    std::copy_n(
+      position
+    , result.client_public_key.size()
+    , result.client_public_key.begin()
+    );
+    position += result.client_public_key.size();
+    std::copy_n(position, result.secret.size(), result.secret.begin());
+    position += result.secret.size();
+    uint64_t issued_at;
+    std::memcpy(&issued_at, &*position, sizeof(issued_at));
+    result.issued_at = byte_swap_if_big_endian(issued_at);
+    position += sizeof(issued_at);
+    result.cipher_suite = *position;
+    sodium_memzero(&data[0], data.size());
+    return true;
+  }
+
+  // Sent instead of the sealed hello to resume a session: the ticket, followed
+  // by the client's reply nonce in a secretbox under a key derived from the
+  // resumption secret, which proves the client holds the secret
+  class resume_hello final {
+    static constexpr std::size_t
+    box_nonce_offset = sealed_ticket_size;
+
+    static constexpr std::size_t
+    box_offset = box_nonce_offset + crypto_secretbox_NONCEBYTES;
+
+  public:
+    static constexpr std::size_t
+    buffer_size =
+      box_offset + crypto_secretbox_MACBYTES + crypto_box_NONCEBYTES
+    ;
+
+    using buffer = std::array<byte, buffer_size>;
+
+    constexpr explicit
+    resume_hello(
+      buffer& data
+    ) noexcept
+      : data_(data)
+    {}
+
+    void
+    set_ticket(sealed_ticket const& ticket) noexcept {
+      std::copy(ticket.begin(), ticket.end(), data_.begin());
+    }
+
+    void
+    copy_ticket(sealed_ticket& result) const noexcept {
+      std::copy_n(data_.begin(), result.size(), result.begin());
+    }
+
+    bool
+    encrypt(
+      session_key const& secret
+    , nonce const& reply_nonce
+    )
+    noexcept {
+      session_key key;
+      randombytes_buf(&data_[box_nonce_offset], crypto_secretbox_NONCEBYTES);
+      auto const result =
+        derive_resumption_key(secret, resumption_subkey::hello, key)
+        && crypto_secretbox_easy(
+             &data_[box_offset]
+           , &reply_nonce[0]
+           , reply_nonce.size()
+           , &data_[box_nonce_offset]
+           , &key[0]
+           )
+           == 0
+      ;
+      sodium_memzero(&key[0], key.size());
+      return result;
+    }
+
+    bool
+    decrypt(
+      session_key const& secret
+    , nonce& reply_nonce
+    ) const
+    noexcept {
+      session_key key;
+      auto const result =
+        derive_resumption_key(secret, resumption_subkey::hello, key)
+        && crypto_secretbox_open_easy(
+             &reply_nonce[0]
+           , &data_[box_offset]
+           , crypto_secretbox_MACBYTES + reply_nonce.size()
+           , &data_[box_nonce_offset]
+           , &key[0]
+           )
+           == 0
+      ;
+      sodium_memzero(&key[0], key.size());
+      return result;
+    }
+
+  private:
+    buffer& data_;
+  };
+}}
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_ad32d69d_eddb_4779_87bb_9570357d50e2
+#define ASIO_SODIUM_ad32d69d_eddb_4779_87bb_9570357d50e2
+
+#include <sodium.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // Process-wide storage for per-session key material. Slots are carved out of
+  // sodium_malloc'd chunks, so they are mlock'ed (never swapped) and fenced by
+  // guard pages, and a slot is wiped as soon as it is released. Each slot is
+  // padded to whole cache lines so that keys for different directions or
+  // sessions never share one.
+  //
+  // Every thread keeps its own free list, so sessions on different threads
+  // don't contend for slots. The lock is only taken to carve a new chunk, to
+  // take back the free list of a thread that exits, and for the (rare)
+  // release on a thread whose list is already gone.
+  template <typename T>
+  class locked_arena final {
+  public:
+    static constexpr std::size_t
+    slot_alignment = 64;
+
+    static constexpr std::size_t
+    slot_size =
+      (sizeof(T) + slot_alignment - 1) / slot_alignment * slot_alignment
+    ;
+
+    static constexpr std::size_t
+    slots_per_chunk = 64;
+
+    // Never destroyed, so sessions that outlive static destruction can still
+    // release their slots. Chunks last as long as the process.
+    static locked_arena&
+    instance() {
+      static auto const arena = new locked_arena();
+      return *arena;
+    }
+
+    locked_arena(locked_arena const&) = delete;
+    locked_arena& operator=(locked_arena const&) = delete;
+
+    void*
+    allocate() {
+      auto const local = thread_free_list();
+      if (!local) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+          add_chunk();
+        }
+        return take_back(free_);
+      }
+      if (local->empty()) {
+        refill(*local);
+      }
+      return take_back(*local);
+    }
+
+    void
+    deallocate(void* slot) noexcept {
+      sodium_memzero(slot, slot_size);
+      auto const local = thread_free_list();
+      if (local) {
+        try {
+          local->push_back(slot);
+          return;
+        } catch (...) {
+          // Fall back to the shared list
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_.push_back(slot);
+    }
+
+  private:
+    // A thread's free list, handed back to the shared list when the thread
+    // exits
+    struct thread_cache {
+      std::vector<void*> slots;
+      bool& exited;
+
+      ~thread_cache() {
+        instance().adopt(slots);
+        exited = true;
+      }
+    };
+
+    locked_arena() = default;
+
+    // Null once the calling thread's list has been destroyed (a session
+    // released during thread or static destruction)
+    static std::vector<void*>*
+    thread_free_list() noexcept {
+      static thread_local bool exited = false;
+      if (exited) {
+        return nullptr;
+      }
+      static thread_local thread_cache local{{}, exited};
+      return &local.slots;
+    }
+
+    static void*
+    take_back(std::vector<void*>& slots) noexcept {
+      auto const result = slots.back();
+      slots.pop_back();
+      return result;
+    }
+
+    // Moves up to a chunk's worth of slots into an empty thread list, carving
+    // a new chunk if no exited thread left any behind
+    void
+    refill(std::vector<void*>& local) {
+      local.reserve(slots_per_chunk);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_.empty()) {
+        add_chunk();
+      }
+      // (std::min would bind a reference to slots_per_chunk, which has no
+      // definition)
+      auto const count =
+        std::min(free_.size(), static_cast<std::size_t>(slots_per_chunk))
+      ;
+      local.insert(local.end(), free_.end() - count, free_.end());
+      free_.erase(free_.end() - count, free_.end());
+    }
+
+    void
+    adopt(std::vector<void*> const& slots) noexcept {
+      std::lock_guard<std::mutex> lock(mutex_);
+      try {
+        free_.insert(free_.end(), slots.begin(), slots.end());
+      } catch (...) {
+        // The slots stay wiped but unused
+      }
+    }
+
+    void
+    add_chunk() {
+      // sodium_malloc needs libsodium initialized (sodium_init is idempotent)
+      if (sodium_init() < 0) {
+        throw std::bad_alloc();
+      }
+      // The chunk size is a multiple of the slot alignment, so sodium_malloc
+      // (which places the chunk against its trailing guard page) returns
+      // suitably aligned memory
+      auto const chunk =
+        static_cast<unsigned char*>(sodium_malloc(slot_size * slots_per_chunk))
+      ;
+      if (!chunk) {
+        throw std::bad_alloc();
+      }
+      sodium_memzero(chunk, slot_size * slots_per_chunk);
+      chunks_.push_back(chunk);
+      free_.reserve(free_.size() + slots_per_chunk);
+      for (std::size_t i = slots_per_chunk; i-- > 0;) {
+        free_.push_back(chunk + i * slot_size);
+      }
+    }
+
+    std::mutex mutex_;
+    std::vector<void*> chunks_;
+    std::vector<void*> free_;
+  };
+
+  // Owns one T in a locked_arena slot and converts to T& wherever the key is
+  // used
+  template <typename T>
+  class locked final {
+  public:
+    locked()
+      : value_(new (locked_arena<T>::instance().allocate()) T())
+    {}
+
+    locked(locked const&) = delete;
+    locked& operator=(locked const&) = delete;
+
+    ~locked() {
+      value_->~T();
+      locked_arena<T>::instance().deallocate(value_);
+    }
+
+    operator T&() noexcept { return *value_; }
+    operator T const&() const noexcept { return *value_; }
+
+    T&
+    get() noexcept { return *value_; }
+
+    T const&
+    get() const noexcept { return *value_; }
+
+  private:
+    T* value_;
+  };
+}}
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_b5cae5b6_e5d6_474c_8c2a_0fe26851773b
+#define ASIO_SODIUM_b5cae5b6_e5d6_474c_8c2a_0fe26851773b
+
+#include "../crypto.hpp"
+
+#include "message_nonce.hpp"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#pragma clang diagnostic ignored "-Wweak-vtables"
+#include <span.h>
+#pragma clang diagnostic pop
+
+#include <algorithm>
+#include <cstdint>
+
+namespace asio_sodium {
+namespace detail {
+  // A chunked message is its header (of kind chunked) followed by one frame
+  // per chunk, each holding the chunk's mac and then its ciphertext.
+  // Every chunk but the last is message_chunk_size bytes. The header takes the
+  // next message counter value and chunk i the i'th one after it, so chunks
+  // can be encrypted and decrypted independently and in any order, while
+  // frames that arrive out of order, truncated, or from another message still
+  // fail to authenticate.
+  constexpr std::size_t message_chunk_size = 64 * 1024;
+
+  inline std::size_t
+  message_chunk_count(std::size_t length) noexcept {
+    return (length + message_chunk_size - 1) / message_chunk_size;
+  }
+
+  inline gsl::span<byte>
+  message_chunk(
+    gsl::span<byte> message
+  , std::size_t index
+  )
+  noexcept {
+    auto const offset = index * message_chunk_size;
+    auto const length = std::min(
+      message_chunk_size
+    , static_cast<std::size_t>(message.size()) - offset
+    );
+    return
+      message.subspan(
+        static_cast<std::ptrdiff_t>(offset)
+      , static_cast<std::ptrdiff_t>(length)
+      )
+    ;
+  }
+
+  // Encrypts a chunk in place, using counter for its nonce
+  template <typename CipherSuite>
+  bool
+  encrypt_message_chunk(
+    typename CipherSuite::key_state const& key
+  , nonce const& base_nonce
+  , uint64_t counter
+  , gsl::span<byte> chunk
+  , byte* mac
+  )
+  noexcept {
+    nonce chunk_nonce;
+    message_nonce(base_nonce, counter, chunk_nonce);
+    return
+      CipherSuite::encrypt(
+        key
+      , chunk.data()
+      , mac
+      , chunk.data()
+      , static_cast<std::size_t>(chunk.size())
+      , chunk_nonce
+      )
+    ;
+  }
+
+  template <typename CipherSuite>
+  bool
+  decrypt_message_chunk(
+    typename CipherSuite::key_state const& key
+  , nonce const& base_nonce
+  , uint64_t counter
+  , gsl::span<byte> chunk
+  , byte const* mac
+  )
+  noexcept {
+    nonce chunk_nonce;
+    message_nonce(base_nonce, counter, chunk_nonce);
+    return
+      CipherSuite::decrypt(
+        key
+      , chunk.data()
+      , chunk.data()
+      , mac
+      , static_cast<std::size_t>(chunk.size())
+      , chunk_nonce
+      )
+    ;
+  }
+}}
+
+#endif
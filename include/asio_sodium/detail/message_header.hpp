@@ -17,6 +17,7 @@
 #ifndef ASIO_SODIUM_4344f2d4_0557_403d_841c_9ba292025fd5
 #define ASIO_SODIUM_4344f2d4_0557_403d_841c_9ba292025fd5
 
+#include "../cipher_suites.hpp"
 #include "../crypto.hpp"
 #include "endianness.hpp"
 
@@ -41,21 +42,22 @@
 
 namespace asio_sodium {
 namespace detail {
+  // The top two bits of a header's length field say what follows it: an
+  // ordinary message, a chunked message (see message_chunks.hpp), or the
+  // opening or a later frame of a stream (see message_stream.hpp)
+  enum class message_kind : uint32_t {
+    single = 0
+  , chunked = uint32_t(2) << 30
+  , stream_start = uint32_t(1) << 30
+  , stream_chunk = uint32_t(3) << 30
+  };
+
+  template <typename CipherSuite>
   class message_header_view {
     using byte = unsigned char;
 
     static constexpr std::size_t
-    data_nonce_offset = crypto_box_MACBYTES;
-
-    static constexpr std::size_t
-    followup_nonce_offset =
-      data_nonce_offset + crypto_box_NONCEBYTES
-    ;
-
-    static constexpr std::size_t
-    message_length_offset =
-      followup_nonce_offset + crypto_box_NONCEBYTES
-    ;
+    message_length_offset = CipherSuite::mac_size;
 
   public:
     static constexpr std::size_t
@@ -65,7 +67,7 @@ namespace detail {
 
     static constexpr std::size_t
     data_size =
-      buffer_size - crypto_box_MACBYTES
+      buffer_size - CipherSuite::mac_size
     ;
 
     using length_span = gsl::span<byte, sizeof(uint32_t)>;
@@ -81,34 +83,17 @@ namespace detail {
     span() noexcept { return view_; }
 
     constexpr auto
-    data_span() noexcept { return view_.last<data_size>(); }
+    mac_span() noexcept { return view_.template first<CipherSuite::mac_size>(); }
+
+    constexpr auto
+    data_span() noexcept { return view_.template last<data_size>(); }
 
     auto
     buffer() noexcept { return asio::buffer(&view_[0], static_cast<std::size_t>(view_.size())); }
 
-    constexpr nonce_span
-    data_nonce_field() noexcept {
-      return view_.subspan<data_nonce_offset, crypto_secretbox_NONCEBYTES>();
-    }
-
-    constexpr nonce_span const
-    data_nonce_field() const noexcept {
-      return const_cast<message_header_view&>(*this).data_nonce_field();
-    }
-
-    constexpr nonce_span
-    followup_nonce_field() noexcept {
-      return span().subspan<followup_nonce_offset, crypto_box_NONCEBYTES>();
-    }
-
-    constexpr nonce_span const
-    followup_nonce_field() const noexcept {
-      return const_cast<message_header_view&>(*this).followup_nonce_field();
-    }
-
     constexpr length_span
     message_length_field() noexcept {
-      return span().subspan<message_length_offset, sizeof(uint32_t)>();
+      return span().template subspan<message_length_offset, sizeof(uint32_t)>();
     }
 
     constexpr length_span const
@@ -120,14 +105,25 @@ namespace detail {
     gsl::span<byte, buffer_size> view_;
   };
 
+  template <typename CipherSuite>
   class message_header final {
+    using view_type = message_header_view<CipherSuite>;
+    using key_state = typename CipherSuite::key_state;
+
     static constexpr std::size_t
-    buffer_size = message_header_view::buffer_size;
+    buffer_size = view_type::buffer_size;
+
+    static constexpr uint32_t
+    kind_mask = uint32_t(3) << 30;
+
   public:
     template <typename T>
     using optional = std::experimental::optional<T>;
     using buffer = std::array<byte, buffer_size>;
 
+    static constexpr uint32_t
+    max_message_length = ~kind_mask;
+
     constexpr explicit
     message_header(
       buffer& data
@@ -137,7 +133,7 @@ namespace detail {
 
     constexpr explicit
     message_header(
-      message_header_view view
+      view_type view
     ) noexcept
       : view_(view)
     {}
@@ -147,24 +143,22 @@ namespace detail {
     decrypt(
       buffer& data
     , nonce const& nonce
-    , public_key const& public_key
-    , private_key const& private_key
+    , key_state const& key
     )
     noexcept {
-      message_header_view view{gsl::as_span(data)};
-      auto full_span = view.span();
+      view_type view{gsl::as_span(data)};
+      auto mac_span = view.mac_span();
       auto data_span = view.data_span();
 
       if (
-        crypto_box_open_easy(
-          &data_span[0]
-        , &full_span[0]
-        , static_cast<std::size_t>(full_span.size())
-        , &nonce[0]
-        , &public_key[0]
-        , &private_key[0]
+        CipherSuite::decrypt(
+          key
+        , &data_span[0]
+        , &data_span[0]
+        , &mac_span[0]
+        , static_cast<std::size_t>(data_span.size())
+        , nonce
         )
-        == 0
       ) {
         return message_header(view);
       } else {
@@ -172,21 +166,14 @@ namespace detail {
       }
     }
 
+    // length must not exceed max_message_length
     void
-    generate_data_nonce() noexcept {
-      auto data_nonce = view_.data_nonce_field();
-      randombytes_buf(&data_nonce[0], static_cast<std::size_t>(data_nonce.size()));
-    }
-
-    void
-    generate_followup_nonce() noexcept {
-      auto followup_nonce = view_.followup_nonce_field();
-      randombytes_buf(&followup_nonce[0], static_cast<std::size_t>(followup_nonce.size()));
-    }
-
-    void
-    set_message_length(uint32_t length) noexcept {
-      using length_span = message_header_view::length_span;
+    set_message_length(
+      uint32_t length
+    , message_kind kind = message_kind::single
+    ) noexcept {
+      using length_span = typename view_type::length_span;
+      length |= static_cast<uint32_t>(kind);
       length = byte_swap_if_big_endian(length);
       length_span source{reinterpret_cast<byte*>(&length), sizeof(uint32_t)};
       length_span target = view_.message_length_field();
@@ -197,39 +184,41 @@ namespace detail {
       );
     }
 
-    constexpr nonce_span const
-    data_nonce_span() const noexcept {
-      return view_.data_nonce_field();
+    uint32_t
+    message_length() const noexcept {
+      return length_field() & ~kind_mask;
     }
 
-    void
-    copy_data_nonce(nonce& result) const {
-      auto data_nonce = view_.data_nonce_field();
-      std::copy(
-        data_nonce.begin()
-      , data_nonce.end()
-      , result.begin()
-      );
+    message_kind
+    kind() const noexcept {
+      return static_cast<message_kind>(length_field() & kind_mask);
     }
 
-    constexpr nonce_span const
-    followup_nonce_span() const noexcept {
-      return view_.followup_nonce_field();
-    }
+    bool
+    encrypt_to(
+      nonce const& nonce
+    , key_state const& key
+    )
+    noexcept {
+      auto mac_span = view_.mac_span();
+      auto data_span = view_.data_span();
 
-    void
-    copy_followup_nonce(nonce& result) const {
-      auto followup_nonce = view_.followup_nonce_field();
-      std::copy(
-        followup_nonce.begin()
-      , followup_nonce.end()
-      , result.begin()
-      );
+      return
+        CipherSuite::encrypt(
+          key
+        , &data_span[0]
+        , &mac_span[0]
+        , &data_span[0]
+        , static_cast<std::size_t>(data_span.size())
+        , nonce
+        )
+      ;
     }
 
+  private:
     uint32_t
-    message_length() const noexcept {
-      using length_span = message_header_view::length_span;
+    length_field() const noexcept {
+      using length_span = typename view_type::length_span;
       uint32_t result;
       length_span source = view_.message_length_field();
       length_span target{reinterpret_cast<byte*>(&result), sizeof(uint32_t)};
@@ -242,31 +231,7 @@ namespace detail {
       return result;
     }
 
-    bool
-    encrypt_to(
-      nonce const& nonce
-    , public_key const& public_key
-    , private_key const& private_key
-    )
-    noexcept {
-      auto full_span = view_.span();
-      auto data_span = view_.data_span();
-
-      return
-        crypto_box_easy(
-          &full_span[0]
-        , &data_span[0]
-        , static_cast<std::size_t>(data_span.size())
-        , &nonce[0]
-        , &public_key[0]
-        , &private_key[0]
-        )
-        == 0
-      ;
-    }
-
-  private:
-    message_header_view view_;
+    view_type view_;
   };
 }}
 
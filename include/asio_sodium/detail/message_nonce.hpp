@@ -0,0 +1,86 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ASIO_SODIUM_a8490604_121e_47ae_84c1_9d163ddfa4ec
+#define ASIO_SODIUM_a8490604_121e_47ae_84c1_9d163ddfa4ec
+
+#include "../crypto.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+namespace asio_sodium {
+namespace detail {
+  // Message nonces are never transmitted. Each direction starts from a secret
+  // random nonce exchanged during the handshake and mixes in a monotonic
+  // message counter, so a replayed or reordered frame fails to authenticate.
+  inline void
+  message_nonce(
+    nonce const& base
+  , uint64_t counter
+  , nonce& result
+  )
+  noexcept {
+    std::copy(
+      base.begin()
+    , base.end()
+    , result.begin()
+    );
+    for (std::size_t i = 0; i < sizeof(uint64_t); ++i) {
+      result[i] ^= static_cast<byte>(counter >> (8 * i));
+    }
+  }
+
+  inline bool
+  next_message_nonce(
+    nonce const& base
+  , uint64_t& counter
+  , nonce& result
+  )
+  noexcept {
+    if (counter == std::numeric_limits<uint64_t>::max()) {
+      return false;
+    }
+
+    message_nonce(base, counter, result);
+    ++counter;
+
+    return true;
+  }
+
+  // Claims count consecutive counter values at once (for the chunks of a
+  // chunked message, whose nonces are computed on other threads), and stores
+  // the first in first
+  inline bool
+  reserve_message_nonces(
+    uint64_t& counter
+  , uint64_t count
+  , uint64_t& first
+  )
+  noexcept {
+    if (std::numeric_limits<uint64_t>::max() - counter < count) {
+      return false;
+    }
+
+    first = counter;
+    counter += count;
+
+    return true;
+  }
+}}
+
+#endif
@@ -19,8 +19,11 @@
 
 #include "../errors.hpp"
 
-#include "asio_types.hpp"
+#include "message_chunks.hpp"
 #include "message_header.hpp"
+#include "message_nonce.hpp"
+#include "read_buffers.hpp"
+#include "session_data.hpp"
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wdeprecated"
@@ -29,76 +32,244 @@
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/executor_work_guard.hpp>
+#include <asio/post.hpp>
 #include <asio/read.hpp>
-#include <asio/write.hpp>
 #pragma clang diagnostic pop
 
 #include <asio/yield.hpp>
 
+#include <algorithm>
+#include <array>
+#include <new>
+#include <vector>
+
 namespace asio_sodium {
 namespace detail {
-  template <typename Resumable>
+  // Reads and decrypts one message. Calling the reader starts it: it moves
+  // itself into the read half's operation memory once, and from then on asio
+  // only ever holds a pointer-sized step, so no step of the read copies the
+  // handler or the buffer.
+  //
+  // Chunked messages (see message_chunks.hpp) are read one chunk at a time.
+  // With a crypto pool on the read half, each chunk is decrypted there while
+  // the next one is read; otherwise it is decrypted here as it arrives. Either
+  // way the reader completes only once no chunk is left on the pool.
+  //
+  // Early data the server received during the handshake is delivered by the
+  // first read, without touching the stream.
+  template <
+    typename CipherSuite
+  , typename Stream
+  , typename Resumable
+  , typename ReadBuffer = fixed_read_buffer
+  >
   class message_reader final : asio::coroutine {
+    using mac_type = std::array<byte, CipherSuite::mac_size>;
+
+    struct step {
+      message_reader* reader;
+
+      using allocator_type = handler_allocator<void>;
+
+      allocator_type
+      get_allocator() const noexcept {
+        return reader->get_allocator();
+      }
+
+      void
+      operator()(
+        std::error_code ec = std::error_code()
+      , std::size_t bytes = 0
+      ) const {
+        reader->resume(ec, bytes);
+      }
+    };
+
   public:
+    using allocator_type = handler_allocator<void>;
+
     explicit
     message_reader(
-      gsl::span<byte> message_buffer
-    , socket_type& socket
-    , session_data& session
+      ReadBuffer read_buffer
+    , Stream& stream
+    , read_half<CipherSuite>& state
     , Resumable&& resumable
     )
-      : message_buffer_(message_buffer)
-      , socket_(socket)
-      , session_(session)
+      : read_buffer_(std::move(read_buffer))
+      , stream_(stream)
+      , state_(state)
       , resumable_(std::move(resumable))
     {}
 
+    message_reader(message_reader&&) = default;
+
+    void
+    operator()() {
+      auto& memory = state_.operation;
+      auto const block = memory.allocate(sizeof(message_reader));
+      message_reader* reader;
+      try {
+        reader = new (block) message_reader(std::move(*this));
+      } catch (...) {
+        memory.deallocate(block);
+        throw;
+      }
+      reader->resume(std::error_code(), 0);
+    }
+
+    allocator_type
+    get_allocator() const noexcept {
+      return allocator_type(state_.memory);
+    }
+
+  private:
+    enum class action {
+      receive
+    , read_frame_remainder
+    , read_chunk_remainder
+    , post_continuation
+    , complete
+    };
+
+    // The next step is started last, because once it is handed to asio it may
+    // complete (and free the reader) on another thread
     void
-    operator()(
-      std::error_code ec = std::error_code()
-    , std::size_t bytes = 0
+    resume(
+      std::error_code ec
+    , std::size_t bytes
     ) {
       if (ec) {
-        resumable_(ec, bytes);
-        return;
+        result_ = ec;
+      } else {
+        switch (advance(bytes)) {
+        case action::receive:
+          receive();
+          return;
+        case action::read_frame_remainder:
+          read_frame_remainder();
+          return;
+        case action::read_chunk_remainder:
+          read_chunk_remainder();
+          return;
+        case action::post_continuation:
+          post_continuation();
+          return;
+        case action::complete:
+          break;
+        }
       }
+      // Chunks still on the pool refer to the reader and the message, so the
+      // last of them to come back completes the read instead
+      if (chunks_pending_ > 0) {
+        waiting_ = true;
+      } else {
+        complete(result_);
+      }
+    }
 
+    action
+    advance(std::size_t bytes) {
       reenter (this) {
-        yield read_header();
-        ec = process_header();
-        if (ec) {
-          resumable_(ec, bytes);
+        if (!state_.early_data.empty()) {
+          result_ = take_early_data();
+          // Never invoke the handler from within the initiating function
+          yield return action::post_continuation;
           yield break;
         }
-        yield read_mac();
-        yield read_message();
-        ec = decrypt_message();
-        if (ec) {
-          resumable_(ec, bytes);
+
+        while (state_.received.size() < state_.header_buffer.size()) {
+          yield return action::receive;
+          state_.received.commit(bytes);
+        }
+        state_.received.take(gsl::as_span(state_.header_buffer));
+        result_ = process_header();
+        if (result_) {
           yield break;
         }
 
-        resumable_(std::error_code(), 0);
+        if (chunked_) {
+          for (chunk_ = 0; chunk_ < chunk_macs_.size() && !result_; ++chunk_) {
+            take_buffered_chunk();
+            if (frame_received_ < chunk_frame_size()) {
+              yield return action::read_chunk_remainder;
+            }
+            decrypt_chunk();
+          }
+          if (!suspended_ && chunks_pending_ == 0) {
+            yield return action::post_continuation;
+          }
+          yield break;
+        }
+
+        // Small frames are pulled through the receive buffer (along with
+        // whatever follows them), while large frames are read directly into
+        // the message buffer once the buffered prefix is used up.
+        if (frame_remaining() <= state_.received.capacity()) {
+          while (state_.received.size() < frame_remaining()) {
+            yield return action::receive;
+            state_.received.commit(bytes);
+          }
+        }
+        take_buffered_frame();
+        if (frame_received_ < frame_remaining()) {
+          yield return action::read_frame_remainder;
+        } else if (!suspended_) {
+          // Never invoke the handler from within the initiating function
+          yield return action::post_continuation;
+        }
+
+        result_ = decrypt_message();
       }
+      return action::complete;
     }
 
+    // Releases the operation memory before invoking the handler, so that the
+    // handler can start the next read in the same block
     void
-    read_header()
-    noexcept {
-      asio::async_read(
-        socket_
-      , asio::buffer(session_.header_buffer)
-      , std::move(*this)
+    complete(std::error_code ec) {
+      auto read_buffer = std::move(read_buffer_);
+      auto resumable = std::move(resumable_);
+      auto& memory = state_.operation;
+      this->~message_reader();
+      memory.deallocate(this);
+      read_buffer.complete(resumable, ec);
+    }
+
+    void
+    receive() {
+      suspended_ = true;
+      stream_.async_read_some(
+        state_.received.prepare()
+      , step{this}
+      );
+    }
+
+    void
+    post_continuation() {
+      asio::post(
+        stream_.get_executor()
+      , step{this}
       );
     }
 
     std::error_code
     process_header() {
-      auto const header = message_header::decrypt(
-        session_.header_buffer
-      , session_.decrypt_nonce
-      , session_.remote_public_key
-      , session_.local_private_key
+      nonce header_nonce;
+      if (
+        !next_message_nonce(
+          state_.base_nonce
+        , state_.counter
+        , header_nonce
+        )
+      ) {
+        return error::message_nonce_exhausted;
+      }
+
+      auto const header = message_header<CipherSuite>::decrypt(
+        state_.header_buffer
+      , header_nonce
+      , state_.key
       );
 
       if (!header) {
@@ -106,56 +277,205 @@ namespace detail {
       }
 
       message_length_ = header->message_length();
-      if (message_length_ > message_buffer_.size()) {
-        return error::message_too_large;
+      switch (header->kind()) {
+      case message_kind::single:
+        break;
+      case message_kind::chunked:
+        chunked_ = true;
+        break;
+      case message_kind::stream_start:
+      case message_kind::stream_chunk:
+        return error::message_kind;
       }
+      if (chunked_) {
+        auto const count = message_chunk_count(message_length_);
+        if (
+          !reserve_message_nonces(
+            state_.counter
+          , count
+          , first_chunk_counter_
+          )
+        ) {
+          return error::message_nonce_exhausted;
+        }
+        chunk_macs_.resize(count);
+      }
+      return read_buffer_.prepare(message_length_);
+    }
+
+    std::error_code
+    take_early_data() {
+      auto& early_data = state_.early_data;
+      auto const result =
+        read_buffer_.prepare(static_cast<uint32_t>(early_data.size()))
+      ;
+      if (!result) {
+        std::copy(
+          early_data.begin()
+        , early_data.end()
+        , read_buffer_.message().begin()
+        );
+      }
+      std::vector<byte>().swap(early_data);
+      return result;
+    }
+
+    std::size_t
+    frame_remaining() const noexcept {
+      return state_.mac.size() + message_length_;
+    }
 
-      return {};
+    void
+    take_buffered_frame()
+    noexcept {
+      mac_received_ = state_.received.take(gsl::as_span(state_.mac));
+      message_received_ =
+        state_.received.take(read_buffer_.message())
+      ;
+      frame_received_ = mac_received_ + message_received_;
     }
 
     void
-    read_mac()
+    read_frame_remainder()
     noexcept {
+      suspended_ = true;
+      std::array<asio::mutable_buffer, 2> const remainder{{
+        asio::buffer(state_.mac) + mac_received_
+      , asio::buffer(read_buffer_.message().data(), message_length_)
+        + message_received_
+      }};
       asio::async_read(
-        socket_
-      , asio::buffer(session_.mac)
-      , std::move(*this)
+        stream_
+      , remainder
+      , step{this}
       );
     }
 
+    gsl::span<byte>
+    current_chunk() const noexcept {
+      return message_chunk(read_buffer_.message(), chunk_);
+    }
+
+    std::size_t
+    chunk_frame_size() const noexcept {
+      return
+        CipherSuite::mac_size
+        + static_cast<std::size_t>(current_chunk().size())
+      ;
+    }
+
+    void
+    take_buffered_chunk()
+    noexcept {
+      mac_received_ = state_.received.take(gsl::as_span(chunk_macs_[chunk_]));
+      message_received_ = state_.received.take(current_chunk());
+      frame_received_ = mac_received_ + message_received_;
+    }
+
     void
-    read_message()
+    read_chunk_remainder()
     noexcept {
+      suspended_ = true;
+      auto const chunk = current_chunk();
+      std::array<asio::mutable_buffer, 2> const remainder{{
+        asio::buffer(chunk_macs_[chunk_]) + mac_received_
+      , asio::buffer(chunk.data(), static_cast<std::size_t>(chunk.size()))
+        + message_received_
+      }};
       asio::async_read(
-        socket_
-      , asio::buffer(&message_buffer_[0], message_length_)
-      , std::move(*this)
+        stream_
+      , remainder
+      , step{this}
       );
     }
 
+    void
+    decrypt_chunk() {
+      auto const counter = first_chunk_counter_ + chunk_;
+      auto const mac = &chunk_macs_[chunk_][0];
+      if (state_.pool == nullptr) {
+        if (
+          !decrypt_message_chunk<CipherSuite>(
+            state_.key
+          , state_.base_nonce
+          , counter
+          , current_chunk()
+          , mac
+          )
+        ) {
+          result_ = error::message_decrypt;
+        }
+        return;
+      }
+
+      ++chunks_pending_;
+      typename CipherSuite::key_state const& key = state_.key;
+      // Both posts take their storage from the read half's job memory
+      state_.pool->post(make_allocated_job(
+        [ reader = this
+        , work = asio::make_work_guard(stream_.get_executor())
+        , &key
+        , &base_nonce = state_.base_nonce
+        , counter
+        , chunk = current_chunk()
+        , mac
+        , &jobs = state_.jobs
+        ]() {
+          auto const decrypted = decrypt_message_chunk<CipherSuite>(
+            key
+          , base_nonce
+          , counter
+          , chunk
+          , mac
+          );
+          asio::post(
+            work.get_executor()
+          , make_allocated_job(
+              [reader, decrypted] { reader->chunk_decrypted(decrypted); }
+            , jobs
+            )
+          );
+        }
+      , state_.jobs
+      ));
+    }
+
+    void
+    chunk_decrypted(bool decrypted) {
+      --chunks_pending_;
+      if (!decrypted && !result_) {
+        result_ = error::message_decrypt;
+      }
+      if (waiting_ && chunks_pending_ == 0) {
+        complete(result_);
+      }
+    }
+
     std::error_code
     decrypt_message()
     noexcept {
-      auto ciphertext = message_buffer_.first(message_length_);
+      auto ciphertext = read_buffer_.message();
 
-      message_header const header(
-        session_.header_buffer
-      );
-
-      header.copy_followup_nonce(session_.decrypt_nonce);
+      nonce data_nonce;
+      if (
+        !next_message_nonce(
+          state_.base_nonce
+        , state_.counter
+        , data_nonce
+        )
+      ) {
+        return error::message_nonce_exhausted;
+      }
 
-      auto const data_nonce = header.data_nonce_span();
       if (
-        crypto_box_open_detached(
-          &ciphertext[0]
-        , &ciphertext[0]
-        , &session_.mac[0]
+        !CipherSuite::decrypt(
+          state_.key
+        , ciphertext.data()
+        , ciphertext.data()
+        , &state_.mac[0]
         , static_cast<std::size_t>(ciphertext.size())
-        , &data_nonce[0]
-        , &session_.remote_public_key[0]
-        , &session_.local_private_key[0]
+        , data_nonce
         )
-        != 0
       ) {
         return error::message_decrypt;
       } else {
@@ -163,13 +483,25 @@ namespace detail {
       }
     }
 
-  private:
-    gsl::span<byte> message_buffer_;
-    socket_type& socket_;
-    session_data& session_;
+    ReadBuffer read_buffer_;
+    Stream& stream_;
+    read_half<CipherSuite>& state_;
     Resumable resumable_;
-    uint32_t message_length_;
+    uint32_t message_length_ = 0;
+    std::size_t mac_received_ = 0;
+    std::size_t message_received_ = 0;
+    std::size_t frame_received_ = 0;
+    std::vector<mac_type> chunk_macs_;
+    std::size_t chunk_ = 0;
+    uint64_t first_chunk_counter_ = 0;
+    std::size_t chunks_pending_ = 0;
+    std::error_code result_;
+    bool chunked_ = false;
+    bool suspended_ = false;
+    bool waiting_ = false;
   };
 }}
 
+#include <asio/unyield.hpp>
+
 #endif
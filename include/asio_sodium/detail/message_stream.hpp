@@ -0,0 +1,58 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_400df396_e095_45e8_83eb_d3b2675c7133
+#define ASIO_SODIUM_400df396_e095_45e8_83eb_d3b2675c7133
+
+#include "../crypto.hpp"
+
+#include <sodium.h>
+
+#include <array>
+
+namespace asio_sodium {
+namespace detail {
+  // A stream carries a payload of any length in bounded chunks, encrypted with
+  // crypto_secretstream_xchacha20poly1305. The opening frame is an ordinary
+  // message of kind stream_start whose data is a new random secretstream key
+  // followed by the secretstream header. Each later frame is a header of kind
+  // stream_chunk followed by one secretstream ciphertext holding at most
+  // stream_chunk_size bytes of the payload. The last frame is tagged final, so
+  // a stream that is cut short fails instead of looking complete, and the
+  // headers keep the frames in order with everything else on the connection.
+  constexpr std::size_t
+  stream_chunk_size = 64 * 1024;
+
+  constexpr std::size_t
+  stream_chunk_overhead = crypto_secretstream_xchacha20poly1305_ABYTES;
+
+  using stream_state = crypto_secretstream_xchacha20poly1305_state;
+
+  using stream_opening = std::array<
+    byte
+  , crypto_secretstream_xchacha20poly1305_KEYBYTES
+    + crypto_secretstream_xchacha20poly1305_HEADERBYTES
+  >;
+
+  constexpr std::size_t
+  stream_key_offset = 0;
+
+  constexpr std::size_t
+  stream_header_offset = crypto_secretstream_xchacha20poly1305_KEYBYTES;
+}}
+
+#endif
@@ -19,141 +19,251 @@
 
 #include "../errors.hpp"
 
-#include "asio_types.hpp"
 #include "message_header.hpp"
+#include "message_nonce.hpp"
+#include "session_data.hpp"
 
 #include <asio/coroutine.hpp>
 #include <asio/read.hpp>
 #include <asio/write.hpp>
 #include <asio/yield.hpp>
-#include <limits>
+
+#include <array>
+#include <new>
 
 namespace asio_sodium {
 namespace detail {
-  template <typename Resumable>
+  // Encrypts the message into ciphertext (which must be at least as large, and
+  // may be the message itself) and writes the matching encrypted header and
+  // message mac. Consumes two nonces from the write half.
+  template <typename CipherSuite>
+  std::error_code
+  encrypt_message(
+    write_half<CipherSuite>& state
+  , gsl::span<byte const> message
+  , byte* ciphertext
+  , typename message_header<CipherSuite>::buffer& header_buffer
+  , std::array<byte, CipherSuite::mac_size>& mac
+  , message_kind kind = message_kind::single
+  )
+  noexcept {
+    message_header<CipherSuite> header(header_buffer);
+
+    if (message.length() > message_header<CipherSuite>::max_message_length) {
+      return error::message_too_large;
+    } else {
+      header.set_message_length(
+        static_cast<uint32_t>(message.length())
+      , kind
+      );
+    }
+
+    nonce header_nonce;
+    nonce data_nonce;
+    if (
+      !next_message_nonce(
+        state.base_nonce
+      , state.counter
+      , header_nonce
+      )
+      ||
+      !next_message_nonce(
+        state.base_nonce
+      , state.counter
+      , data_nonce
+      )
+    ) {
+      return error::message_nonce_exhausted;
+    }
+
+    if (
+      !CipherSuite::encrypt(
+        state.key
+      , ciphertext
+      , &mac[0]
+      , message.data()
+      , static_cast<std::size_t>(message.size())
+      , data_nonce
+      )
+    ) {
+      return error::message_encrypt;
+    }
+
+    if (
+      !header.encrypt_to(
+        header_nonce
+      , state.key
+      )
+    ) {
+      return error::message_header_encrypt;
+    }
+
+    return {};
+  }
+
+  template <typename CipherSuite>
+  std::error_code
+  encrypt_message_in_place(
+    write_half<CipherSuite>& state
+  , gsl::span<byte> message
+  , typename message_header<CipherSuite>::buffer& header_buffer
+  , std::array<byte, CipherSuite::mac_size>& mac
+  )
+  noexcept {
+    return
+      encrypt_message(
+        state
+      , message
+      , message.data()
+      , header_buffer
+      , mac
+      )
+    ;
+  }
+
+  // Encrypts one message in place and writes it. Like message_reader, calling
+  // the writer moves it into the write half's operation memory, and asio only
+  // ever holds a pointer to it.
+  template <
+    typename CipherSuite
+  , typename Stream
+  , typename Resumable
+  >
   class message_writer final : asio::coroutine {
+    struct step {
+      message_writer* writer;
+
+      using allocator_type = handler_allocator<void>;
+
+      allocator_type
+      get_allocator() const noexcept {
+        return writer->get_allocator();
+      }
+
+      void
+      operator()(
+        std::error_code ec
+      , std::size_t bytes
+      ) const {
+        writer->resume(ec, bytes);
+      }
+    };
+
   public:
+    using allocator_type = handler_allocator<void>;
+
     explicit
     message_writer(
       gsl::span<byte> message
-    , socket_type& socket
-    , session_data& session
+    , Stream& stream
+    , write_half<CipherSuite>& state
     , Resumable&& resumable
     )
       : message_(message)
-      , socket_(socket)
-      , session_(session)
+      , stream_(stream)
+      , state_(state)
       , resumable_(std::move(resumable))
     {}
 
+    message_writer(message_writer&&) = default;
+
     void
-    operator()(
-      std::error_code ec = std::error_code()
-    , std::size_t bytes = 0
-    ) {
-      if (ec) {
-        resumable_(ec, bytes);
-        return;
+    operator()() {
+      auto& memory = state_.operation;
+      auto const block = memory.allocate(sizeof(message_writer));
+      message_writer* writer;
+      try {
+        writer = new (block) message_writer(std::move(*this));
+      } catch (...) {
+        memory.deallocate(block);
+        throw;
       }
+      writer->resume(std::error_code(), 0);
+    }
 
-      reenter (this) {
-        ec = encrypt_message_in_place_and_write_header();
-        if (ec) {
-          resumable_(ec, bytes);
-          yield break;
-        }
-        yield send_header();
-        yield send_mac();
-        yield send_message_and_invoke_callback();
-      }
+    allocator_type
+    get_allocator() const noexcept {
+      return allocator_type(state_.memory);
     }
 
   private:
-    std::error_code
-    encrypt_message_in_place_and_write_header()
-    noexcept {
-      message_header header(session_.header_buffer);
-      header.generate_data_nonce();
-      header.generate_followup_nonce();
-
-      if (message_.length() > std::numeric_limits<uint32_t>::max()) {
-        return error::message_too_large;
+    // As in message_reader, the write is started last because it may
+    // complete (and free the writer) on another thread
+    void
+    resume(
+      std::error_code ec
+    , std::size_t bytes
+    ) {
+      if (ec) {
+        complete(ec, bytes);
+      } else if (advance()) {
+        send_frame();
       } else {
-        header.set_message_length(static_cast<uint32_t>(message_.length()));
-      }
-
-      auto data_nonce = header.data_nonce_span();
-      if (
-        crypto_box_detached(
-          &message_[0]
-        , &session_.mac[0]
-        , &message_[0]
-        , static_cast<std::size_t>(message_.size())
-        , &data_nonce[0]
-        , &session_.remote_public_key[0]
-        , &session_.local_private_key[0]
-        ) != 0
-      ) {
-        return error::message_encrypt;
+        complete(
+          result_
+        , result_ ? 0 : static_cast<std::size_t>(message_.size())
+        );
       }
-
-      nonce temp_followup_nonce;
-      header.copy_followup_nonce(temp_followup_nonce);
-
-      if (
-        !header.encrypt_to(
-          session_.encrypt_nonce
-        , session_.remote_public_key
-        , session_.local_private_key
-        )
-      ) {
-        return error::message_header_encrypt;
-      }
-
-      std::copy(
-        temp_followup_nonce.begin()
-      , temp_followup_nonce.end()
-      , session_.encrypt_nonce.begin()
-      );
-
-      return {};
     }
 
-    void
-    send_header()
+    // Returns whether the frame should be sent
+    bool
+    advance()
     noexcept {
-      asio::async_write(
-        socket_
-      , asio::buffer(session_.header_buffer)
-      , std::move(*this)
-      );
+      reenter (this) {
+        result_ = encrypt_message_in_place(
+          state_
+        , message_
+        , state_.header_buffer
+        , state_.mac
+        );
+        if (result_) {
+          yield break;
+        }
+        yield return true;
+      }
+      return false;
     }
 
+    // Releases the operation memory before invoking the handler, so that the
+    // handler can start the next write in the same block
     void
-    send_mac()
-    noexcept {
-      asio::async_write(
-        socket_
-      , asio::buffer(session_.mac)
-      , std::move(*this)
-      );
+    complete(
+      std::error_code ec
+    , std::size_t bytes
+    ) {
+      auto resumable = std::move(resumable_);
+      auto& memory = state_.operation;
+      this->~message_writer();
+      memory.deallocate(this);
+      resumable(ec, bytes);
     }
 
+    // Header, mac, and message go out as a single gather write so that a small
+    // message costs one syscall (and usually one segment).
     void
-    send_message_and_invoke_callback()
+    send_frame()
     noexcept {
+      std::array<asio::const_buffer, 3> const frame{{
+        asio::buffer(state_.header_buffer)
+      , asio::buffer(state_.mac)
+      , asio::buffer(message_.data(), static_cast<std::size_t>(message_.size()))
+      }};
       asio::async_write(
-        socket_
-      , asio::buffer(&message_[0], static_cast<std::size_t>(message_.size()))
-      , std::move(resumable_)
+        stream_
+      , frame
+      , step{this}
       );
     }
 
     gsl::span<byte> message_;
-    socket_type& socket_;
-    session_data& session_;
+    Stream& stream_;
+    write_half<CipherSuite>& state_;
     Resumable resumable_;
+    std::error_code result_;
   };
 }}
 
+#include <asio/unyield.hpp>
+
 #endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_4ae9b055_e841_49a2_adcd_9954dc41c63a
+#define ASIO_SODIUM_4ae9b055_e841_49a2_adcd_9954dc41c63a
+
+#include "../errors.hpp"
+#include "../pooled_message.hpp"
+
+#include "buffer_pool.hpp"
+
+#include <memory>
+
+namespace asio_sodium {
+namespace detail {
+  // The message reader learns a message's length only after decrypting its
+  // header. A read buffer decides where the message goes once the length is
+  // known (prepare), exposes the storage to read and decrypt into (message),
+  // and passes the result to the handler (complete).
+
+  // Reads into a caller-supplied span that must be large enough for whatever
+  // arrives
+  class fixed_read_buffer final {
+  public:
+    template <std::ptrdiff_t Extent>
+    fixed_read_buffer(
+      gsl::span<byte, Extent> buffer
+    ) noexcept
+      : buffer_(buffer)
+    {}
+
+    std::error_code
+    prepare(uint32_t length) noexcept {
+      if (length > buffer_.size()) {
+        return error::message_too_large;
+      }
+      length_ = length;
+      return {};
+    }
+
+    gsl::span<byte>
+    message() const noexcept { return buffer_.first(length_); }
+
+    template <typename Handler>
+    void
+    complete(
+      Handler& handler
+    , std::error_code ec
+    ) {
+      handler(ec, ec ? 0 : static_cast<std::size_t>(length_));
+    }
+
+  private:
+    gsl::span<byte> buffer_;
+    uint32_t length_ = 0;
+  };
+
+  // Asks the provider for storage once the length is known, so callers can
+  // allocate exactly the right size from wherever they like. The provider is
+  // called as provider(uint32_t length) and returns a gsl::span<byte>, which
+  // must be at least length bytes.
+  template <typename Provider>
+  class provided_read_buffer final {
+  public:
+    explicit
+    provided_read_buffer(
+      Provider&& provider
+    )
+      : provider_(std::move(provider))
+    {}
+
+    std::error_code
+    prepare(uint32_t length) {
+      gsl::span<byte> const provided = provider_(length);
+      if (length > provided.size()) {
+        return error::message_too_large;
+      }
+      message_ = provided.first(length);
+      return {};
+    }
+
+    gsl::span<byte>
+    message() const noexcept { return message_; }
+
+    template <typename Handler>
+    void
+    complete(
+      Handler& handler
+    , std::error_code ec
+    ) {
+      handler(ec, ec ? gsl::span<byte>() : message_);
+    }
+
+  private:
+    Provider provider_;
+    gsl::span<byte> message_;
+  };
+
+  // Reads into exactly-sized storage from a shared pool, so nothing is
+  // committed until a message actually arrives
+  class pooled_read_buffer final {
+  public:
+    explicit
+    pooled_read_buffer(
+      std::shared_ptr<buffer_pool> pool
+    ) noexcept
+      : pool_(std::move(pool))
+    {}
+
+    std::error_code
+    prepare(uint32_t length) {
+      storage_ =
+        std::allocate_shared<buffer_pool::buffer>(
+          pool_allocator<buffer_pool::buffer>(pool_)
+        , pool_->acquire(length)
+        )
+      ;
+      return {};
+    }
+
+    gsl::span<byte>
+    message() const noexcept { return gsl::as_span(*storage_); }
+
+    template <typename Handler>
+    void
+    complete(
+      Handler& handler
+    , std::error_code ec
+    ) {
+      if (ec) {
+        handler(ec, pooled_message());
+      } else {
+        auto const size = storage_->size();
+        handler(ec, pooled_message(std::move(storage_), size));
+      }
+    }
+
+  private:
+    std::shared_ptr<buffer_pool> pool_;
+    std::shared_ptr<buffer_pool::buffer> storage_;
+  };
+}}
+
+#endif
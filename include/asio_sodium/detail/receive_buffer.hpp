@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ASIO_SODIUM_15e835db_f403_49a8_8001_6eadc78b2633
+#define ASIO_SODIUM_15e835db_f403_49a8_8001_6eadc78b2633
+
+#include "../crypto.hpp"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wundef"
+#include <asio/buffer.hpp>
+#pragma clang diagnostic pop
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+namespace asio_sodium {
+namespace detail {
+  // Per-connection receive buffer. The reader fills it with as much as the
+  // socket has available and then parses frames out of it, so pipelined
+  // messages don't cost a syscall apiece. Storage is allocated on first use to
+  // keep idle connections small.
+  class receive_buffer final {
+  public:
+    static constexpr std::size_t
+    default_capacity = 16 * 1024;
+
+    explicit
+    receive_buffer(
+      std::size_t capacity = default_capacity
+    ) noexcept
+      : capacity_(capacity)
+    {}
+
+    std::size_t
+    capacity() const noexcept { return capacity_; }
+
+    // The number of received bytes that haven't been consumed yet
+    std::size_t
+    size() const noexcept { return end_ - begin_; }
+
+    // Free space for the next receive. Unconsumed bytes are first moved to the
+    // front of the buffer so that the free space is as large as possible.
+    asio::mutable_buffers_1
+    prepare() {
+      if (!storage_) {
+        storage_.reset(new byte[capacity_]);
+      }
+      if (begin_ != 0) {
+        std::memmove(&storage_[0], &storage_[begin_], size());
+        end_ -= begin_;
+        begin_ = 0;
+      }
+      return asio::buffer(&storage_[end_], capacity_ - end_);
+    }
+
+    void
+    commit(std::size_t bytes) noexcept {
+      end_ += bytes;
+    }
+
+    // Moves up to target.size() received bytes into target and returns the
+    // number of bytes moved
+    std::size_t
+    take(gsl::span<byte> target) noexcept {
+      auto const bytes =
+        std::min(size(), static_cast<std::size_t>(target.size()))
+      ;
+      if (bytes != 0) {
+        std::copy(
+          &storage_[begin_]
+        , &storage_[begin_ + bytes]
+        , target.begin()
+        );
+        begin_ += bytes;
+      }
+      return bytes;
+    }
+
+  private:
+    std::unique_ptr<byte[]> storage_;
+    std::size_t capacity_;
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+  };
+}}
+
+#endif
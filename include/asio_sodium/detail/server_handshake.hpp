@@ -17,38 +17,82 @@
 #ifndef ASIO_SODIUM_e50e3cf0_2e11_453d_bb1e_3f6ff09eca5d
 #define ASIO_SODIUM_e50e3cf0_2e11_453d_bb1e_3f6ff09eca5d
 
-#include "asio_types.hpp"
+#include "../crypto_pool.hpp"
+#include "../errors.hpp"
+
 #include "handshake_hello.hpp"
 #include "handshake_response.hpp"
+#include "handshake_state.hpp"
+#include "message_writer.hpp"
 #include "session_data.hpp"
 
 #include <asio/coroutine.hpp>
+#include <asio/executor_work_guard.hpp>
+#include <asio/post.hpp>
 #include <asio/read.hpp>
 #include <asio/write.hpp>
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <memory>
+#include <vector>
+
 #include <asio/yield.hpp>
 
 namespace asio_sodium {
 namespace detail {
+  // Stands in for a server handshake's responder when it has none: early data
+  // is left for the stream's first read, and the response goes out alone
+  struct no_responder {};
+
+  // The completion is called with no arguments once the session is
+  // established, or with (error_code, bytes transferred) if the handshake
+  // fails.
+  //
+  // Given a crypto pool, the two steps that cost a scalar multiplication
+  // (opening the sealed hello, and deriving the keys and encrypting the
+  // response) run on the pool, and the handshake resumes on the stream's
+  // executor after each, so a burst of handshakes can't hold up established
+  // connections on the same thread. The authenticator always runs on the
+  // stream's executor.
+  //
+  // If the server's identity has a ticket key, every handshake also issues
+  // the client a resumption ticket, and a client presenting a ticket skips the
+  // key exchange (see handshake_ticket.hpp). Resuming needs only symmetric
+  // crypto, so it never goes to the pool.
+  //
+  // Early data from the client (see early_data.hpp) is opened once the
+  // response is ready. A responder is called as responder(gsl::span<byte
+  // const> early_data) on the stream's executor and returns a
+  // std::vector<byte>; if that is not empty, it becomes the stream's first
+  // message and goes out in the same write as the response.
   template <
-    typename Authenticator
-  , typename OnSuccess
-  , typename OnError
+    typename CipherSuite
+  , typename Stream
+  , typename Authenticator
+  , typename Completion
+  , typename Responder = no_responder
   >
   class server_handshake : asio::coroutine {
   public:
     explicit
     server_handshake(
-      session_data& session
-    , socket_type& socket
+      session_data<CipherSuite>& session
+    , Stream& stream
     , Authenticator authenticator
-    , OnSuccess on_success
-    , OnError on_error
+    , Completion completion
+    , crypto_pool* pool = nullptr
+    , Responder responder = Responder()
     )
       : session_(session)
-      , socket_(socket)
+      , stream_(stream)
+      , transient_(std::make_unique<handshake_state>())
       , authenticator_(std::move(authenticator))
-      , on_success_(std::move(on_success))
-      , on_error_(std::move(on_error))
+      , completion_(std::move(completion))
+      , responder_(std::move(responder))
+      , pool_(pool)
+      , cipher_suite_()
     {}
 
     void
@@ -57,52 +101,146 @@ namespace detail {
     , std::size_t bytes = 0
     ) {
       if (ec) {
-        on_error_(ec, bytes);
+        completion_(ec, bytes);
         return;
       }
 
       reenter (this) {
         yield await_hello();
-        ec = process_hello();
+        if (transient_->resuming()) {
+          yield await_resume_hello();
+          ec = process_resume_hello();
+        } else if (transient_->kind() != hello_kind::full) {
+          ec = error::handshake_hello_decrypt;
+        } else {
+          if (pool_ != nullptr) {
+            yield offload(&server_handshake::open_hello);
+          } else {
+            ec = open_hello();
+          }
+          if (!ec) {
+            ec = process_hello();
+          }
+        }
         if (ec) {
-          on_error_(ec, bytes);
+          completion_(ec, bytes);
           yield break;
         }
-        ec = make_hello_response();
+        if (pool_ != nullptr && !transient_->resuming()) {
+          yield offload(&server_handshake::make_hello_response);
+        } else {
+          ec = make_hello_response();
+          if (ec) {
+            completion_(ec, bytes);
+            yield break;
+          }
+        }
+        if (transient_->has_early_data()) {
+          yield await_early_length();
+          ec = prepare_early_frame();
+          if (!ec) {
+            yield await_early_frame();
+            ec = open_early_data();
+          }
+        }
+        if (!ec) {
+          ec = respond(responder_);
+        }
         if (ec) {
-          on_error_(ec, bytes);
+          completion_(ec, bytes);
           yield break;
         }
         yield send_hello_response();
-        on_success_();
+        transient_.reset();
+        completion_();
       }
     }
 
   private:
+    // Reads as much as a full hello takes. A resume hello is longer, so the
+    // rest of it is read separately.
     void
     await_hello()
     noexcept {
+      std::array<asio::mutable_buffer, 2> const buffers{{
+        asio::buffer(&transient_->hello_flags, sizeof(transient_->hello_flags))
+      , asio::buffer(transient_->hello_buffer)
+      }};
+      asio::async_read(
+        stream_
+      , buffers
+      , std::move(*this)
+      );
+    }
+
+    void
+    await_resume_hello()
+    noexcept {
+      static_assert(
+        resume_hello::buffer_size
+        > std::tuple_size<handshake_hello::buffer>::value
+      , "A resume hello must be longer than a full hello"
+      );
+      auto& resume_buffer = transient_->resume_buffer;
+      auto const received = transient_->hello_buffer.size();
+      std::copy(
+        transient_->hello_buffer.begin()
+      , transient_->hello_buffer.end()
+      , resume_buffer.begin()
+      );
       asio::async_read(
-        socket_
-      , asio::buffer(session_.hello_buffer)
+        stream_
+      , asio::buffer(resume_buffer) + received
       , std::move(*this)
       );
     }
 
+    // Runs the step on the pool, then resumes the handshake on the stream's
+    // executor with its result. The work guard keeps the stream's io_service
+    // from running out of work in the meantime.
+    void
+    offload(std::error_code (server_handshake::*step)()) {
+      auto const pool = pool_;
+      auto work = asio::make_work_guard(stream_.get_executor());
+      pool->post(
+        [ handshake = std::move(*this)
+        , work = std::move(work)
+        , step
+        ]() mutable {
+          auto const ec = (handshake.*step)();
+          auto const executor = work.get_executor();
+          asio::post(
+            executor
+          , [handshake = std::move(handshake), ec]() mutable {
+              handshake(ec, 0);
+            }
+          );
+        }
+      );
+    }
+
     std::error_code
-    process_hello()
+    open_hello()
     noexcept {
       auto hello =
         handshake_hello::decrypt(
-          session_.hello_buffer
-        , session_.local_public_key
-        , session_.local_private_key
+          transient_->hello_buffer
+        , session_.identity->get_public_key()
+        , session_.identity->get_private_key()
         )
       ;
       if (!hello) {
         return error::handshake_hello_decrypt;
       }
-      auto public_key = hello->client_public_key_span();
+      return {};
+    }
+
+    // Expects the hello to be open already
+    std::error_code
+    process_hello()
+    noexcept {
+      handshake_hello const hello{transient_->hello_buffer};
+      auto public_key = hello.client_public_key_span();
       // Look up the public key and make sure it's authorized
       if (!authenticator_(public_key)) {
         return error::handshake_authentication;
@@ -112,28 +250,100 @@ namespace detail {
       , public_key.end()
       , session_.remote_public_key.begin()
       );
-      hello->copy_reply_nonce(session_.encrypt_nonce);
+      auto const cipher_suite = CipherSuite::select(hello.cipher_suite());
+      if (!cipher_suite) {
+        return error::handshake_cipher_suite;
+      }
+      cipher_suite_ = *cipher_suite;
+      hello.copy_reply_nonce(session_.write_state.base_nonce);
+      transient_->reply_nonce = session_.write_state.base_nonce;
+      return {};
+    }
+
+    // Opens the ticket and the client's reply nonce, and leaves the key for
+    // the response in the shared key's place
+    std::error_code
+    process_resume_hello()
+    noexcept {
+      auto const tickets = session_.identity->get_ticket_key();
+      if (tickets == nullptr) {
+        return error::handshake_ticket;
+      }
+      resume_hello const hello{transient_->resume_buffer};
+      sealed_ticket sealed;
+      hello.copy_ticket(sealed);
+      ticket_contents contents;
+      if (
+        !open_ticket(*tickets, sealed, contents)
+        || !ticket_is_current(contents, tickets->lifetime(), ticket_clock_now())
+      ) {
+        return error::handshake_ticket;
+      }
+      if (!hello.decrypt(contents.secret, session_.write_state.base_nonce)) {
+        return error::handshake_hello_decrypt;
+      }
+      transient_->reply_nonce = session_.write_state.base_nonce;
+      // The client may have lost its authorization since the ticket was issued
+      if (!authenticator_(gsl::as_span(contents.client_public_key))) {
+        return error::handshake_authentication;
+      }
+      session_.remote_public_key = contents.client_public_key;
+      auto const cipher_suite = CipherSuite::select(contents.cipher_suite);
+      if (!cipher_suite) {
+        return error::handshake_cipher_suite;
+      }
+      cipher_suite_ = *cipher_suite;
+      transient_->resumption_secret = contents.secret;
+      if (
+        !derive_resumption_key(
+          contents.secret
+        , resumption_subkey::response
+        , transient_->shared_key
+        )
+      ) {
+        return error::handshake_shared_key;
+      }
       return {};
     }
 
     std::error_code
     make_hello_response()
     noexcept {
-      handshake_response response{session_.hello_response_buffer};
+      if (
+        !transient_->resuming()
+        && !transient_->precompute_shared_key(
+              session_.remote_public_key
+            , session_.identity->get_private_key()
+            )
+      ) {
+        return error::handshake_shared_key;
+      }
+
+      handshake_response response{transient_->hello_response_buffer};
 
       response.generate_reply_nonce();
-      response.copy_reply_nonce(session_.decrypt_nonce);
+      response.set_cipher_suite(cipher_suite_);
+      response.copy_reply_nonce(session_.read_state.base_nonce);
 
       nonce temp_followup_nonce;
 
       response.generate_followup_nonce();
       response.copy_followup_nonce(temp_followup_nonce);
 
+      if (!issue_ticket(response)) {
+        return error::handshake_response_encrypt;
+      }
+
+      auto& server_nonce = transient_->server_nonce;
+      if (transient_->resuming()) {
+        randombytes_buf(&server_nonce[0], server_nonce.size());
+      }
       if (
         !response.encrypt_to(
-          session_.encrypt_nonce
-        , session_.remote_public_key
-        , session_.local_private_key
+          transient_->resuming()
+          ? server_nonce
+          : session_.write_state.base_nonce
+        , transient_->shared_key
         )
       ) {
         return error::handshake_response_encrypt;
@@ -142,28 +352,183 @@ namespace detail {
       std::copy(
         temp_followup_nonce.begin()
       , temp_followup_nonce.end()
-      , session_.encrypt_nonce.begin()
+      , session_.write_state.base_nonce.begin()
+      );
+
+      auto const keys =
+        transient_->resuming()
+        ? session_.derive_resumed_session_keys(
+            cipher_suite_
+          , transient_->resumption_secret
+          , server_nonce
+          , false
+          )
+        : session_.derive_session_keys(
+            cipher_suite_
+          , transient_->shared_point
+          , false
+          )
+      ;
+      if (!keys) {
+        return error::handshake_session_keys;
+      }
+
+      return {};
+    }
+
+    // Every handshake, resumed or not, hands the client a new ticket if this
+    // server issues them
+    bool
+    issue_ticket(handshake_response& response)
+    noexcept {
+      auto const tickets = session_.identity->get_ticket_key();
+      auto const lifetime =
+        tickets == nullptr ? 0 : tickets->lifetime().count()
+      ;
+      if (lifetime <= 0) {
+        response.clear_ticket();
+        return true;
+      }
+
+      ticket_contents contents;
+      contents.client_public_key = session_.remote_public_key;
+      randombytes_buf(&contents.secret[0], contents.secret.size());
+      contents.issued_at = ticket_clock_now();
+      contents.cipher_suite = cipher_suite_;
+      sealed_ticket sealed;
+      if (!seal_ticket(*tickets, contents, sealed)) {
+        return false;
+      }
+      response.set_ticket(
+        static_cast<uint32_t>(
+          std::min<decltype(lifetime)>(
+            lifetime
+          , std::numeric_limits<uint32_t>::max()
+          )
+        )
+      , sealed
+      , contents.secret
+      );
+      return true;
+    }
+
+    void
+    await_early_length()
+    noexcept {
+      asio::async_read(
+        stream_
+      , asio::buffer(transient_->early_length)
+      , std::move(*this)
       );
+    }
 
+    std::error_code
+    prepare_early_frame() {
+      auto const length = early_data_length(transient_->early_length);
+      if (length == 0 || length > max_early_data_size) {
+        return error::handshake_early_data;
+      }
+      transient_->early_frame.resize(early_frame_size(length));
       return {};
     }
 
+    void
+    await_early_frame()
+    noexcept {
+      asio::async_read(
+        stream_
+      , asio::buffer(transient_->early_frame)
+      , std::move(*this)
+      );
+    }
+
+    // Expects the response key to be in the shared key's place. The payload
+    // waits in the read half for the responder or the stream's first read.
+    std::error_code
+    open_early_data() {
+      if (
+        !detail::open_early_data(
+          transient_->shared_key
+        , transient_->reply_nonce
+        , early_data_length(transient_->early_length)
+        , transient_->early_frame
+        , session_.read_state.early_data
+        )
+      ) {
+        return error::handshake_early_data;
+      }
+      return {};
+    }
+
+    std::error_code
+    respond(no_responder&)
+    noexcept {
+      return {};
+    }
+
+    // Hands the early data (if any) to the responder instead of the stream's
+    // first read, and encrypts whatever it returns as the first message
+    template <typename R>
+    std::error_code
+    respond(R& responder) {
+      auto& early_data = session_.read_state.early_data;
+      transient_->first_message = responder(
+        gsl::span<byte const>(
+          early_data.data()
+        , static_cast<std::ptrdiff_t>(early_data.size())
+        )
+      );
+      std::vector<byte>().swap(early_data);
+      auto& first_message = transient_->first_message;
+      if (first_message.empty()) {
+        return {};
+      }
+      auto& state = session_.write_state;
+      return
+        encrypt_message_in_place(
+          state
+        , gsl::as_span(first_message)
+        , state.header_buffer
+        , state.mac
+        )
+      ;
+    }
+
+    // The response and the first message (if any) go out as a single gather
+    // write
     void
     send_hello_response()
     noexcept {
+      auto const& state = session_.write_state;
+      auto const& first_message = transient_->first_message;
+      // Without a first message, only the response goes out
+      auto const framed = first_message.empty() ? 0 : ~std::size_t(0);
+      auto const resumed = transient_->resuming() ? ~std::size_t(0) : 0;
+      std::array<asio::const_buffer, 5> const flight{{
+        asio::buffer(transient_->server_nonce, resumed)
+      , asio::buffer(transient_->hello_response_buffer)
+      , asio::buffer(state.header_buffer, framed)
+      , asio::buffer(state.mac, framed)
+      , asio::buffer(first_message)
+      }};
       asio::async_write(
-        socket_
-      , asio::buffer(session_.hello_response_buffer)
+        stream_
+      , flight
       , std::move(*this)
       );
     }
 
-    session_data& session_;
-    socket_type& socket_;
+    session_data<CipherSuite>& session_;
+    Stream& stream_;
+    std::unique_ptr<handshake_state> transient_;
     Authenticator authenticator_;
-    OnSuccess on_success_;
-    OnError on_error_;
+    Completion completion_;
+    Responder responder_;
+    crypto_pool* pool_;
+    byte cipher_suite_;
   };
 }}
 
+#include <asio/unyield.hpp>
+
 #endif
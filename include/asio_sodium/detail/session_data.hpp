@@ -17,45 +17,251 @@
 #ifndef ASIO_SODIUM_777dbf21_f3d8_4d87_8a5b_208d2f9259fa
 #define ASIO_SODIUM_777dbf21_f3d8_4d87_8a5b_208d2f9259fa
 
-#include "handshake_hello.hpp"
-#include "handshake_response.hpp"
+#include "../crypto_pool.hpp"
+#include "../local_identity.hpp"
+
+#include "handler_memory.hpp"
+#include "handshake_ticket.hpp"
+#include "locked_arena.hpp"
 #include "message_header.hpp"
+#include "receive_buffer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
 
 namespace asio_sodium {
 namespace detail {
+  constexpr std::size_t cache_line_size = 64;
+
+  // Everything an in-flight read touches. After the handshake, base_nonce is
+  // the base nonce for incoming messages (see next_message_nonce).
+  template <typename CipherSuite>
+  struct read_half {
+    nonce base_nonce;
+    uint64_t counter = 0;
+    locked<typename CipherSuite::key_state> key;
+    std::array<byte, CipherSuite::mac_size> mac;
+    typename message_header<CipherSuite>::buffer header_buffer;
+    receive_buffer received;
+    handler_memory memory;
+    operation_memory operation;
+    // Decrypts the chunks of chunked messages, if set
+    crypto_pool* pool = nullptr;
+    job_memory jobs;
+    // Early data from the handshake (server side only), which the first read
+    // delivers as an ordinary message. It is last because steady-state reads
+    // never touch it (see session_data).
+    std::vector<byte> early_data;
+  };
+
+  // Everything an in-flight write touches
+  template <typename CipherSuite>
+  struct write_half {
+    nonce base_nonce;
+    uint64_t counter = 0;
+    locked<typename CipherSuite::key_state> key;
+    std::array<byte, CipherSuite::mac_size> mac;
+    typename message_header<CipherSuite>::buffer header_buffer;
+    handler_memory memory;
+    operation_memory operation;
+    // Encrypts the chunks of chunked messages, if set
+    crypto_pool* pool = nullptr;
+    job_memory jobs;
+  };
+
+  template <typename CipherSuite>
   struct session_data {
+    static_assert(
+      sizeof(std::vector<byte>)
+      + sizeof(public_key)
+      + sizeof(shared_identity)
+      + sizeof(std::unique_ptr<resumption_ticket>)
+      >= cache_line_size
+    , "The cold fields no longer keep the halves a cache line apart"
+    );
+
     explicit
     session_data(
       public_key const& remote_public_key_
-    , public_key const& local_public_key_
-    , private_key const& local_private_key_
+    , shared_identity identity_
     )
-    noexcept
       : remote_public_key(remote_public_key_)
-      , local_public_key(local_public_key_)
-      , local_private_key(local_private_key_)
+      , identity(std::move(identity_))
     {}
 
     explicit
     session_data(
-      public_key const& local_public_key_
-    , private_key const& local_private_key_
+      shared_identity identity_
     )
-    noexcept
-      : local_public_key(local_public_key_)
-      , local_private_key(local_private_key_)
+      : identity(std::move(identity_))
     {}
 
-    nonce decrypt_nonce;
-    nonce encrypt_nonce;
+    // Derives independent symmetric keys for each direction from the X25519
+    // point the handshake already computed (see handshake_state), the same way
+    // crypto_kx does: BLAKE2b-512 over the point and the client's and server's
+    // public keys, split in half. Each key is then bound to this connection by
+    // hashing in its direction's base nonce, so both base nonces must already
+    // be set.
+    bool
+    derive_session_keys(
+      byte cipher_suite
+    , shared_point const& point
+    , bool client
+    )
+    noexcept {
+      static_assert(
+        2 * sizeof(session_key) <= crypto_generichash_BYTES_MAX
+      , "session keys too large"
+      );
+      auto const& local_public_key = identity->get_public_key();
+      auto const& client_public_key =
+        client ? local_public_key : remote_public_key
+      ;
+      auto const& server_public_key =
+        client ? remote_public_key : local_public_key
+      ;
+      std::array<byte, sizeof(shared_point) + 2 * sizeof(public_key)> input;
+      auto const after_point =
+        std::copy(point.begin(), point.end(), input.begin())
+      ;
+      std::copy(
+        server_public_key.begin()
+      , server_public_key.end()
+      , std::copy(
+          client_public_key.begin()
+        , client_public_key.end()
+        , after_point
+        )
+      );
+
+      // The first half is the client's receive key and the server's transmit
+      // key
+      std::array<byte, 2 * sizeof(session_key)> keys;
+      auto const hashed =
+        crypto_generichash(
+          &keys[0]
+        , keys.size()
+        , &input[0]
+        , input.size()
+        , nullptr
+        , 0
+        )
+        == 0
+      ;
+      auto const middle = keys.begin() + sizeof(session_key);
+      session_key rx;
+      session_key tx;
+      std::copy(keys.begin(), middle, client ? rx.begin() : tx.begin());
+      std::copy(middle, keys.end(), client ? tx.begin() : rx.begin());
+      auto const result =
+        hashed
+        && install_session_keys(cipher_suite, rx, tx)
+      ;
+      sodium_memzero(&input[0], input.size());
+      sodium_memzero(&keys[0], keys.size());
+      sodium_memzero(&rx[0], rx.size());
+      sodium_memzero(&tx[0], tx.size());
+      return result;
+    }
+
+    // Like derive_session_keys, but for a resumed session, whose keys come
+    // from the resumption secret instead of a key exchange. The server's
+    // random nonce is hashed into the secret first, so a replayed resume hello
+    // doesn't bring back the keys of the session it was captured from.
+    bool
+    derive_resumed_session_keys(
+      byte cipher_suite
+    , session_key const& secret
+    , nonce const& server_nonce
+    , bool client
+    )
+    noexcept {
+      auto const inbound =
+        client
+        ? resumption_subkey::server_to_client
+        : resumption_subkey::client_to_server
+      ;
+      auto const outbound =
+        client
+        ? resumption_subkey::client_to_server
+        : resumption_subkey::server_to_client
+      ;
+      session_key connection_secret;
+      session_key rx;
+      session_key tx;
+      auto const result =
+        crypto_generichash(
+          &connection_secret[0]
+        , connection_secret.size()
+        , &server_nonce[0]
+        , server_nonce.size()
+        , &secret[0]
+        , secret.size()
+        )
+        == 0
+        && derive_resumption_key(connection_secret, inbound, rx)
+        && derive_resumption_key(connection_secret, outbound, tx)
+        && install_session_keys(cipher_suite, rx, tx)
+      ;
+      sodium_memzero(&connection_secret[0], connection_secret.size());
+      sodium_memzero(&rx[0], rx.size());
+      sodium_memzero(&tx[0], tx.size());
+      return result;
+    }
+
+    // One outstanding read and one outstanding write may run concurrently, so
+    // the halves are kept at least a cache line apart. Rather than padding,
+    // the fields only the handshake touches sit between them, after the read
+    // half's early data (see the static_assert below).
+    read_half<CipherSuite> read_state;
     public_key remote_public_key;
-    public_key local_public_key;
-    // TODO - RAII wrapper to wipe this on destruct!
-    private_key local_private_key;
-    message_authentication_code mac;
-    handshake_hello::buffer hello_buffer;
-    handshake_response::buffer hello_response_buffer;
-    message_header::buffer header_buffer;
+    shared_identity identity;
+    // The ticket the server issued during the handshake, if any (client side
+    // only)
+    std::unique_ptr<resumption_ticket> ticket;
+    write_half<CipherSuite> write_state;
+
+  private:
+    bool
+    install_session_keys(
+      byte cipher_suite
+    , session_key& rx
+    , session_key& tx
+    )
+    noexcept {
+      return
+        bind_session_key(rx, read_state.base_nonce)
+        && bind_session_key(tx, write_state.base_nonce)
+        && CipherSuite::set_key(read_state.key, cipher_suite, rx)
+        && CipherSuite::set_key(write_state.key, cipher_suite, tx)
+      ;
+    }
+
+    static bool
+    bind_session_key(
+      session_key& key
+    , nonce const& base_nonce
+    )
+    noexcept {
+      session_key bound;
+      auto const result =
+        crypto_generichash(
+          &bound[0]
+        , bound.size()
+        , &base_nonce[0]
+        , base_nonce.size()
+        , &key[0]
+        , key.size()
+        )
+        == 0
+      ;
+      std::copy(bound.begin(), bound.end(), key.begin());
+      sodium_memzero(&bound[0], bound.size());
+      return result;
+    }
   };
 }}
 
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_494a1de4_a0e3_45a2_8bde_1779736e1fcc
+#define ASIO_SODIUM_494a1de4_a0e3_45a2_8bde_1779736e1fcc
+
+#include <asio/io_service.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // Fixed-size slots for objects of type T, carved out of chunks owned by an
+  // io_service. Freed slots are reused before a new chunk is allocated, and
+  // chunks are only returned when the io_service is destroyed, so a busy
+  // server settles into a stable footprint instead of churning the heap.
+  template <typename T>
+  class slab_service final : public asio::io_service::service {
+  public:
+    static asio::io_service::id id;
+
+    static constexpr std::size_t
+    slots_per_chunk = 64;
+
+    explicit
+    slab_service(
+      asio::io_service& io
+    )
+      : asio::io_service::service(io)
+    {}
+
+    void*
+    allocate() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_) {
+        add_chunk();
+      }
+      auto const result = free_;
+      free_ = free_->next;
+      ++in_use_;
+      return result;
+    }
+
+    void
+    deallocate(void* pointer) noexcept {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto const released = static_cast<slot*>(pointer);
+      released->next = free_;
+      free_ = released;
+      --in_use_;
+    }
+
+    std::size_t
+    capacity() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return chunks_.size() * slots_per_chunk;
+    }
+
+    std::size_t
+    in_use() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return in_use_;
+    }
+
+  private:
+    union slot {
+      slot* next;
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    void
+    shutdown_service() override {}
+
+    void
+    add_chunk() {
+      chunks_.emplace_back(new slot[slots_per_chunk]);
+      auto& chunk = chunks_.back();
+      for (std::size_t i = 0; i < slots_per_chunk; ++i) {
+        chunk[i].next = free_;
+        free_ = &chunk[i];
+      }
+    }
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<slot[]>> chunks_;
+    slot* free_ = nullptr;
+    std::size_t in_use_ = 0;
+  };
+
+  template <typename T>
+  asio::io_service::id slab_service<T>::id;
+}}
+
+#endif
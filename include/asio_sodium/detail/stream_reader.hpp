@@ -0,0 +1,392 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_3adb594d_a992_4345_855f_9eec10b7425e
+#define ASIO_SODIUM_3adb594d_a992_4345_855f_9eec10b7425e
+
+#include "../errors.hpp"
+
+#include "locked_arena.hpp"
+#include "message_header.hpp"
+#include "message_nonce.hpp"
+#include "message_stream.hpp"
+#include "session_data.hpp"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#include <asio/coroutine.hpp>
+#pragma clang diagnostic pop
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/post.hpp>
+#include <asio/read.hpp>
+#pragma clang diagnostic pop
+
+#include <asio/yield.hpp>
+
+#include <sodium.h>
+
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // Reads a stream (see message_stream.hpp), handing each decrypted chunk to
+  // the sink as a span that is only valid for the duration of the call. Only
+  // one chunk is held at a time, so memory stays constant however long the
+  // stream is. Like message_reader, calling the reader moves it into the read
+  // half's operation memory, and asio only ever holds a pointer to it.
+  template <
+    typename CipherSuite
+  , typename Stream
+  , typename Sink
+  , typename Resumable
+  >
+  class stream_reader final : asio::coroutine {
+    static constexpr std::size_t
+    frame_capacity = stream_chunk_size + stream_chunk_overhead;
+
+    struct step {
+      stream_reader* reader;
+
+      using allocator_type = handler_allocator<void>;
+
+      allocator_type
+      get_allocator() const noexcept {
+        return reader->get_allocator();
+      }
+
+      void
+      operator()(
+        std::error_code ec = std::error_code()
+      , std::size_t bytes = 0
+      ) const {
+        reader->resume(ec, bytes);
+      }
+    };
+
+  public:
+    using allocator_type = handler_allocator<void>;
+
+    explicit
+    stream_reader(
+      Sink&& sink
+    , Stream& stream
+    , read_half<CipherSuite>& state
+    , Resumable&& resumable
+    )
+      : sink_(std::move(sink))
+      , stream_(stream)
+      , state_(state)
+      , resumable_(std::move(resumable))
+        // One ciphertext frame and one plaintext chunk, for the whole stream
+      , buffers_(new byte[frame_capacity + stream_chunk_size])
+      , secretstream_(new locked<stream_state>())
+    {}
+
+    stream_reader(stream_reader&&) = default;
+
+    void
+    operator()() {
+      auto& memory = state_.operation;
+      auto const block = memory.allocate(sizeof(stream_reader));
+      stream_reader* reader;
+      try {
+        reader = new (block) stream_reader(std::move(*this));
+      } catch (...) {
+        memory.deallocate(block);
+        throw;
+      }
+      reader->resume(std::error_code(), 0);
+    }
+
+    allocator_type
+    get_allocator() const noexcept {
+      return allocator_type(state_.memory);
+    }
+
+  private:
+    enum class action {
+      receive
+    , read_frame_remainder
+    , post_continuation
+    , complete
+    };
+
+    // As in message_reader, the next step is started last
+    void
+    resume(
+      std::error_code ec
+    , std::size_t bytes
+    ) {
+      if (ec) {
+        result_ = ec;
+      } else {
+        switch (advance(bytes)) {
+        case action::receive:
+          receive();
+          return;
+        case action::read_frame_remainder:
+          read_frame_remainder();
+          return;
+        case action::post_continuation:
+          post_continuation();
+          return;
+        case action::complete:
+          break;
+        }
+      }
+      complete(result_);
+    }
+
+    // The opening frame and every chunk frame are read the same way: a
+    // header, then a frame that is either pulled through the receive buffer
+    // or read directly once the buffered prefix is used up
+    action
+    advance(std::size_t bytes) {
+      reenter (this) {
+        // Early data is an ordinary message, so it can't open a stream. It
+        // stays pending for the next ordinary read.
+        if (!state_.early_data.empty()) {
+          result_ = error::message_kind;
+          yield return action::post_continuation;
+          yield break;
+        }
+
+        while (!final_) {
+          while (state_.received.size() < state_.header_buffer.size()) {
+            yield return action::receive;
+            state_.received.commit(bytes);
+          }
+          state_.received.take(gsl::as_span(state_.header_buffer));
+          result_ = process_header();
+          if (result_) {
+            yield break;
+          }
+
+          if (frame_size_ <= state_.received.capacity()) {
+            while (state_.received.size() < frame_size_) {
+              yield return action::receive;
+              state_.received.commit(bytes);
+            }
+          }
+          frame_received_ = state_.received.take(
+            gsl::span<byte>(&buffers_[0], frame_size_)
+          );
+          if (frame_received_ < frame_size_) {
+            yield return action::read_frame_remainder;
+          }
+
+          result_ = opened_ ? pull_chunk() : open();
+          if (result_) {
+            yield break;
+          }
+        }
+        if (!suspended_) {
+          // Never invoke the handler from within the initiating function
+          yield return action::post_continuation;
+        }
+      }
+      return action::complete;
+    }
+
+    // Releases the operation memory before invoking the handler, so that the
+    // handler can start the next read in the same block
+    void
+    complete(std::error_code ec) {
+      auto resumable = std::move(resumable_);
+      auto const total = total_;
+      auto& memory = state_.operation;
+      this->~stream_reader();
+      memory.deallocate(this);
+      resumable(ec, ec ? 0 : total);
+    }
+
+    void
+    receive() {
+      suspended_ = true;
+      stream_.async_read_some(
+        state_.received.prepare()
+      , step{this}
+      );
+    }
+
+    void
+    read_frame_remainder()
+    noexcept {
+      suspended_ = true;
+      asio::async_read(
+        stream_
+      , asio::buffer(&buffers_[0], frame_size_) + frame_received_
+      , step{this}
+      );
+    }
+
+    void
+    post_continuation() {
+      asio::post(
+        stream_.get_executor()
+      , step{this}
+      );
+    }
+
+    std::error_code
+    process_header() {
+      nonce header_nonce;
+      if (
+        !next_message_nonce(
+          state_.base_nonce
+        , state_.counter
+        , header_nonce
+        )
+      ) {
+        return error::message_nonce_exhausted;
+      }
+
+      auto const header = message_header<CipherSuite>::decrypt(
+        state_.header_buffer
+      , header_nonce
+      , state_.key
+      );
+
+      if (!header) {
+        return error::message_header_decrypt;
+      }
+
+      // The header's nonce is used up by now, so a kind mismatch (like any
+      // other failure here) ends the connection rather than leaving the
+      // message for another kind of read
+      auto const length = header->message_length();
+      if (!opened_) {
+        if (header->kind() != message_kind::stream_start) {
+          return error::message_kind;
+        }
+        if (length != std::tuple_size<stream_opening>::value) {
+          return error::message_decrypt;
+        }
+        frame_size_ = CipherSuite::mac_size + length;
+      } else {
+        if (header->kind() != message_kind::stream_chunk) {
+          return error::message_kind;
+        }
+        if (length > frame_capacity) {
+          return error::message_too_large;
+        }
+        if (length < stream_chunk_overhead) {
+          return error::message_decrypt;
+        }
+        frame_size_ = length;
+      }
+      return {};
+    }
+
+    // The opening frame is an ordinary message holding the secretstream key
+    // and header
+    std::error_code
+    open()
+    noexcept {
+      nonce data_nonce;
+      if (
+        !next_message_nonce(
+          state_.base_nonce
+        , state_.counter
+        , data_nonce
+        )
+      ) {
+        return error::message_nonce_exhausted;
+      }
+
+      stream_opening opening;
+      auto const frame = &buffers_[0];
+      auto result = std::error_code();
+      if (
+        !CipherSuite::decrypt(
+          state_.key
+        , &opening[0]
+        , frame + CipherSuite::mac_size
+        , frame
+        , opening.size()
+        , data_nonce
+        )
+        ||
+        crypto_secretstream_xchacha20poly1305_init_pull(
+          &secretstream()
+        , &opening[stream_header_offset]
+        , &opening[stream_key_offset]
+        )
+        != 0
+      ) {
+        result = error::message_decrypt;
+      }
+      sodium_memzero(&opening[0], opening.size());
+      opened_ = true;
+      return result;
+    }
+
+    std::error_code
+    pull_chunk() {
+      auto const plaintext = &buffers_[frame_capacity];
+      unsigned long long length;
+      unsigned char tag;
+      if (
+        crypto_secretstream_xchacha20poly1305_pull(
+          &secretstream()
+        , plaintext
+        , &length
+        , &tag
+        , &buffers_[0]
+        , frame_size_
+        , nullptr
+        , 0
+        )
+        != 0
+      ) {
+        return error::message_decrypt;
+      }
+
+      total_ += length;
+      final_ = tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+      sink_(gsl::span<byte>(plaintext, static_cast<std::ptrdiff_t>(length)));
+      return {};
+    }
+
+    stream_state&
+    secretstream() noexcept {
+      return *secretstream_;
+    }
+
+    Sink sink_;
+    Stream& stream_;
+    read_half<CipherSuite>& state_;
+    Resumable resumable_;
+    std::unique_ptr<byte[]> buffers_;
+    std::unique_ptr<locked<stream_state>> secretstream_;
+    std::size_t frame_size_ = 0;
+    std::size_t frame_received_ = 0;
+    uint64_t total_ = 0;
+    std::error_code result_;
+    bool opened_ = false;
+    bool final_ = false;
+    bool suspended_ = false;
+  };
+}}
+
+#include <asio/unyield.hpp>
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_e7144e85_b1a8_4e5e_b84d_03483e8637b1
+#define ASIO_SODIUM_e7144e85_b1a8_4e5e_b84d_03483e8637b1
+
+#include "../errors.hpp"
+
+#include "locked_arena.hpp"
+#include "message_header.hpp"
+#include "message_nonce.hpp"
+#include "message_stream.hpp"
+#include "message_writer.hpp"
+#include "session_data.hpp"
+
+#include <asio/post.hpp>
+#include <asio/write.hpp>
+
+#include <sodium.h>
+
+#include <array>
+#include <memory>
+#include <new>
+
+namespace asio_sodium {
+namespace detail {
+  // Writes a stream (see message_stream.hpp) of whatever the source produces.
+  // The source is called with a span of at most stream_chunk_size bytes to
+  // fill and returns how many it filled; returning zero ends the stream.
+  //
+  // The writer keeps two frames: while one is being written, the next chunk
+  // is pulled from the source and encrypted into the other, so memory stays
+  // constant however long the stream is. Like chunked_writer, calling the
+  // writer moves it into the write half's operation memory, and from then on
+  // it only runs on the stream's executor.
+  template <
+    typename CipherSuite
+  , typename Stream
+  , typename Source
+  , typename Resumable
+  >
+  class stream_writer final {
+    using mac_type = std::array<byte, CipherSuite::mac_size>;
+
+    static constexpr std::size_t
+    frame_capacity = stream_chunk_size + stream_chunk_overhead;
+
+    struct frame {
+      typename message_header<CipherSuite>::buffer header{};
+      std::size_t size = 0;
+    };
+
+    struct step {
+      stream_writer* writer;
+
+      using allocator_type = handler_allocator<void>;
+
+      allocator_type
+      get_allocator() const noexcept {
+        return writer->get_allocator();
+      }
+
+      void
+      operator()(
+        std::error_code ec
+      , std::size_t
+      ) const {
+        writer->written(ec);
+      }
+    };
+
+  public:
+    using allocator_type = handler_allocator<void>;
+
+    explicit
+    stream_writer(
+      Source&& source
+    , Stream& stream
+    , write_half<CipherSuite>& state
+    , Resumable&& resumable
+    )
+      : source_(std::move(source))
+      , stream_(stream)
+      , state_(state)
+      , resumable_(std::move(resumable))
+        // One plaintext chunk and two ciphertext frames, for the whole stream
+      , buffers_(new byte[stream_chunk_size + 2 * frame_capacity])
+      , secretstream_(new locked<stream_state>())
+    {}
+
+    stream_writer(stream_writer&&) = default;
+
+    void
+    operator()() {
+      auto& memory = state_.operation;
+      auto const block = memory.allocate(sizeof(stream_writer));
+      stream_writer* writer;
+      try {
+        writer = new (block) stream_writer(std::move(*this));
+      } catch (...) {
+        memory.deallocate(block);
+        throw;
+      }
+      asio::post(stream_.get_executor(), [writer] { writer->start(); });
+    }
+
+    allocator_type
+    get_allocator() const noexcept {
+      return allocator_type(state_.memory);
+    }
+
+  private:
+    void
+    start() {
+      result_ = open();
+      pump();
+    }
+
+    // Encrypts the opening frame, which carries a new secretstream key and
+    // the secretstream header
+    std::error_code
+    open() {
+      stream_opening opening;
+      auto const key = &opening[stream_key_offset];
+      randombytes_buf(key, crypto_secretstream_xchacha20poly1305_KEYBYTES);
+      if (
+        crypto_secretstream_xchacha20poly1305_init_push(
+          &secretstream()
+        , &opening[stream_header_offset]
+        , key
+        )
+        != 0
+      ) {
+        sodium_memzero(&opening[0], opening.size());
+        return error::message_encrypt;
+      }
+
+      auto const result = encrypt_message(
+        state_
+      , gsl::as_span(opening)
+      , &opening_[0]
+      , opening_header_
+      , opening_mac_
+      , message_kind::stream_start
+      );
+      sodium_memzero(&opening[0], opening.size());
+      return result;
+    }
+
+    // Pulls the next chunk from the source and encrypts it into a free frame
+    std::error_code
+    fill() {
+      auto const slot = filled_ % frames_.size();
+      auto& filling = frames_[slot];
+      gsl::span<byte> const plaintext{&buffers_[0], stream_chunk_size};
+      std::size_t const length = source_(plaintext);
+      if (length > stream_chunk_size) {
+        return error::message_too_large;
+      }
+
+      auto const final = length == 0;
+      unsigned long long ciphertext_length;
+      if (
+        crypto_secretstream_xchacha20poly1305_push(
+          &secretstream()
+        , ciphertext(slot)
+        , &ciphertext_length
+        , plaintext.data()
+        , length
+        , nullptr
+        , 0
+        , final
+          ? crypto_secretstream_xchacha20poly1305_TAG_FINAL
+          : crypto_secretstream_xchacha20poly1305_TAG_MESSAGE
+        )
+        != 0
+      ) {
+        return error::message_encrypt;
+      }
+
+      nonce header_nonce;
+      if (
+        !next_message_nonce(
+          state_.base_nonce
+        , state_.counter
+        , header_nonce
+        )
+      ) {
+        return error::message_nonce_exhausted;
+      }
+
+      message_header<CipherSuite> header(filling.header);
+      header.set_message_length(
+        static_cast<uint32_t>(ciphertext_length)
+      , message_kind::stream_chunk
+      );
+      if (!header.encrypt_to(header_nonce, state_.key)) {
+        return error::message_header_encrypt;
+      }
+
+      filling.size = static_cast<std::size_t>(ciphertext_length);
+      total_ += length;
+      final_filled_ = final;
+      ++filled_;
+      return {};
+    }
+
+    void
+    written(std::error_code ec) {
+      writing_ = false;
+      if (ec) {
+        if (!result_) {
+          result_ = ec;
+        }
+      } else if (!opened_) {
+        opened_ = true;
+      } else {
+        ++written_;
+      }
+      pump();
+    }
+
+    // Keeps a write in flight and the other frame filled, and completes once
+    // the final frame is out
+    void
+    pump() {
+      while (!result_) {
+        if (!writing_ && write_next_frame()) {
+          continue;
+        }
+        if (final_filled_ || filled_ - written_ == frames_.size()) {
+          break;
+        }
+        result_ = fill();
+      }
+
+      auto const finished =
+        result_ || (final_filled_ && written_ == filled_)
+      ;
+      if (finished && !writing_) {
+        complete(result_, result_ ? 0 : total_);
+      }
+    }
+
+    bool
+    write_next_frame() {
+      if (!opened_) {
+        std::array<asio::const_buffer, 3> const opening{{
+          asio::buffer(opening_header_)
+        , asio::buffer(opening_mac_)
+        , asio::buffer(opening_)
+        }};
+        writing_ = true;
+        asio::async_write(stream_, opening, step{this});
+        return true;
+      }
+      if (written_ == filled_) {
+        return false;
+      }
+      auto const slot = written_ % frames_.size();
+      auto& next = frames_[slot];
+      std::array<asio::const_buffer, 2> const buffers{{
+        asio::buffer(next.header)
+      , asio::buffer(ciphertext(slot), next.size)
+      }};
+      writing_ = true;
+      asio::async_write(stream_, buffers, step{this});
+      return true;
+    }
+
+    stream_state&
+    secretstream() noexcept {
+      return *secretstream_;
+    }
+
+    byte*
+    ciphertext(std::size_t slot) noexcept {
+      return &buffers_[stream_chunk_size + slot * frame_capacity];
+    }
+
+    // Releases the operation memory before invoking the handler, so that the
+    // handler can start the next write in the same block
+    void
+    complete(
+      std::error_code ec
+    , uint64_t bytes
+    ) {
+      auto resumable = std::move(resumable_);
+      auto& memory = state_.operation;
+      this->~stream_writer();
+      memory.deallocate(this);
+      resumable(ec, bytes);
+    }
+
+    Source source_;
+    Stream& stream_;
+    write_half<CipherSuite>& state_;
+    Resumable resumable_;
+    std::unique_ptr<byte[]> buffers_;
+    std::unique_ptr<locked<stream_state>> secretstream_;
+    typename message_header<CipherSuite>::buffer opening_header_{};
+    mac_type opening_mac_{};
+    stream_opening opening_{};
+    std::array<frame, 2> frames_;
+    std::size_t filled_ = 0;
+    std::size_t written_ = 0;
+    uint64_t total_ = 0;
+    std::error_code result_;
+    bool opened_ = false;
+    bool final_filled_ = false;
+    bool writing_ = false;
+  };
+}}
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ASIO_SODIUM_e29cb42d_7c80_4b30_9876_b5ee324bf044
+#define ASIO_SODIUM_e29cb42d_7c80_4b30_9876_b5ee324bf044
+
+#include "../errors.hpp"
+
+#include "buffer_pool.hpp"
+#include "message_writer.hpp"
+#include "session_data.hpp"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/write.hpp>
+#pragma clang diagnostic pop
+
+#include <memory>
+#include <vector>
+
+namespace asio_sodium {
+namespace detail {
+  // A non-owning buffer sequence, so that handing a batch to asio doesn't copy
+  // the underlying vector
+  class const_buffer_span {
+  public:
+    using value_type = asio::const_buffer;
+    using const_iterator = asio::const_buffer const*;
+
+    const_buffer_span(
+      std::vector<asio::const_buffer> const& buffers
+    ) noexcept
+      : begin_(buffers.data())
+      , end_(buffers.data() + buffers.size())
+    {}
+
+    const_iterator
+    begin() const noexcept { return begin_; }
+
+    const_iterator
+    end() const noexcept { return end_; }
+
+  private:
+    const_iterator begin_;
+    const_iterator end_;
+  };
+
+  // Accepts messages while a write is in progress. Whenever the stream is free,
+  // every pending message is encrypted and the whole batch is flushed with a
+  // single gather write. Each message's handler is invoked once the batch
+  // containing it has been written.
+  //
+  // Messages are either encrypted in place (destructive) or into a buffer from
+  // the queue's pool, which is recycled as soon as the write completes. Each
+  // message's operation (which holds its handler) lives in a block from the
+  // queue's recycler, so in steady state queueing a message doesn't allocate.
+  template <
+    typename CipherSuite
+  , typename Stream
+  >
+  class write_queue final {
+    class operation {
+    public:
+      explicit
+      operation(
+        gsl::span<byte const> message_
+      , gsl::span<byte> ciphertext_
+      , buffer_pool::buffer&& storage_
+      ) noexcept
+        : message(message_)
+        , ciphertext(ciphertext_)
+        , storage(std::move(storage_))
+      {}
+
+      virtual ~operation() = default;
+
+      virtual void
+      complete(std::error_code ec, std::size_t bytes) = 0;
+
+      block_recycler::block block{};
+      gsl::span<byte const> message;
+      gsl::span<byte> ciphertext;
+      buffer_pool::buffer storage;
+      typename message_header<CipherSuite>::buffer header_buffer;
+      std::array<byte, CipherSuite::mac_size> mac;
+      std::error_code ec;
+    };
+
+    template <typename WriteHandler>
+    class handler_operation final : public operation {
+    public:
+      handler_operation(
+        gsl::span<byte const> message_
+      , gsl::span<byte> ciphertext_
+      , buffer_pool::buffer&& storage_
+      , WriteHandler&& handler
+      )
+        : operation(message_, ciphertext_, std::move(storage_))
+        , handler_(std::move(handler))
+      {}
+
+      void
+      complete(std::error_code result, std::size_t bytes) override {
+        handler_(result, bytes);
+      }
+
+    private:
+      WriteHandler handler_;
+    };
+
+    struct on_flushed {
+      write_queue* queue;
+
+      using allocator_type = handler_allocator<void>;
+
+      allocator_type
+      get_allocator() const noexcept {
+        return allocator_type(queue->state_.memory);
+      }
+
+      void
+      operator()(
+        std::error_code ec
+      , std::size_t
+      ) {
+        queue->complete(ec);
+      }
+    };
+
+  public:
+    explicit
+    write_queue(
+      Stream& stream
+    , write_half<CipherSuite>& state
+    ) noexcept
+      : stream_(stream)
+      , state_(state)
+    {}
+
+    write_queue(write_queue const&) = delete;
+    write_queue& operator=(write_queue const&) = delete;
+
+    ~write_queue() {
+      if (destroyed_) {
+        *destroyed_ = true;
+      }
+      for (auto op : pending_) {
+        recycle(op);
+      }
+      for (auto op : in_flight_) {
+        recycle(op);
+      }
+    }
+
+    // Encrypts the message in place
+    template <typename WriteHandler>
+    void
+    enqueue(
+      gsl::span<byte> message
+    , WriteHandler&& handler
+    ) {
+      push(
+        message
+      , message
+      , buffer_pool::buffer()
+      , std::forward<WriteHandler>(handler)
+      );
+    }
+
+    // Leaves the message untouched and encrypts into a pooled buffer
+    template <typename WriteHandler>
+    void
+    enqueue_copy(
+      gsl::span<byte const> message
+    , WriteHandler&& handler
+    ) {
+      if (!pool_) {
+        pool_.reset(new buffer_pool);
+      }
+      auto pooled = pool_->acquire(static_cast<std::size_t>(message.size()));
+      gsl::span<byte> ciphertext(pooled.data(), message.size());
+      push(
+        message
+      , ciphertext
+      , std::move(pooled)
+      , std::forward<WriteHandler>(handler)
+      );
+    }
+
+  private:
+    template <typename WriteHandler>
+    void
+    push(
+      gsl::span<byte const> message
+    , gsl::span<byte> ciphertext
+    , buffer_pool::buffer&& storage
+    , WriteHandler&& handler
+    ) {
+      using handler_type = typename std::decay<WriteHandler>::type;
+      using operation_type = handler_operation<handler_type>;
+      auto const block = blocks_.allocate(sizeof(operation_type));
+      operation* op;
+      try {
+        op = new (block.memory) operation_type(
+          message
+        , ciphertext
+        , std::move(storage)
+        , handler_type(std::forward<WriteHandler>(handler))
+        );
+      } catch (...) {
+        blocks_.deallocate(block);
+        throw;
+      }
+      op->block = block;
+      try {
+        pending_.push_back(op);
+      } catch (...) {
+        recycle(op);
+        throw;
+      }
+      if (!writing_) {
+        flush();
+      }
+    }
+
+    void
+    flush() {
+      writing_ = true;
+      in_flight_.swap(pending_);
+      buffers_.clear();
+      for (auto op : in_flight_) {
+        op->ec = encrypt_message(
+          state_
+        , op->message
+        , op->ciphertext.data()
+        , op->header_buffer
+        , op->mac
+        );
+        if (!op->ec) {
+          buffers_.push_back(asio::buffer(op->header_buffer));
+          buffers_.push_back(asio::buffer(op->mac));
+          buffers_.push_back(
+            asio::buffer(
+              op->ciphertext.data()
+            , static_cast<std::size_t>(op->ciphertext.size())
+            )
+          );
+        }
+      }
+      asio::async_write(
+        stream_
+      , const_buffer_span(buffers_)
+      , on_flushed{this}
+      );
+    }
+
+    void
+    complete(std::error_code ec) {
+      // Handlers may queue more messages, which land in pending_ and go out
+      // with the next batch. They may also destroy the queue (a coroutine
+      // resumed by its handler can drop the stream), so the batch is moved out
+      // first and the queue isn't touched again if that happens.
+      auto completed = std::move(in_flight_);
+      for (auto op : completed) {
+        if (op->storage.capacity() != 0) {
+          pool_->release(std::move(op->storage));
+        }
+      }
+
+      bool destroyed = false;
+      destroyed_ = &destroyed;
+      for (auto op : completed) {
+        if (op->ec) {
+          op->complete(op->ec, 0);
+        } else if (ec) {
+          op->complete(ec, 0);
+        } else {
+          op->complete(
+            std::error_code()
+          , static_cast<std::size_t>(op->message.size())
+          );
+        }
+      }
+      if (destroyed) {
+        // The recycler went with the queue
+        for (auto op : completed) {
+          auto const memory = op->block.memory;
+          op->~operation();
+          ::operator delete(memory);
+        }
+        return;
+      }
+      destroyed_ = nullptr;
+
+      for (auto op : completed) {
+        recycle(op);
+      }
+      // Hand the vector back so its capacity is reused
+      completed.clear();
+      in_flight_ = std::move(completed);
+
+      if (pending_.empty()) {
+        writing_ = false;
+      } else {
+        flush();
+      }
+    }
+
+    void
+    recycle(operation* op) noexcept {
+      auto const block = op->block;
+      op->~operation();
+      blocks_.deallocate(block);
+    }
+
+    Stream& stream_;
+    write_half<CipherSuite>& state_;
+    block_recycler blocks_;
+    std::vector<operation*> pending_;
+    std::vector<operation*> in_flight_;
+    std::vector<asio::const_buffer> buffers_;
+    // Created by the first enqueue_copy
+    std::unique_ptr<buffer_pool> pool_;
+    bool writing_ = false;
+    // Set while handlers run, so complete() can tell when one of them
+    // destroyed the queue
+    bool* destroyed_ = nullptr;
+  };
+}}
+
+#endif
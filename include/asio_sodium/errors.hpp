@@ -22,13 +22,20 @@ namespace asio_sodium {
     handshake_hello_encrypt
   , handshake_hello_decrypt
   , handshake_authentication
+  , handshake_shared_key
+  , handshake_cipher_suite
+  , handshake_session_keys
   , handshake_response_encrypt
   , handshake_response_decrypt
+  , handshake_ticket
+  , handshake_early_data
   , message_header_encrypt
   , message_header_decrypt
   , message_too_large
+  , message_nonce_exhausted
   , message_encrypt
   , message_decrypt
+  , message_kind
   };
 
   class error_category
@@ -49,20 +56,34 @@ namespace asio_sodium {
         return "Couldn't decrypt handshake hello";
       case error::handshake_authentication:
         return "Handshake failed to authenticate";
+      case error::handshake_shared_key:
+        return "Couldn't compute shared key";
+      case error::handshake_cipher_suite:
+        return "Couldn't agree on a cipher suite";
+      case error::handshake_session_keys:
+        return "Couldn't derive session keys";
       case error::handshake_response_encrypt:
         return "Couldn't encrypt handshake response";
       case error::handshake_response_decrypt:
         return "Couldn't decrypt handshake response";
+      case error::handshake_ticket:
+        return "Resumption ticket rejected";
+      case error::handshake_early_data:
+        return "Couldn't seal or open early data";
       case error::message_header_encrypt:
         return "Couldn't encrypt message header";
       case error::message_header_decrypt:
         return "Couldn't decrypt message header";
       case error::message_too_large:
         return "Message too large";
+      case error::message_nonce_exhausted:
+        return "Message nonces exhausted";
       case error::message_encrypt:
         return "Couldn't encrypt message";
       case error::message_decrypt:
         return "Couldn't decrypt message";
+      case error::message_kind:
+        return "Unexpected kind of message";
       }
     }
   };
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_6a61f81c_bb93_435c_b54a_63bc6713e9a2
+#define ASIO_SODIUM_6a61f81c_bb93_435c_b54a_63bc6713e9a2
+
+#include "crypto.hpp"
+#include "resumption.hpp"
+
+#include <sodium.h>
+
+#include <memory>
+#include <new>
+
+namespace asio_sodium {
+  // This end's long-term keypair. Every connection made with the same identity
+  // shares it through a std::shared_ptr<local_identity const> rather than
+  // holding its own copy of the keys. The private key lives in sodium_malloc'd
+  // memory (mlock'ed, between guard pages, read-only once written) and is
+  // wiped when the identity is destroyed. A server identity with a ticket key
+  // issues resumption tickets to its clients (see resumption.hpp).
+  class local_identity final {
+  public:
+    explicit
+    local_identity(
+      public_key const& local_public_key
+    , private_key const& local_private_key
+    , shared_ticket_key tickets = nullptr
+    )
+      : public_key_(local_public_key)
+      , private_key_(
+          sodium_init() < 0
+          ? nullptr
+          : static_cast<private_key*>(sodium_malloc(sizeof(private_key)))
+        )
+      , tickets_(std::move(tickets))
+    {
+      if (!private_key_) {
+        throw std::bad_alloc();
+      }
+      *private_key_ = local_private_key;
+      sodium_mprotect_readonly(private_key_);
+    }
+
+    local_identity(local_identity const&) = delete;
+    local_identity& operator=(local_identity const&) = delete;
+
+    ~local_identity() {
+      sodium_free(private_key_);
+    }
+
+    public_key const&
+    get_public_key() const noexcept { return public_key_; }
+
+    private_key const&
+    get_private_key() const noexcept { return *private_key_; }
+
+    // nullptr unless this identity issues resumption tickets
+    ticket_key const*
+    get_ticket_key() const noexcept { return tickets_.get(); }
+
+  private:
+    public_key public_key_;
+    private_key* private_key_;
+    shared_ticket_key tickets_;
+  };
+
+  using shared_identity = std::shared_ptr<local_identity const>;
+
+  inline shared_identity
+  make_identity(
+    public_key const& local_public_key
+  , private_key const& local_private_key
+  , shared_ticket_key tickets = nullptr
+  ) {
+    return
+      std::make_shared<local_identity const>(
+        local_public_key
+      , local_private_key
+      , std::move(tickets)
+      )
+    ;
+  }
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_335fc198_39e9_46a7_ac64_7a28ea49d67a
+#define ASIO_SODIUM_335fc198_39e9_46a7_ac64_7a28ea49d67a
+
+#include "crypto.hpp"
+#include "detail/buffer_pool.hpp"
+
+#include <memory>
+
+namespace asio_sodium {
+  namespace detail {
+    class pooled_read_buffer;
+  }
+
+  // A decrypted message owned by the socket's receive pool. Copies share the
+  // same storage, which goes back to the pool when the last copy is destroyed.
+  // Messages can be dropped on any thread.
+  class pooled_message final {
+  public:
+    pooled_message() noexcept = default;
+
+    gsl::span<byte>
+    span() const noexcept {
+      return {data(), static_cast<std::ptrdiff_t>(size_)};
+    }
+
+    byte*
+    data() const noexcept {
+      return storage_ ? storage_->data() : nullptr;
+    }
+
+    std::size_t
+    size() const noexcept { return size_; }
+
+    bool
+    empty() const noexcept { return size_ == 0; }
+
+  private:
+    friend class detail::pooled_read_buffer;
+
+    explicit
+    pooled_message(
+      std::shared_ptr<detail::buffer_pool::buffer> storage
+    , std::size_t size
+    ) noexcept
+      : storage_(std::move(storage))
+      , size_(size)
+    {}
+
+    std::shared_ptr<detail::buffer_pool::buffer> storage_;
+    std::size_t size_ = 0;
+  };
+}
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_6abd129e_10d0_4640_9cca_c14fd10437bd
+#define ASIO_SODIUM_6abd129e_10d0_4640_9cca_c14fd10437bd
+
+#include "crypto.hpp"
+
+#include <sodium.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+namespace asio_sodium {
+namespace detail {
+  // A ticket holds the client's public key, the resumption secret, the time
+  // it was issued, and the cipher suite, sealed with crypto_secretbox under
+  // the server's ticket key (see handshake_ticket.hpp)
+  constexpr std::size_t
+  ticket_data_size =
+    crypto_box_PUBLICKEYBYTES
+    + crypto_kdf_KEYBYTES
+    + sizeof(uint64_t)
+    + sizeof(byte)
+  ;
+
+  constexpr std::size_t
+  sealed_ticket_size =
+    crypto_secretbox_NONCEBYTES
+    + crypto_secretbox_MACBYTES
+    + ticket_data_size
+  ;
+
+  using sealed_ticket = std::array<byte, sealed_ticket_size>;
+}
+
+  // The key a server seals its resumption tickets with. It is random and lives
+  // in sodium_malloc'd memory, so tickets only resume sessions with the
+  // servers that share this ticket_key (e.g. the workers of a server_runtime)
+  // until it is destroyed. Give it to the server's identity (see
+  // make_identity) to have the server issue tickets.
+  class ticket_key final {
+  public:
+    using key_type = std::array<byte, crypto_secretbox_KEYBYTES>;
+
+    explicit
+    ticket_key(
+      std::chrono::seconds lifetime = default_lifetime()
+    )
+      : lifetime_(lifetime)
+      , key_(
+          sodium_init() < 0
+          ? nullptr
+          : static_cast<key_type*>(sodium_malloc(sizeof(key_type)))
+        )
+    {
+      if (!key_) {
+        throw std::bad_alloc();
+      }
+      randombytes_buf(&(*key_)[0], key_->size());
+      sodium_mprotect_readonly(key_);
+    }
+
+    ticket_key(ticket_key const&) = delete;
+    ticket_key& operator=(ticket_key const&) = delete;
+
+    ~ticket_key() {
+      sodium_free(key_);
+    }
+
+    static std::chrono::seconds
+    default_lifetime() noexcept { return std::chrono::hours(24); }
+
+    // How long after it is issued the server accepts a ticket
+    std::chrono::seconds
+    lifetime() const noexcept { return lifetime_; }
+
+    key_type const&
+    get_key() const noexcept { return *key_; }
+
+  private:
+    std::chrono::seconds lifetime_;
+    key_type* key_;
+  };
+
+  using shared_ticket_key = std::shared_ptr<ticket_key const>;
+
+  inline shared_ticket_key
+  make_ticket_key(
+    std::chrono::seconds lifetime = ticket_key::default_lifetime()
+  ) {
+    return std::make_shared<ticket_key const>(lifetime);
+  }
+
+  // What a client keeps to resume a session later (see
+  // crypto_stream::async_resume). The sealed ticket is opaque to the client,
+  // but the secret is as sensitive as the session itself, so it is wiped when
+  // the ticket is destroyed. Each resumption issues a new ticket, and a ticket
+  // should only be used once.
+  struct resumption_ticket {
+    detail::sealed_ticket sealed;
+    session_key secret;
+    std::chrono::system_clock::time_point expiry;
+
+    ~resumption_ticket() {
+      sodium_memzero(&secret[0], secret.size());
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_9aca337f_6273_4768_bc67_da0d68e6572d
+#define ASIO_SODIUM_9aca337f_6273_4768_bc67_da0d68e6572d
+
+#include "crypto_pool.hpp"
+#include "crypto_stream.hpp"
+#include "local_identity.hpp"
+
+#include <asio/io_service.hpp>
+#include <asio/steady_timer.hpp>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/ip/tcp.hpp>
+#pragma clang diagnostic pop
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <chrono>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace asio_sodium {
+  // Runs a server across cores without sharing anything between them. Each
+  // worker thread has its own io_service, is pinned to its own core (where the
+  // platform supports it), and accepts on its own SO_REUSEPORT acceptor, so the
+  // kernel spreads incoming connections across workers. A connection is
+  // accepted, handshaken and served entirely on one worker, and the handlers
+  // for it never need a lock.
+  class server_runtime final {
+  public:
+    // How long a worker waits before accepting again after a failed accept.
+    // Running out of file descriptors fails every accept until a connection
+    // closes, so retrying at once would spin.
+    static std::chrono::milliseconds
+    accept_retry_delay() noexcept { return std::chrono::milliseconds(100); }
+
+    explicit
+    server_runtime(
+      std::size_t worker_count = default_worker_count()
+    ) {
+      workers_.reserve(worker_count);
+      for (std::size_t i = 0; i < worker_count; ++i) {
+        workers_.push_back(std::make_unique<worker>());
+      }
+    }
+
+    server_runtime(server_runtime const&) = delete;
+    server_runtime& operator=(server_runtime const&) = delete;
+
+    ~server_runtime() {
+      stop();
+      join();
+    }
+
+    static std::size_t
+    default_worker_count() noexcept {
+      auto const cores = std::thread::hardware_concurrency();
+      return cores == 0 ? 1 : cores;
+    }
+
+    std::size_t
+    size() const noexcept { return workers_.size(); }
+
+    asio::io_service&
+    get_io_service(std::size_t index) noexcept {
+      return workers_[index]->io;
+    }
+
+    // Runs the public-key crypto of the handshakes accepted by later calls to
+    // listen on the pool (nullptr to run it on the workers), so that a burst
+    // of new connections doesn't hold up established ones. The pool must
+    // outlive the runtime's handshakes.
+    void
+    set_handshake_pool(crypto_pool* pool) noexcept {
+      handshake_pool_ = pool;
+    }
+
+    // Opens an acceptor for the endpoint on every worker. Each accepted
+    // connection runs the server handshake on its worker, and then
+    // on_connection(Stream&&) or on_error(error_code) is called there.
+    // Connections are accepted as fast as they arrive, without waiting for
+    // earlier handshakes. Every worker gets its own copy of the callbacks.
+    // The first acceptor binds the endpoint and the rest share its address,
+    // so port 0 picks one port for all of them (see local_endpoint). If any
+    // acceptor fails to open, none of them are left open. Call this before
+    // run.
+    template <
+      typename Stream = crypto_stream<asio::ip::tcp::socket>
+    , typename Authenticator
+    , typename OnConnection
+    , typename OnError
+    >
+    std::error_code
+    listen(
+      asio::ip::tcp::endpoint const& endpoint
+    , shared_identity identity
+    , Authenticator authenticator
+    , OnConnection on_connection
+    , OnError on_error
+    ) {
+      using listener_type =
+        listener<Stream, Authenticator, OnConnection, OnError>
+      ;
+      std::vector<std::shared_ptr<listener_type>> listeners;
+      listeners.reserve(workers_.size());
+      auto bound = endpoint;
+      for (std::size_t i = 0; i < workers_.size(); ++i) {
+        listeners.push_back(
+          std::make_shared<listener_type>(
+            workers_[i]->io
+          , handshake_pool_
+          , identity
+          , authenticator
+          , on_connection
+          , on_error
+          )
+        );
+        // The acceptors opened so far close as the listeners go away
+        auto const ec = listeners.back()->open(bound);
+        if (ec) {
+          return ec;
+        }
+        if (i == 0) {
+          asio::error_code local_ec;
+          bound = listeners.back()->local_endpoint(local_ec);
+          if (local_ec) {
+            return local_ec;
+          }
+        }
+      }
+      for (auto const& opened : listeners) {
+        opened->accept();
+      }
+      local_endpoint_ = bound;
+      return {};
+    }
+
+    // The endpoint the last successful listen bound, with the port filled in
+    asio::ip::tcp::endpoint
+    local_endpoint() const noexcept { return local_endpoint_; }
+
+    // Starts one pinned thread per worker and returns
+    void
+    run() {
+      auto const cores = std::thread::hardware_concurrency();
+      for (std::size_t i = 0; i < workers_.size(); ++i) {
+        auto& pinned = *workers_[i];
+        pinned.thread = std::thread([&pinned] { pinned.io.run(); });
+#if defined(__linux__)
+        if (cores != 0) {
+          cpu_set_t cpus;
+          CPU_ZERO(&cpus);
+          CPU_SET(i % cores, &cpus);
+          pthread_setaffinity_np(
+            pinned.thread.native_handle()
+          , sizeof(cpus)
+          , &cpus
+          );
+        }
+#else
+        static_cast<void>(cores);
+#endif
+      }
+    }
+
+    void
+    stop() noexcept {
+      for (auto& stopping : workers_) {
+        stopping->work.reset();
+        stopping->io.stop();
+      }
+    }
+
+    void
+    join() {
+      for (auto& joining : workers_) {
+        if (joining->thread.joinable()) {
+          joining->thread.join();
+        }
+      }
+    }
+
+  private:
+    struct worker {
+      asio::io_service io;
+      std::unique_ptr<asio::io_service::work> work =
+        std::make_unique<asio::io_service::work>(io)
+      ;
+      std::thread thread;
+    };
+
+    template <
+      typename Stream
+    , typename Authenticator
+    , typename OnConnection
+    , typename OnError
+    >
+    class listener final
+      : public std::enable_shared_from_this<
+          listener<Stream, Authenticator, OnConnection, OnError>
+        >
+    {
+    public:
+      listener(
+        asio::io_service& io
+      , crypto_pool* pool
+      , shared_identity identity
+      , Authenticator authenticator
+      , OnConnection on_connection
+      , OnError on_error
+      )
+        : acceptor_(io)
+        , retry_timer_(io)
+        , socket_(io)
+        , pool_(pool)
+        , identity_(std::move(identity))
+        , authenticator_(std::move(authenticator))
+        , on_connection_(std::move(on_connection))
+        , on_error_(std::move(on_error))
+      {}
+
+      std::error_code
+      open(asio::ip::tcp::endpoint const& endpoint) {
+        asio::error_code ec;
+        acceptor_.open(endpoint.protocol(), ec);
+        if (!ec) {
+          acceptor_.set_option(
+            asio::ip::tcp::acceptor::reuse_address(true)
+          , ec
+          );
+        }
+#if defined(SO_REUSEPORT)
+        if (!ec) {
+          acceptor_.set_option(reuse_port(true), ec);
+        }
+#endif
+        if (!ec) {
+          acceptor_.bind(endpoint, ec);
+        }
+        if (!ec) {
+          acceptor_.listen(asio::socket_base::max_connections, ec);
+        }
+        return ec;
+      }
+
+      asio::ip::tcp::endpoint
+      local_endpoint(asio::error_code& ec) const {
+        return acceptor_.local_endpoint(ec);
+      }
+
+      void
+      accept() {
+        auto self = this->shared_from_this();
+        acceptor_.async_accept(
+          socket_
+        , [self](asio::error_code const& ec) {
+            if (ec == asio::error::operation_aborted) {
+              return;
+            }
+            if (ec) {
+              self->on_error_(ec);
+              self->retry_accept();
+              return;
+            }
+            self->handshake();
+            self->accept();
+          }
+        );
+      }
+
+    private:
+#if defined(SO_REUSEPORT)
+      // A SettableSocketOption for SO_REUSEPORT, which asio doesn't provide
+      class reuse_port final {
+      public:
+        explicit
+        reuse_port(
+          bool enabled
+        ) noexcept
+          : value_(enabled ? 1 : 0)
+        {}
+
+        template <typename Protocol>
+        int
+        level(Protocol const&) const noexcept { return SOL_SOCKET; }
+
+        template <typename Protocol>
+        int
+        name(Protocol const&) const noexcept { return SO_REUSEPORT; }
+
+        template <typename Protocol>
+        void const*
+        data(Protocol const&) const noexcept { return &value_; }
+
+        template <typename Protocol>
+        std::size_t
+        size(Protocol const&) const noexcept { return sizeof(value_); }
+
+      private:
+        int value_;
+      };
+#endif
+
+      void
+      retry_accept() {
+        auto self = this->shared_from_this();
+        retry_timer_.expires_from_now(accept_retry_delay());
+        retry_timer_.async_wait(
+          [self](asio::error_code const& ec) {
+            if (ec != asio::error::operation_aborted) {
+              self->accept();
+            }
+          }
+        );
+      }
+
+      void
+      handshake() {
+        auto self = this->shared_from_this();
+        auto on_success = [self](Stream&& stream) {
+          self->on_connection_(std::move(stream));
+        };
+        auto on_error = [self](std::error_code const& ec, std::size_t) {
+          self->on_error_(ec);
+        };
+        if (pool_ != nullptr) {
+          Stream::async_server_handshake(
+            *pool_
+          , std::move(socket_)
+          , identity_
+          , authenticator_
+          , std::move(on_success)
+          , std::move(on_error)
+          );
+        } else {
+          Stream::async_server_handshake(
+            std::move(socket_)
+          , identity_
+          , authenticator_
+          , std::move(on_success)
+          , std::move(on_error)
+          );
+        }
+        // A moved-from socket is as good as a newly constructed one, so it's
+        // ready for the next accept
+      }
+
+      asio::ip::tcp::acceptor acceptor_;
+      asio::steady_timer retry_timer_;
+      typename Stream::next_layer_type socket_;
+      crypto_pool* pool_;
+      shared_identity identity_;
+      Authenticator authenticator_;
+      OnConnection on_connection_;
+      OnError on_error_;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers_;
+    crypto_pool* handshake_pool_ = nullptr;
+    asio::ip::tcp::endpoint local_endpoint_;
+  };
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ASIO_SODIUM_c9857346_ce6c_4dfb_a655_7548b915920c
+#define ASIO_SODIUM_c9857346_ce6c_4dfb_a655_7548b915920c
+
+#include "detail/slab_service.hpp"
+
+#include <asio/io_service.hpp>
+
+#include <memory>
+
+// A storage policy decides where a crypto_stream's per-connection state (the
+// next layer plus the session) lives. Each policy provides:
+//
+//   pointer<T>       - the owning pointer type
+//   make<T>(io, ...) - constructs a T for a connection on the given io_service
+
+namespace asio_sodium {
+  struct pool_statistics {
+    // Slots allocated so far, whether in use or not
+    std::size_t capacity;
+    // Slots held by live connections
+    std::size_t in_use;
+  };
+
+  // Allocates each connection's state from the general-purpose heap
+  struct heap_storage {
+    template <typename T>
+    using pointer = std::unique_ptr<T>;
+
+    template <
+      typename T
+    , typename ...Args
+    >
+    static pointer<T>
+    make(
+      asio::io_service&
+    , Args&&... args
+    ) {
+      return std::make_unique<T>(std::forward<Args>(args)...);
+    }
+  };
+
+  // Allocates each connection's state from a slab owned by its io_service, so
+  // slots freed by closed connections are reused by new ones
+  struct pooled_storage {
+    template <typename T>
+    class deleter {
+    public:
+      deleter() noexcept = default;
+
+      explicit
+      deleter(
+        detail::slab_service<T>& service
+      ) noexcept
+        : service_(&service)
+      {}
+
+      void
+      operator()(T* pointer) const noexcept {
+        pointer->~T();
+        service_->deallocate(pointer);
+      }
+
+    private:
+      detail::slab_service<T>* service_ = nullptr;
+    };
+
+    template <typename T>
+    using pointer = std::unique_ptr<T, deleter<T>>;
+
+    template <
+      typename T
+    , typename ...Args
+    >
+    static pointer<T>
+    make(
+      asio::io_service& io
+    , Args&&... args
+    ) {
+      auto& service = asio::use_service<detail::slab_service<T>>(io);
+      auto const memory = service.allocate();
+      T* result;
+      try {
+        result = new (memory) T(std::forward<Args>(args)...);
+      } catch (...) {
+        service.deallocate(memory);
+        throw;
+      }
+      return pointer<T>(result, deleter<T>(service));
+    }
+
+    template <typename T>
+    static pool_statistics
+    statistics(asio::io_service& io) {
+      auto const& service = asio::use_service<detail::slab_service<T>>(io);
+      return {service.capacity(), service.in_use()};
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "asio_sodium/crypto_stream.hpp"
+
+#include <asio/coroutine.hpp>
+#include <asio/io_service.hpp>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/local/connect_pair.hpp>
+#include <asio/local/stream_protocol.hpp>
+#pragma clang diagnostic pop
+
+#include <asio/yield.hpp>
+#include <catch.hpp>
+#include <sodium.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Counts every heap allocation in the test binary. (The replacements are kept
+// out of line so that GCC doesn't pair the inlined malloc/free with new/delete
+// expressions and warn about a mismatch.)
+namespace {
+  std::size_t allocation_count = 0;
+}
+
+__attribute__((noinline)) void*
+operator new(std::size_t size) {
+  ++allocation_count;
+  if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void
+operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+__attribute__((noinline)) void
+operator delete(void* pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+
+using namespace asio_sodium;
+
+namespace {
+  using local_stream = crypto_stream<asio::local::stream_protocol::socket>;
+
+  constexpr std::size_t warmup_rounds = 10;
+  constexpr std::size_t measured_rounds = 100;
+
+  enum class write_method {
+    destructive
+  , queued_destructive
+  , copying
+  };
+
+  template <typename Handler>
+  void
+  write_message(
+    local_stream& stream
+  , write_method method
+  , std::vector<byte>& message
+  , Handler&& handler
+  ) {
+    switch (method) {
+      case write_method::destructive:
+        stream.async_write_destructive(
+          message, std::forward<Handler>(handler)
+        );
+        break;
+      case write_method::queued_destructive:
+        stream.async_queue_write_destructive(
+          message, std::forward<Handler>(handler)
+        );
+        break;
+      case write_method::copying:
+        stream.async_write(
+          gsl::span<byte const>(message), std::forward<Handler>(handler)
+        );
+        break;
+    }
+  }
+
+  // Sends a message and waits for the echo, over and over
+  class pinger : asio::coroutine {
+  public:
+    pinger(
+      local_stream& stream
+    , write_method method
+    , std::vector<byte>& message
+    , std::size_t& allocations
+    )
+      : stream_(stream)
+      , method_(method)
+      , message_(message)
+      , allocations_(allocations)
+    {}
+
+    void
+    operator()(
+      std::error_code ec = std::error_code()
+    , std::size_t = 0
+    ) {
+      if (ec) {
+        std::cout << "PINGER ERROR: " << ec.message() << std::endl;
+        return;
+      }
+
+      reenter (this) {
+        for (round_ = 0; round_ < warmup_rounds + measured_rounds; ++round_) {
+          if (round_ == warmup_rounds) {
+            allocations_ = allocation_count;
+          }
+          yield write_message(stream_, method_, message_, std::move(*this));
+          yield stream_.async_read(message_, std::move(*this));
+        }
+        allocations_ = allocation_count - allocations_;
+      }
+    }
+
+  private:
+    local_stream& stream_;
+    write_method method_;
+    std::vector<byte>& message_;
+    std::size_t& allocations_;
+    std::size_t round_ = 0;
+  };
+
+  class ponger : asio::coroutine {
+  public:
+    ponger(
+      local_stream& stream
+    , write_method method
+    , std::vector<byte>& message
+    )
+      : stream_(stream)
+      , method_(method)
+      , message_(message)
+    {}
+
+    void
+    operator()(
+      std::error_code ec = std::error_code()
+    , std::size_t = 0
+    ) {
+      if (ec) {
+        std::cout << "PONGER ERROR: " << ec.message() << std::endl;
+        return;
+      }
+
+      reenter (this) {
+        for (round_ = 0; round_ < warmup_rounds + measured_rounds; ++round_) {
+          yield stream_.async_read(message_, std::move(*this));
+          yield write_message(stream_, method_, message_, std::move(*this));
+        }
+      }
+    }
+
+  private:
+    local_stream& stream_;
+    write_method method_;
+    std::vector<byte>& message_;
+    std::size_t round_ = 0;
+  };
+
+  // Echoes a message back and forth and returns the number of allocations
+  // made by the measured rounds
+  std::size_t
+  count_steady_state_allocations(write_method method) {
+    private_key server_sk;
+    public_key server_pk;
+    crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+    private_key client_sk;
+    public_key client_pk;
+    crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+    asio::io_service io;
+    asio::local::stream_protocol::socket client_local(io);
+    asio::local::stream_protocol::socket server_local(io);
+    asio::local::connect_pair(client_local, server_local);
+
+    std::vector<byte> client_message(100);
+    randombytes_buf(client_message.data(), client_message.size());
+    std::vector<byte> server_message(client_message.size());
+    std::size_t allocations = 0;
+
+    std::unique_ptr<local_stream> server_stream;
+    std::unique_ptr<local_stream> client_stream;
+
+    local_stream::async_server_handshake(
+      std::move(server_local)
+    , server_pk
+    , server_sk
+    , [](auto const) { return true; }
+    , [&](auto&& stream) {
+        server_stream = std::make_unique<local_stream>(std::move(stream));
+        ponger(*server_stream, method, server_message)();
+      }
+    , [](auto ec, auto) {
+        std::cout << "SERVER ERROR: " << ec.message() << std::endl;
+      }
+    );
+
+    local_stream::async_client_handshake(
+      std::move(client_local)
+    , server_pk
+    , client_pk
+    , client_sk
+    , [&](auto&& stream) {
+        client_stream = std::make_unique<local_stream>(std::move(stream));
+        pinger(*client_stream, method, client_message, allocations)();
+      }
+    , [](auto ec) {
+        std::cout << "CLIENT ERROR: " << ec.message() << std::endl;
+      }
+    );
+
+    auto const before = allocation_count;
+    io.run();
+
+    // Make sure the counter is actually hooked up
+    REQUIRE( allocation_count > before );
+    return allocations;
+  }
+}
+
+SCENARIO("steady state messages don't allocate", "[integration]") {
+  WHEN("messages are written destructively") {
+    THEN("the measured rounds don't allocate") {
+      REQUIRE( count_steady_state_allocations(write_method::destructive) == 0 );
+    }
+  }
+
+  WHEN("messages are queued for writing") {
+    THEN("the measured rounds don't allocate") {
+      REQUIRE(
+        count_steady_state_allocations(write_method::queued_destructive) == 0
+      );
+    }
+  }
+
+  WHEN("messages are copied into pooled buffers") {
+    THEN("the measured rounds don't allocate") {
+      REQUIRE( count_steady_state_allocations(write_method::copying) == 0 );
+    }
+  }
+}
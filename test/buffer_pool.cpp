@@ -0,0 +1,103 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "asio_sodium/detail/buffer_pool.hpp"
+
+#include <catch.hpp>
+
+#include <memory>
+#include <thread>
+
+using namespace asio_sodium;
+
+SCENARIO("buffer pool recycling", "[unit]") {
+  detail::buffer_pool pool{2};
+
+  auto first = pool.acquire(100);
+  REQUIRE( first.size() == 100 );
+  auto const first_data = first.data();
+  pool.release(std::move(first));
+  REQUIRE( pool.retained() == 1 );
+
+  // A smaller request reuses the retained allocation
+  auto second = pool.acquire(50);
+  REQUIRE( second.size() == 50 );
+  REQUIRE( second.data() == first_data );
+  REQUIRE( pool.retained() == 0 );
+
+  // The best fit wins over a larger buffer
+  auto large = pool.acquire(1000);
+  auto const large_data = large.data();
+  pool.release(std::move(large));
+  pool.release(std::move(second));
+  auto fit = pool.acquire(80);
+  REQUIRE( fit.data() == first_data );
+  auto big = pool.acquire(900);
+  REQUIRE( big.data() == large_data );
+
+  // Retention is capped
+  pool.release(std::move(fit));
+  pool.release(std::move(big));
+  pool.release(detail::buffer_pool::buffer(10));
+  REQUIRE( pool.retained() == 2 );
+}
+
+SCENARIO("buffer pool byte cap", "[unit]") {
+  detail::buffer_pool pool{4, 1000};
+
+  auto small = pool.acquire(600);
+  auto other = pool.acquire(600);
+  auto huge = pool.acquire(5000);
+  pool.release(std::move(huge));
+  REQUIRE( pool.retained() == 0 );
+
+  pool.release(std::move(small));
+  REQUIRE( pool.retained() == 1 );
+  REQUIRE( pool.retained_bytes() >= 600 );
+
+  // Retaining both would exceed the byte cap
+  pool.release(std::move(other));
+  REQUIRE( pool.retained() == 1 );
+}
+
+SCENARIO("shared pooled buffers", "[unit]") {
+  auto pool = std::make_shared<detail::buffer_pool>();
+  using allocator = detail::pool_allocator<detail::buffer_pool::buffer>;
+
+  auto first =
+    std::allocate_shared<detail::buffer_pool::buffer>(
+      allocator(pool), pool->acquire(100)
+    )
+  ;
+  auto const data = first->data();
+  auto const control = static_cast<void const*>(first.get());
+
+  // Dropping the last reference on another thread returns the storage
+  std::thread([dropped = std::move(first)]() mutable {
+    dropped.reset();
+  }).join();
+  REQUIRE( pool->retained() == 1 );
+
+  // The next shared buffer reuses both the storage and the shared allocation
+  auto second =
+    std::allocate_shared<detail::buffer_pool::buffer>(
+      allocator(pool), pool->acquire(100)
+    )
+  ;
+  REQUIRE( second->data() == data );
+  REQUIRE( static_cast<void const*>(second.get()) == control );
+}
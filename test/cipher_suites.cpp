@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "asio_sodium/cipher_suites.hpp"
+
+#include <catch.hpp>
+#include <sodium.h>
+
+using namespace asio_sodium;
+
+namespace {
+  template <typename CipherSuite>
+  void
+  require_round_trip(byte selection) {
+    session_key key;
+    randombytes_buf(&key[0], key.size());
+    typename CipherSuite::key_state state;
+    REQUIRE( CipherSuite::set_key(state, selection, key) );
+
+    nonce message_nonce;
+    randombytes_buf(&message_nonce[0], message_nonce.size());
+    std::array<byte, 100> original;
+    randombytes_buf(&original[0], original.size());
+    std::array<byte, 100> message = original;
+    std::array<byte, CipherSuite::mac_size> mac;
+
+    REQUIRE(
+      CipherSuite::encrypt(
+        state, &message[0], &mac[0], &message[0], message.size(), message_nonce
+      )
+    );
+    REQUIRE( message != original );
+    REQUIRE(
+      CipherSuite::decrypt(
+        state, &message[0], &message[0], &mac[0], message.size(), message_nonce
+      )
+    );
+    REQUIRE( message == original );
+
+    message_nonce[0] ^= 1;
+    REQUIRE(
+      CipherSuite::encrypt(
+        state, &message[0], &mac[0], &message[0], message.size(), message_nonce
+      )
+    );
+    message_nonce[0] ^= 1;
+    REQUIRE(
+      !CipherSuite::decrypt(
+        state, &message[0], &message[0], &mac[0], message.size(), message_nonce
+      )
+    );
+  }
+}
+
+SCENARIO("cipher suite encrypt/decrypt", "[integration]") {
+  using namespace cipher_suites;
+
+  require_round_trip<xchacha20poly1305_ietf>(ids::xchacha20poly1305_ietf);
+  require_round_trip<automatic>(ids::xchacha20poly1305_ietf);
+  if (aes256gcm::is_available()) {
+    require_round_trip<aes256gcm>(ids::aes256gcm);
+    require_round_trip<automatic>(ids::aes256gcm);
+  }
+}
+
+SCENARIO("cipher suite negotiation", "[unit]") {
+  using namespace cipher_suites;
+
+  GIVEN("fixed suites") {
+    REQUIRE( *xchacha20poly1305_ietf::select(ids::xchacha20poly1305_ietf) == ids::xchacha20poly1305_ietf );
+    REQUIRE( !xchacha20poly1305_ietf::select(ids::aes256gcm) );
+    REQUIRE( !xchacha20poly1305_ietf::accepts(ids::aes256gcm) );
+    REQUIRE( !aes256gcm::select(ids::xchacha20poly1305_ietf) );
+  }
+
+  GIVEN("the automatic suite") {
+    auto const selection = automatic::select(automatic::proposal());
+    REQUIRE( selection );
+    REQUIRE( automatic::accepts(*selection) );
+    if (aes256gcm::is_available()) {
+      REQUIRE( *selection == ids::aes256gcm );
+    } else {
+      REQUIRE( *selection == ids::xchacha20poly1305_ietf );
+    }
+    // A peer without AES-256-GCM falls back to XChaCha20-Poly1305
+    REQUIRE( *automatic::select(ids::xchacha20poly1305_ietf) == ids::xchacha20poly1305_ietf );
+    REQUIRE( xchacha20poly1305_ietf::accepts(*automatic::select(xchacha20poly1305_ietf::proposal())) );
+  }
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "asio_sodium/detail/early_data.hpp"
+
+#include <catch.hpp>
+
+#include <vector>
+
+using namespace asio_sodium;
+
+SCENARIO("early data seal/open", "[integration]") {
+  shared_key response_key;
+  randombytes_buf(&response_key[0], response_key.size());
+
+  nonce reply_nonce;
+  randombytes_buf(&reply_nonce[0], reply_nonce.size());
+
+  std::vector<byte> const payload(100, 42);
+  auto frame = payload;
+  REQUIRE( detail::seal_early_data(response_key, reply_nonce, frame) );
+
+  detail::early_length_buffer length_buffer;
+  std::copy_n(frame.begin(), length_buffer.size(), length_buffer.begin());
+  auto const length = detail::early_data_length(length_buffer);
+  REQUIRE( length == payload.size() );
+  std::vector<byte> sealed(frame.begin() + length_buffer.size(), frame.end());
+  REQUIRE( sealed.size() == detail::early_frame_size(length) );
+
+  GIVEN("the response key") {
+    std::vector<byte> opened;
+    REQUIRE(
+      detail::open_early_data(
+        response_key, reply_nonce, length, sealed, opened
+      )
+    );
+    REQUIRE( opened == payload );
+  }
+
+  GIVEN("a different hello under the same key") {
+    // A frame captured from one flight can't ride along with a later hello
+    nonce other;
+    randombytes_buf(&other[0], other.size());
+    std::vector<byte> opened;
+    REQUIRE(
+      !detail::open_early_data(
+        response_key, other, length, sealed, opened
+      )
+    );
+  }
+
+  GIVEN("a different key") {
+    shared_key other;
+    randombytes_buf(&other[0], other.size());
+    std::vector<byte> opened;
+    REQUIRE(
+      !detail::open_early_data(
+        other, reply_nonce, length, sealed, opened
+      )
+    );
+  }
+
+  GIVEN("a tampered frame") {
+    sealed.back() ^= 1;
+    std::vector<byte> opened;
+    REQUIRE(
+      !detail::open_early_data(
+        response_key, reply_nonce, length, sealed, opened
+      )
+    );
+  }
+
+  GIVEN("a truncated frame") {
+    sealed.pop_back();
+    std::vector<byte> opened;
+    REQUIRE(
+      !detail::open_early_data(
+        response_key, reply_nonce, length - 1, sealed, opened
+      )
+    );
+  }
+}
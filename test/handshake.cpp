@@ -14,8 +14,11 @@
  * limitations under the License.
  */
 
+#include "asio_sodium/cipher_suites.hpp"
 #include "asio_sodium/crypto.hpp"
+#include "asio_sodium/detail/asio_types.hpp"
 #include "asio_sodium/detail/client_handshake.hpp"
+#include "asio_sodium/detail/handshake_state.hpp"
 #include "asio_sodium/detail/server_handshake.hpp"
 #include "asio_sodium/detail/session_data.hpp"
 
@@ -32,6 +35,44 @@
 
 using namespace asio_sodium;
 
+namespace {
+  using suite = cipher_suites::automatic;
+
+  // Splits a handshake's completion into success and error callbacks
+  template <
+    typename OnSuccess
+  , typename OnError
+  >
+  struct split_completion {
+    OnSuccess on_success;
+    OnError on_error;
+
+    void
+    operator()() { on_success(); }
+
+    template <typename ...Details>
+    void
+    operator()(
+      std::error_code ec
+    , Details... details
+    ) {
+      on_error(ec, details...);
+    }
+  };
+
+  template <
+    typename OnSuccess
+  , typename OnError
+  >
+  split_completion<OnSuccess, OnError>
+  make_split_completion(
+    OnSuccess on_success
+  , OnError on_error
+  ) {
+    return {std::move(on_success), std::move(on_error)};
+  }
+}
+
 SCENARIO("full handshake", "[integration]") {
   private_key server_sk;
   public_key server_pk;
@@ -41,8 +82,13 @@ SCENARIO("full handshake", "[integration]") {
   public_key client_pk;
   crypto_box_keypair(&client_pk[0], &client_sk[0]);
 
-  detail::session_data client_session{server_pk, client_pk, client_sk};
-  detail::session_data server_session{server_pk, server_sk};
+  detail::session_data<suite> client_session{
+    server_pk
+  , make_identity(client_pk, client_sk)
+  };
+  detail::session_data<suite> server_session{
+    make_identity(server_pk, server_sk)
+  };
 
   asio::io_service io;
   asio::ip::tcp::acceptor acceptor{
@@ -73,16 +119,17 @@ SCENARIO("full handshake", "[integration]") {
         );
         server_error = true;
       };
+      auto completion = make_split_completion(on_success, on_error);
       detail::server_handshake<
-        decltype(authenticator)
-      , decltype(on_success)
-      , decltype(on_error)
+        suite
+      , detail::socket_type
+      , decltype(authenticator)
+      , decltype(completion)
       >(
         server_session
       , server_socket
       , std::move(authenticator)
-      , std::move(on_success)
-      , std::move(on_error)
+      , std::move(completion)
       )();
     }
   );
@@ -102,16 +149,20 @@ SCENARIO("full handshake", "[integration]") {
     );
     client_error = true;
   };
-  detail::client_handshake<
-    decltype(on_success)
-  , decltype(on_error)
-  >(
+  auto completion = make_split_completion(on_success, on_error);
+  // The handshake starts once the connection is up
+  client_socket.async_connect(
     detail::endpoint_type(asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 58008))
-  , client_session
-  , client_socket
-  , std::move(on_success)
-  , std::move(on_error)
-  )();
+  , detail::client_handshake<
+      suite
+    , detail::socket_type
+    , decltype(completion)
+    >(
+      client_session
+    , client_socket
+    , std::move(completion)
+    )
+  );
 
   io.run();
 
@@ -119,4 +170,68 @@ SCENARIO("full handshake", "[integration]") {
   REQUIRE( !server_error );
   REQUIRE( client_success );
   REQUIRE( !client_error );
+  REQUIRE( client_session.write_state.base_nonce == server_session.read_state.base_nonce );
+  REQUIRE( client_session.read_state.base_nonce == server_session.write_state.base_nonce );
+
+  // Each direction has its own key
+  std::array<byte, 16> message{};
+  std::array<byte, suite::mac_size> mac;
+  REQUIRE(
+    suite::encrypt(
+      client_session.write_state.key, &message[0], &mac[0], &message[0]
+    , message.size(), client_session.write_state.base_nonce
+    )
+  );
+  auto const ciphertext = message;
+  REQUIRE(
+    suite::decrypt(
+      server_session.read_state.key, &message[0], &message[0], &mac[0]
+    , message.size(), server_session.read_state.base_nonce
+    )
+  );
+  message = ciphertext;
+  REQUIRE(
+    !suite::decrypt(
+      client_session.read_state.key, &message[0], &message[0], &mac[0]
+    , message.size(), server_session.read_state.base_nonce
+    )
+  );
+}
+
+SCENARIO("single key agreement", "[unit]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  detail::handshake_state client_state;
+  REQUIRE( client_state.precompute_shared_key(server_pk, client_sk) );
+  detail::handshake_state server_state;
+  REQUIRE( server_state.precompute_shared_key(client_pk, server_sk) );
+
+  // Both sides reach the same point, and the response key derived from it is
+  // the one crypto_box_beforenm would have computed
+  REQUIRE( client_state.shared_point == server_state.shared_point );
+  shared_key boxed;
+  REQUIRE( crypto_box_beforenm(&boxed[0], &server_pk[0], &client_sk[0]) == 0 );
+  REQUIRE( client_state.shared_key == boxed );
+  REQUIRE( server_state.shared_key == boxed );
+}
+
+SCENARIO("established session size", "[unit]") {
+  using session = detail::session_data<suite>;
+
+  WARN(
+    "sizeof(session_data) = " << sizeof(session)
+    << " (handshake state, freed after the handshake: "
+    << sizeof(detail::handshake_state) << ")"
+  );
+
+  // The original single-direction session_data, which also held the handshake
+  // buffers, was 396 bytes on x86-64. The handshake state is now separate and
+  // freed, so the established session must come in below that.
+  REQUIRE( sizeof(session) <= 384 );
 }
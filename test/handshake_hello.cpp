@@ -34,6 +34,7 @@ SCENARIO("handshake hello encrypt/decrypt", "[integration]") {
 
   hello.set_public_key(client_pk);
   hello.generate_reply_nonce();
+  hello.set_cipher_suite(7);
   nonce reply_nonce;
   hello.copy_reply_nonce(reply_nonce);
   REQUIRE( hello.encrypt_to(server_pk) );
@@ -45,6 +46,7 @@ SCENARIO("handshake hello encrypt/decrypt", "[integration]") {
     )
   ;
   REQUIRE( decrypted );
+  REQUIRE( decrypted->cipher_suite() == 7 );
   auto result_pk = decrypted->client_public_key_span();
   REQUIRE(
     std::equal(
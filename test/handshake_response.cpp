@@ -33,29 +33,38 @@ SCENARIO("handshake response encrypt/decrypt", "[integration]") {
   crypto_box_keypair(&client_pk[0], &client_sk[0]);
 
   response.generate_reply_nonce();
+  response.set_cipher_suite(7);
   response.generate_followup_nonce();
+  detail::sealed_ticket ticket;
+  randombytes_buf(&ticket[0], ticket.size());
+  session_key ticket_secret;
+  randombytes_buf(&ticket_secret[0], ticket_secret.size());
+  response.set_ticket(3600, ticket, ticket_secret);
   nonce reply_nonce;
   nonce followup_nonce;
   response.copy_reply_nonce(reply_nonce);
   response.copy_followup_nonce(followup_nonce);
   nonce encrypt_nonce;
   randombytes_buf(&encrypt_nonce[0], encrypt_nonce.size());
+  shared_key server_key;
+  REQUIRE( crypto_box_beforenm(&server_key[0], &client_pk[0], &server_sk[0]) == 0 );
+  shared_key client_key;
+  REQUIRE( crypto_box_beforenm(&client_key[0], &server_pk[0], &client_sk[0]) == 0 );
   REQUIRE(
     response.encrypt_to(
       encrypt_nonce
-    , client_pk
-    , server_sk
+    , server_key
     )
   );
   auto decrypted =
     detail::handshake_response::decrypt(
       buffer
     , encrypt_nonce
-    , server_pk
-    , client_sk
+    , client_key
     )
   ;
   REQUIRE( decrypted );
+  REQUIRE( decrypted->cipher_suite() == 7 );
   auto result_reply_nonce = decrypted->reply_nonce_span();
   REQUIRE(
     std::equal(
@@ -72,4 +81,14 @@ SCENARIO("handshake response encrypt/decrypt", "[integration]") {
     , followup_nonce.begin()
     )
   );
+  REQUIRE( decrypted->ticket_lifetime() == 3600 );
+  detail::sealed_ticket result_ticket;
+  decrypted->copy_ticket(result_ticket);
+  REQUIRE( result_ticket == ticket );
+  session_key result_secret;
+  decrypted->copy_ticket_secret(result_secret);
+  REQUIRE( result_secret == ticket_secret );
+
+  response.clear_ticket();
+  REQUIRE( response.ticket_lifetime() == 0 );
 }
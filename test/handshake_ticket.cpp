@@ -0,0 +1,107 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "asio_sodium/detail/handshake_ticket.hpp"
+
+#include <catch.hpp>
+
+using namespace asio_sodium;
+
+SCENARIO("resumption ticket seal/open", "[integration]") {
+  ticket_key key{std::chrono::seconds(60)};
+  detail::ticket_contents contents;
+  randombytes_buf(&contents.client_public_key[0], contents.client_public_key.size());
+  randombytes_buf(&contents.secret[0], contents.secret.size());
+  contents.issued_at = 1000;
+  contents.cipher_suite = 7;
+
+  detail::sealed_ticket sealed;
+  REQUIRE( detail::seal_ticket(key, contents, sealed) );
+
+  GIVEN("the key that sealed it") {
+    detail::ticket_contents opened;
+    REQUIRE( detail::open_ticket(key, sealed, opened) );
+    REQUIRE( opened.client_public_key == contents.client_public_key );
+    REQUIRE( opened.secret == contents.secret );
+    REQUIRE( opened.issued_at == 1000 );
+    REQUIRE( opened.cipher_suite == 7 );
+  }
+
+  GIVEN("a tampered ticket") {
+    sealed[sealed.size() - 1] ^= 1;
+    detail::ticket_contents opened;
+    REQUIRE( !detail::open_ticket(key, sealed, opened) );
+  }
+
+  GIVEN("a different key") {
+    ticket_key other;
+    detail::ticket_contents opened;
+    REQUIRE( !detail::open_ticket(other, sealed, opened) );
+  }
+
+  GIVEN("the ticket's age") {
+    REQUIRE( detail::ticket_is_current(contents, key.lifetime(), 1000) );
+    REQUIRE( detail::ticket_is_current(contents, key.lifetime(), 1059) );
+    REQUIRE( !detail::ticket_is_current(contents, key.lifetime(), 1060) );
+  }
+
+  GIVEN("a ticket issued in the future") {
+    auto const skew = detail::ticket_clock_skew.count();
+    // A little clock skew between servers is tolerated
+    REQUIRE( detail::ticket_is_current(contents, key.lifetime(), 1000 - 1) );
+    REQUIRE(
+      detail::ticket_is_current(contents, key.lifetime(), 1000 - skew)
+    );
+    // Beyond that, the ticket would otherwise never expire
+    REQUIRE(
+      !detail::ticket_is_current(contents, key.lifetime(), 1000 - skew - 1)
+    );
+    contents.issued_at = ~uint64_t(0);
+    REQUIRE( !detail::ticket_is_current(contents, key.lifetime(), 1000) );
+  }
+}
+
+SCENARIO("resume hello encrypt/decrypt", "[integration]") {
+  detail::resume_hello::buffer buffer;
+  detail::resume_hello hello{buffer};
+
+  detail::sealed_ticket ticket;
+  randombytes_buf(&ticket[0], ticket.size());
+  session_key secret;
+  randombytes_buf(&secret[0], secret.size());
+  nonce reply_nonce;
+  randombytes_buf(&reply_nonce[0], reply_nonce.size());
+
+  hello.set_ticket(ticket);
+  REQUIRE( hello.encrypt(secret, reply_nonce) );
+
+  detail::sealed_ticket result_ticket;
+  hello.copy_ticket(result_ticket);
+  REQUIRE( result_ticket == ticket );
+
+  GIVEN("the resumption secret") {
+    nonce result;
+    REQUIRE( hello.decrypt(secret, result) );
+    REQUIRE( result == reply_nonce );
+  }
+
+  GIVEN("a different secret") {
+    session_key other;
+    randombytes_buf(&other[0], other.size());
+    nonce result;
+    REQUIRE( !hello.decrypt(other, result) );
+  }
+}
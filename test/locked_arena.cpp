@@ -0,0 +1,88 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "asio_sodium/local_identity.hpp"
+#include "asio_sodium/detail/locked_arena.hpp"
+
+#include <catch.hpp>
+#include <sodium.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+using namespace asio_sodium;
+
+SCENARIO("locked arena slots", "[unit]") {
+  using secret = std::array<byte, 100>;
+  using arena = detail::locked_arena<secret>;
+  REQUIRE( arena::slot_size % arena::slot_alignment == 0 );
+
+  byte const* address;
+  {
+    detail::locked<secret> key;
+    secret& value = key;
+    address = value.data();
+    auto const alignment =
+      reinterpret_cast<std::uintptr_t>(address) % arena::slot_alignment
+    ;
+    REQUIRE( alignment == 0 );
+    std::fill(value.begin(), value.end(), 0xAB);
+  }
+
+  // Released slots are wiped and handed out again
+  REQUIRE(
+    std::all_of(
+      address
+    , address + sizeof(secret)
+    , [](byte b) { return b == 0; }
+    )
+  );
+  detail::locked<secret> reused;
+  REQUIRE( reused.get().data() == address );
+}
+
+SCENARIO("locked arena slots released on another thread", "[unit]") {
+  using secret = std::array<byte, 100>;
+
+  // A slot goes onto the free list of the thread that releases it, which
+  // hands it out again without touching the shared list
+  std::unique_ptr<detail::locked<secret>> key{new detail::locked<secret>()};
+  auto const address = key->get().data();
+  byte const* reused = nullptr;
+  std::thread releaser{
+    [&] {
+      key.reset();
+      detail::locked<secret> again;
+      reused = again.get().data();
+    }
+  };
+  releaser.join();
+  REQUIRE( reused == address );
+}
+
+SCENARIO("shared local identity", "[unit]") {
+  private_key sk;
+  public_key pk;
+  crypto_box_keypair(&pk[0], &sk[0]);
+
+  auto const identity = make_identity(pk, sk);
+  REQUIRE( identity->get_public_key() == pk );
+  REQUIRE( identity->get_private_key() == sk );
+}
@@ -20,9 +20,13 @@
 
 using namespace asio_sodium;
 
+namespace {
+  using suite = cipher_suites::xchacha20poly1305_ietf;
+}
+
 SCENARIO("message header encrypt/decrypt", "[integration]") {
-  detail::message_header::buffer buffer;
-  detail::message_header header{buffer};
+  detail::message_header<suite>::buffer buffer;
+  detail::message_header<suite> header{buffer};
 
   private_key remote_sk;
   public_key remote_pk;
@@ -32,46 +36,52 @@ SCENARIO("message header encrypt/decrypt", "[integration]") {
   public_key local_pk;
   crypto_box_keypair(&local_pk[0], &local_sk[0]);
 
-  header.generate_data_nonce();
-  header.generate_followup_nonce();
   header.set_message_length(42);
-  nonce data_nonce;
-  nonce followup_nonce;
-  header.copy_data_nonce(data_nonce);
-  header.copy_followup_nonce(followup_nonce);
   nonce encrypt_nonce;
   randombytes_buf(&encrypt_nonce[0], encrypt_nonce.size());
+  shared_key local_key;
+  REQUIRE( crypto_box_beforenm(&local_key[0], &remote_pk[0], &local_sk[0]) == 0 );
+  shared_key remote_key;
+  REQUIRE( crypto_box_beforenm(&remote_key[0], &local_pk[0], &remote_sk[0]) == 0 );
+  suite::key_state local_state;
+  REQUIRE( suite::set_key(local_state, cipher_suites::ids::xchacha20poly1305_ietf, local_key) );
+  suite::key_state remote_state;
+  REQUIRE( suite::set_key(remote_state, cipher_suites::ids::xchacha20poly1305_ietf, remote_key) );
   REQUIRE(
     header.encrypt_to(
       encrypt_nonce
-    , remote_pk
-    , local_sk
+    , local_state
     )
   );
   auto decrypted =
-    detail::message_header::decrypt(
+    detail::message_header<suite>::decrypt(
       buffer
     , encrypt_nonce
-    , local_pk
-    , remote_sk
+    , remote_state
     )
   ;
   REQUIRE( decrypted );
-  auto result_data_nonce = decrypted->data_nonce_span();
-  REQUIRE(
-    std::equal(
-      result_data_nonce.begin()
-    , result_data_nonce.end()
-    , data_nonce.begin()
-    )
-  );
-  auto result_followup_nonce = decrypted->followup_nonce_span();
-  REQUIRE(
-    std::equal(
-      result_followup_nonce.begin()
-    , result_followup_nonce.end()
-    , followup_nonce.begin()
-    )
-  );
   REQUIRE( decrypted->message_length() == 42 );
 }
+
+SCENARIO("message kinds", "[unit]") {
+  detail::message_header<suite>::buffer buffer;
+  detail::message_header<suite> header{buffer};
+
+  header.set_message_length(42);
+  REQUIRE( header.kind() == detail::message_kind::single );
+  REQUIRE( header.message_length() == 42 );
+
+  auto const max = detail::message_header<suite>::max_message_length;
+  for (
+    auto const kind : {
+      detail::message_kind::chunked
+    , detail::message_kind::stream_start
+    , detail::message_kind::stream_chunk
+    }
+  ) {
+    header.set_message_length(max, kind);
+    REQUIRE( header.kind() == kind );
+    REQUIRE( header.message_length() == max );
+  }
+}
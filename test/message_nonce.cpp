@@ -0,0 +1,70 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "asio_sodium/detail/message_header.hpp"
+#include "asio_sodium/detail/message_nonce.hpp"
+
+#include <catch.hpp>
+
+#include <limits>
+
+using namespace asio_sodium;
+
+namespace {
+  using suite = cipher_suites::xchacha20poly1305_ietf;
+}
+
+SCENARIO("message nonce sequence", "[unit]") {
+  nonce base;
+  randombytes_buf(&base[0], base.size());
+  uint64_t counter = 0;
+
+  nonce first;
+  nonce second;
+  REQUIRE( detail::next_message_nonce(base, counter, first) );
+  REQUIRE( detail::next_message_nonce(base, counter, second) );
+  REQUIRE( counter == 2 );
+  REQUIRE( first == base );
+  REQUIRE( first != second );
+
+  counter = std::numeric_limits<uint64_t>::max();
+  REQUIRE( !detail::next_message_nonce(base, counter, first) );
+}
+
+SCENARIO("replayed message header is rejected", "[integration]") {
+  suite::key_state key;
+  randombytes_buf(&key[0], key.size());
+  nonce base;
+  randombytes_buf(&base[0], base.size());
+  uint64_t encrypt_counter = 0;
+  uint64_t decrypt_counter = 0;
+
+  detail::message_header<suite>::buffer buffer;
+  detail::message_header<suite> header{buffer};
+  header.set_message_length(42);
+  nonce encrypt_nonce;
+  REQUIRE( detail::next_message_nonce(base, encrypt_counter, encrypt_nonce) );
+  REQUIRE( header.encrypt_to(encrypt_nonce, key) );
+  auto const replayed = buffer;
+
+  nonce decrypt_nonce;
+  REQUIRE( detail::next_message_nonce(base, decrypt_counter, decrypt_nonce) );
+  REQUIRE( detail::message_header<suite>::decrypt(buffer, decrypt_nonce, key) );
+
+  buffer = replayed;
+  REQUIRE( detail::next_message_nonce(base, decrypt_counter, decrypt_nonce) );
+  REQUIRE( !detail::message_header<suite>::decrypt(buffer, decrypt_nonce, key) );
+}
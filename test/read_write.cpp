@@ -14,26 +14,190 @@
  * limitations under the License.
  */
 
+#include "asio_sodium/cipher_suites.hpp"
 #include "asio_sodium/crypto.hpp"
+#include "asio_sodium/detail/asio_types.hpp"
+#include "asio_sodium/detail/handshake_state.hpp"
 #include "asio_sodium/detail/session_data.hpp"
 #include "asio_sodium/detail/message_reader.hpp"
 #include "asio_sodium/detail/message_writer.hpp"
 
+#include <asio/coroutine.hpp>
 #include <asio/io_service.hpp>
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wdeprecated"
 #pragma clang diagnostic ignored "-Wunused-local-typedef"
 #include <asio/ip/tcp.hpp>
+#include <asio/local/connect_pair.hpp>
+#include <asio/local/stream_protocol.hpp>
 #pragma clang diagnostic pop
 
+#include <asio/yield.hpp>
+
 #include <catch.hpp>
 #include <sodium.h>
 
+#include <functional>
 #include <iostream>
+#include <vector>
 
 using namespace asio_sodium;
 
+namespace {
+  using suite = cipher_suites::xchacha20poly1305_ietf;
+
+  void
+  simulate_handshake(
+    detail::session_data<suite>& client_session
+  , detail::session_data<suite>& server_session
+  ) {
+    // Simulate a successful handshake
+    // (Each side's encrypt nonce should match the other side's decrypt nonce,
+    // and vice versa.)
+    nonce nonce1;
+    randombytes_buf(&nonce1[0], nonce1.size());
+    std::copy(
+      nonce1.begin()
+    , nonce1.end()
+    , client_session.write_state.base_nonce.begin()
+    );
+    std::copy(
+      nonce1.begin()
+    , nonce1.end()
+    , server_session.read_state.base_nonce.begin()
+    );
+    nonce nonce2;
+    randombytes_buf(&nonce2[0], nonce2.size());
+    std::copy(
+      nonce2.begin()
+    , nonce2.end()
+    , server_session.write_state.base_nonce.begin()
+    );
+    std::copy(
+      nonce2.begin()
+    , nonce2.end()
+    , client_session.read_state.base_nonce.begin()
+    );
+    detail::handshake_state client_state;
+    REQUIRE(
+      client_state.precompute_shared_key(
+        client_session.remote_public_key
+      , client_session.identity->get_private_key()
+      )
+    );
+    detail::handshake_state server_state;
+    REQUIRE(
+      server_state.precompute_shared_key(
+        server_session.remote_public_key
+      , server_session.identity->get_private_key()
+      )
+    );
+    REQUIRE(
+      client_session.derive_session_keys(
+        cipher_suites::ids::xchacha20poly1305_ietf
+      , client_state.shared_point
+      , true
+      )
+    );
+    REQUIRE(
+      server_session.derive_session_keys(
+        cipher_suites::ids::xchacha20poly1305_ietf
+      , server_state.shared_point
+      , false
+      )
+    );
+  }
+
+  class pipelined_writer : asio::coroutine {
+  public:
+    pipelined_writer(
+      detail::socket_type& socket
+    , detail::session_data<suite>& session
+    , std::vector<std::vector<byte>>& messages
+    , std::function<void()> on_done
+    )
+      : socket_(socket)
+      , session_(session)
+      , messages_(messages)
+      , on_done_(std::move(on_done))
+    {}
+
+    void
+    operator()(
+      std::error_code ec = std::error_code()
+    , std::size_t = 0
+    ) {
+      if (ec) {
+        std::cout << "WRITER ERROR: " << ec.message() << std::endl;
+        return;
+      }
+
+      reenter (this) {
+        for (index_ = 0; index_ < messages_.size(); ++index_) {
+          yield detail::message_writer<suite, detail::socket_type, pipelined_writer>(
+            gsl::as_span(messages_[index_])
+          , socket_
+          , session_.write_state
+          , std::move(*this)
+          )();
+        }
+        on_done_();
+      }
+    }
+
+  private:
+    detail::socket_type& socket_;
+    detail::session_data<suite>& session_;
+    std::vector<std::vector<byte>>& messages_;
+    std::function<void()> on_done_;
+    std::size_t index_ = 0;
+  };
+
+  class pipelined_reader : asio::coroutine {
+  public:
+    pipelined_reader(
+      detail::socket_type& socket
+    , detail::session_data<suite>& session
+    , std::vector<std::vector<byte>>& messages
+    , std::size_t& messages_read
+    )
+      : socket_(socket)
+      , session_(session)
+      , messages_(messages)
+      , messages_read_(messages_read)
+    {}
+
+    void
+    operator()(
+      std::error_code ec = std::error_code()
+    , std::size_t = 0
+    ) {
+      if (ec) {
+        std::cout << "READER ERROR: " << ec.message() << std::endl;
+        return;
+      }
+
+      reenter (this) {
+        for (; messages_read_ < messages_.size(); ++messages_read_) {
+          yield detail::message_reader<suite, detail::socket_type, pipelined_reader>(
+            gsl::as_span(messages_[messages_read_])
+          , socket_
+          , session_.read_state
+          , std::move(*this)
+          )();
+        }
+      }
+    }
+
+  private:
+    detail::socket_type& socket_;
+    detail::session_data<suite>& session_;
+    std::vector<std::vector<byte>>& messages_;
+    std::size_t& messages_read_;
+  };
+}
+
 SCENARIO("message transmission", "[integration]") {
   private_key server_sk;
   public_key server_pk;
@@ -43,39 +207,19 @@ SCENARIO("message transmission", "[integration]") {
   public_key client_pk;
   crypto_box_keypair(&client_pk[0], &client_sk[0]);
 
-  detail::session_data client_session{server_pk, client_pk, client_sk};
+  detail::session_data<suite> client_session{
+    server_pk
+  , make_identity(client_pk, client_sk)
+  };
   // This constructor is usually for the client, but I'm using it to simulate
   // successful authentication. (The handshake process doesn't write the client
   // public key until after authentication.)
-  detail::session_data server_session{client_pk, server_pk, server_sk};
+  detail::session_data<suite> server_session{
+    client_pk
+  , make_identity(server_pk, server_sk)
+  };
 
-  // Simulate a successful handshake
-  // (Each side's encrypt nonce should match the other side's decrypt nonce, and
-  // vice versa.)
-  nonce nonce1;
-  randombytes_buf(&nonce1[0], nonce1.size());
-  std::copy(
-    nonce1.begin()
-  , nonce1.end()
-  , client_session.encrypt_nonce.begin()
-  );
-  std::copy(
-    nonce1.begin()
-  , nonce1.end()
-  , server_session.decrypt_nonce.begin()
-  );
-  nonce nonce2;
-  randombytes_buf(&nonce2[0], nonce2.size());
-  std::copy(
-    nonce2.begin()
-  , nonce2.end()
-  , server_session.encrypt_nonce.begin()
-  );
-  std::copy(
-    nonce2.begin()
-  , nonce2.end()
-  , client_session.decrypt_nonce.begin()
-  );
+  simulate_handshake(client_session, server_session);
 
   asio::io_service io;
   asio::ip::tcp::acceptor acceptor{
@@ -119,10 +263,10 @@ SCENARIO("message transmission", "[integration]") {
           server_success = true;
         }
       };
-      detail::message_reader<decltype(server_callback)>(
+      detail::message_reader<suite, detail::socket_type, decltype(server_callback)>(
         gsl::as_span<byte>(target_message)
       , server_socket
-      , server_session
+      , server_session.read_state
       , std::move(server_callback)
       )();
     }
@@ -154,10 +298,10 @@ SCENARIO("message transmission", "[integration]") {
           client_success = true;
         }
       };
-      detail::message_writer<decltype(client_callback)>(
+      detail::message_writer<suite, detail::socket_type, decltype(client_callback)>(
         gsl::as_span(source_message)
       , client_socket
-      , client_session
+      , client_session.write_state
       , std::move(client_callback)
       )();
     }
@@ -177,3 +321,69 @@ SCENARIO("message transmission", "[integration]") {
     )
   );
 }
+
+SCENARIO("pipelined message transmission", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  detail::session_data<suite> client_session{
+    server_pk
+  , make_identity(client_pk, client_sk)
+  };
+  detail::session_data<suite> server_session{
+    client_pk
+  , make_identity(server_pk, server_sk)
+  };
+  simulate_handshake(client_session, server_session);
+
+  // Many small frames that share receive calls, plus one frame larger than
+  // the receive buffer and an empty one
+  std::vector<std::size_t> sizes(50, 37);
+  sizes[10] = detail::receive_buffer::default_capacity * 3 + 5;
+  sizes[20] = 0;
+  std::vector<std::vector<byte>> original;
+  for (auto size : sizes) {
+    std::vector<byte> message(size);
+    randombytes_buf(message.data(), message.size());
+    original.push_back(std::move(message));
+  }
+  auto source = original;
+  std::vector<std::vector<byte>> target;
+  for (auto size : sizes) {
+    target.emplace_back(size);
+  }
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+  auto client_socket = detail::socket_type(std::move(client_local));
+  auto server_socket = detail::socket_type(std::move(server_local));
+
+  std::size_t messages_read = 0;
+  // Only start reading once everything has been written, so the reader finds
+  // many frames queued up
+  pipelined_writer(
+    client_socket
+  , client_session
+  , source
+  , [&]() {
+      pipelined_reader(
+        server_socket
+      , server_session
+      , target
+      , messages_read
+      )();
+    }
+  )();
+
+  io.run();
+
+  REQUIRE( messages_read == original.size() );
+  REQUIRE( target == original );
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "asio_sodium/crypto_socket.hpp"
+#include "asio_sodium/server_runtime.hpp"
+
+#include <asio/io_service.hpp>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/ip/tcp.hpp>
+#pragma clang diagnostic pop
+
+#include <catch.hpp>
+#include <sodium.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace asio_sodium;
+
+SCENARIO("server runtime accepts on every worker", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+  auto const client_identity = make_identity(client_pk, client_sk);
+
+  using server_stream = crypto_stream<asio::ip::tcp::socket>;
+  constexpr std::size_t connection_count = 16;
+
+  // Connections must go before the runtime that owns their io_services
+  server_runtime runtime{2};
+  REQUIRE( runtime.size() == 2 );
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<server_stream>> connections;
+  std::set<std::thread::id> serving_threads;
+  std::atomic<std::size_t> server_errors{0};
+  // Port 0 picks one free port that every worker shares
+  auto const listen_ec = runtime.listen(
+    asio::ip::tcp::endpoint{asio::ip::tcp::v4(), 0}
+  , make_identity(server_pk, server_sk)
+  , [](auto const) { return true; }
+  , [&](server_stream&& stream) {
+      std::lock_guard<std::mutex> lock(mutex);
+      serving_threads.insert(std::this_thread::get_id());
+      connections.push_back(
+        std::make_unique<server_stream>(std::move(stream))
+      );
+    }
+  , [&](std::error_code const& ec) {
+      std::cout << "SERVER ERROR: " << ec.message() << std::endl;
+      ++server_errors;
+    }
+  );
+  REQUIRE( !listen_ec );
+  auto const endpoint = runtime.local_endpoint();
+  REQUIRE( endpoint.port() != 0 );
+  runtime.run();
+
+  asio::io_service io;
+  std::vector<std::unique_ptr<crypto_socket>> clients;
+  for (std::size_t i = 0; i < connection_count; ++i) {
+    crypto_socket::async_connect(
+      asio::ip::tcp::endpoint(
+        asio::ip::address_v4::loopback()
+      , endpoint.port()
+      )
+    , io
+    , server_pk
+    , client_identity
+    , [&](auto&& socket) {
+        clients.push_back(std::make_unique<crypto_socket>(std::move(socket)));
+      }
+    , [](auto ec) {
+        std::cout << "CONNECT ERROR: " << ec.message() << std::endl;
+      }
+    );
+  }
+  io.run();
+  REQUIRE( clients.size() == connection_count );
+
+  // The server side finishes its handshakes on the worker threads
+  auto const deadline =
+    std::chrono::steady_clock::now() + std::chrono::seconds(5)
+  ;
+  std::size_t served = 0;
+  while (served < connection_count) {
+    REQUIRE( std::chrono::steady_clock::now() < deadline );
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::lock_guard<std::mutex> lock(mutex);
+    served = connections.size();
+  }
+
+  runtime.stop();
+  runtime.join();
+
+  REQUIRE( server_errors == 0 );
+  REQUIRE( !serving_threads.empty() );
+  REQUIRE( serving_threads.count(std::this_thread::get_id()) == 0 );
+}
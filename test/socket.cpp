@@ -30,6 +30,8 @@
 #include <sodium.h>
 
 #include <iostream>
+#include <memory>
+#include <vector>
 
 using namespace asio_sodium;
 
@@ -116,6 +118,133 @@ namespace {
     gsl::span<byte> source2_;
     gsl::span<byte> target3_;
   };
+
+  class streaming_writer : asio::coroutine {
+  public:
+    streaming_writer(
+      crypto_socket& socket
+    , std::vector<std::vector<byte>>& messages
+    )
+      : socket_(socket)
+      , messages_(messages)
+    {}
+
+    void
+    operator()(
+      std::error_code ec = std::error_code()
+    , std::size_t = 0
+    ) {
+      if (ec) {
+        std::cout << "WRITER ERROR: " << ec.message() << std::endl;
+        return;
+      }
+
+      reenter (this) {
+        for (index_ = 0; index_ < messages_.size(); ++index_) {
+          yield socket_.async_write_destructive(
+            messages_[index_]
+          , std::move(*this)
+          );
+        }
+      }
+    }
+  private:
+    crypto_socket& socket_;
+    std::vector<std::vector<byte>>& messages_;
+    std::size_t index_ = 0;
+  };
+
+  class streaming_reader : asio::coroutine {
+  public:
+    streaming_reader(
+      crypto_socket& socket
+    , std::vector<std::vector<byte>>& messages
+    , std::size_t& messages_read
+    )
+      : socket_(socket)
+      , messages_(messages)
+      , messages_read_(messages_read)
+    {}
+
+    void
+    operator()(
+      std::error_code ec = std::error_code()
+    , std::size_t = 0
+    ) {
+      if (ec) {
+        std::cout << "READER ERROR: " << ec.message() << std::endl;
+        return;
+      }
+
+      reenter (this) {
+        for (; messages_read_ < messages_.size(); ++messages_read_) {
+          yield socket_.async_read(
+            messages_[messages_read_]
+          , std::move(*this)
+          );
+        }
+      }
+    }
+  private:
+    crypto_socket& socket_;
+    std::vector<std::vector<byte>>& messages_;
+    std::size_t& messages_read_;
+  };
+
+  class pooled_reader : asio::coroutine {
+  public:
+    pooled_reader(
+      crypto_socket& socket
+    , std::size_t count
+    , std::vector<pooled_message>& messages
+    )
+      : socket_(socket)
+      , count_(count)
+      , messages_(messages)
+    {}
+
+    void
+    operator()(
+      std::error_code ec = std::error_code()
+    , pooled_message message = pooled_message()
+    ) {
+      if (ec) {
+        std::cout << "READER ERROR: " << ec.message() << std::endl;
+        return;
+      }
+
+      reenter (this) {
+        while (messages_.size() < count_) {
+          yield socket_.async_read(std::move(*this));
+          messages_.push_back(std::move(message));
+        }
+      }
+    }
+  private:
+    crypto_socket& socket_;
+    std::size_t count_;
+    std::vector<pooled_message>& messages_;
+  };
+
+  std::vector<std::vector<byte>>
+  random_messages(std::size_t count) {
+    std::vector<std::vector<byte>> result;
+    for (std::size_t i = 0; i < count; ++i) {
+      std::vector<byte> message(randombytes_uniform(70000));
+      randombytes_buf(message.data(), message.size());
+      result.push_back(std::move(message));
+    }
+    return result;
+  }
+
+  std::vector<std::vector<byte>>
+  empty_like(std::vector<std::vector<byte>> const& messages) {
+    std::vector<std::vector<byte>> result;
+    for (auto const& message : messages) {
+      result.emplace_back(message.size());
+    }
+    return result;
+  }
 }
 
 SCENARIO("socket repeated read/write", "[integration]") {
@@ -241,3 +370,450 @@ SCENARIO("socket repeated read/write", "[integration]") {
     )
   );
 }
+
+SCENARIO("socket simultaneous bidirectional streaming", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::ip::tcp::acceptor acceptor{
+    io
+  , asio::ip::tcp::endpoint{asio::ip::tcp::v4(), 58008}
+  };
+
+  auto const client_original = random_messages(100);
+  auto client_source = client_original;
+  auto client_target = empty_like(client_original);
+  auto const server_original = random_messages(100);
+  auto server_source = server_original;
+  auto server_target = empty_like(server_original);
+  std::size_t client_read = 0;
+  std::size_t server_read = 0;
+
+  // Each side keeps one read and one write outstanding for the whole stream
+  std::unique_ptr<crypto_socket> server_socket;
+  std::unique_ptr<crypto_socket> client_socket;
+
+  crypto_socket::async_accept(
+    io
+  , acceptor
+  , server_pk
+  , server_sk
+  , [](auto const) { return true; }
+  , [&](auto&& socket) {
+      server_socket = std::make_unique<crypto_socket>(std::move(socket));
+      streaming_writer(*server_socket, server_source)();
+      streaming_reader(*server_socket, client_target, server_read)();
+    }
+  , [](auto ec, auto) {
+      std::cout << "ACCEPT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  crypto_socket::async_connect(
+    asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 58008)
+  , io
+  , server_pk
+  , client_pk
+  , client_sk
+  , [&](auto&& socket) {
+      client_socket = std::make_unique<crypto_socket>(std::move(socket));
+      streaming_writer(*client_socket, client_source)();
+      streaming_reader(*client_socket, server_target, client_read)();
+    }
+  , [](auto ec) {
+      std::cout << "CONNECT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  io.run();
+
+  REQUIRE( server_read == client_original.size() );
+  REQUIRE( client_read == server_original.size() );
+  REQUIRE( client_target == client_original );
+  REQUIRE( server_target == server_original );
+}
+
+SCENARIO("socket queued writes", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::ip::tcp::acceptor acceptor{
+    io
+  , asio::ip::tcp::endpoint{asio::ip::tcp::v4(), 58008}
+  };
+
+  auto const original = random_messages(200);
+  auto source = original;
+  auto target = empty_like(original);
+  std::size_t messages_read = 0;
+  std::vector<std::size_t> completed;
+
+  std::unique_ptr<crypto_socket> server_socket;
+  std::unique_ptr<crypto_socket> client_socket;
+
+  crypto_socket::async_accept(
+    io
+  , acceptor
+  , server_pk
+  , server_sk
+  , [](auto const) { return true; }
+  , [&](auto&& socket) {
+      server_socket = std::make_unique<crypto_socket>(std::move(socket));
+      streaming_reader(*server_socket, target, messages_read)();
+    }
+  , [](auto ec, auto) {
+      std::cout << "ACCEPT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  crypto_socket::async_connect(
+    asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 58008)
+  , io
+  , server_pk
+  , client_pk
+  , client_sk
+  , [&](auto&& socket) {
+      client_socket = std::make_unique<crypto_socket>(std::move(socket));
+      // Everything is queued up front without waiting for completions
+      for (std::size_t i = 0; i < source.size(); ++i) {
+        client_socket->async_queue_write_destructive(
+          source[i]
+        , [&completed, &original, i](auto ec, auto bytes) {
+            if (ec) {
+              std::cout << "WRITE ERROR: " << ec.message() << std::endl;
+            } else if (bytes == original[i].size()) {
+              completed.push_back(i);
+            }
+          }
+        );
+      }
+    }
+  , [](auto ec) {
+      std::cout << "CONNECT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  io.run();
+
+  std::vector<std::size_t> expected_order(original.size());
+  for (std::size_t i = 0; i < expected_order.size(); ++i) {
+    expected_order[i] = i;
+  }
+  REQUIRE( completed == expected_order );
+  REQUIRE( messages_read == original.size() );
+  REQUIRE( target == original );
+}
+
+SCENARIO("socket non-destructive writes", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::ip::tcp::acceptor acceptor{
+    io
+  , asio::ip::tcp::endpoint{asio::ip::tcp::v4(), 58008}
+  };
+
+  auto const original = random_messages(100);
+  auto source = original;
+  auto target = empty_like(original);
+  std::size_t messages_read = 0;
+  std::size_t writes_completed = 0;
+
+  std::unique_ptr<crypto_socket> server_socket;
+  std::unique_ptr<crypto_socket> client_socket;
+
+  crypto_socket::async_accept(
+    io
+  , acceptor
+  , server_pk
+  , server_sk
+  , [](auto const) { return true; }
+  , [&](auto&& socket) {
+      server_socket = std::make_unique<crypto_socket>(std::move(socket));
+      streaming_reader(*server_socket, target, messages_read)();
+    }
+  , [](auto ec, auto) {
+      std::cout << "ACCEPT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  crypto_socket::async_connect(
+    asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 58008)
+  , io
+  , server_pk
+  , client_pk
+  , client_sk
+  , [&](auto&& socket) {
+      client_socket = std::make_unique<crypto_socket>(std::move(socket));
+      for (auto const& message : source) {
+        client_socket->async_write(
+          gsl::as_span(message)
+        , [&writes_completed](auto ec, auto) {
+            if (ec) {
+              std::cout << "WRITE ERROR: " << ec.message() << std::endl;
+            } else {
+              ++writes_completed;
+            }
+          }
+        );
+      }
+    }
+  , [](auto ec) {
+      std::cout << "CONNECT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  io.run();
+
+  REQUIRE( writes_completed == original.size() );
+  REQUIRE( source == original );
+  REQUIRE( messages_read == original.size() );
+  REQUIRE( target == original );
+}
+
+SCENARIO("socket pooled reads", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::ip::tcp::acceptor acceptor{
+    io
+  , asio::ip::tcp::endpoint{asio::ip::tcp::v4(), 58008}
+  };
+
+  auto const original = random_messages(50);
+  auto source = original;
+  // Holding on to every message keeps its storage out of the pool, so each
+  // one must still be intact once all of them have arrived
+  std::vector<pooled_message> received;
+
+  std::unique_ptr<crypto_socket> server_socket;
+  std::unique_ptr<crypto_socket> client_socket;
+
+  crypto_socket::async_accept(
+    io
+  , acceptor
+  , server_pk
+  , server_sk
+  , [](auto const) { return true; }
+  , [&](auto&& socket) {
+      server_socket = std::make_unique<crypto_socket>(std::move(socket));
+      pooled_reader(*server_socket, original.size(), received)();
+    }
+  , [](auto ec, auto) {
+      std::cout << "ACCEPT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  crypto_socket::async_connect(
+    asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 58008)
+  , io
+  , server_pk
+  , client_pk
+  , client_sk
+  , [&](auto&& socket) {
+      client_socket = std::make_unique<crypto_socket>(std::move(socket));
+      streaming_writer(*client_socket, source)();
+    }
+  , [](auto ec) {
+      std::cout << "CONNECT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  io.run();
+
+  REQUIRE( received.size() == original.size() );
+  for (std::size_t i = 0; i < original.size(); ++i) {
+    REQUIRE( received[i].size() == original[i].size() );
+    REQUIRE(
+      std::equal(
+        original[i].begin()
+      , original[i].end()
+      , received[i].data()
+      )
+    );
+  }
+}
+
+SCENARIO("socket reads into provided buffers", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::ip::tcp::acceptor acceptor{
+    io
+  , asio::ip::tcp::endpoint{asio::ip::tcp::v4(), 58008}
+  };
+
+  auto original = random_messages(2);
+  // The second message must be too large for half its length
+  original[1].push_back(0);
+  auto source = original;
+  std::vector<std::vector<byte>> target;
+  std::vector<uint32_t> requested;
+  bool read_success = false;
+  std::error_code too_large;
+
+  std::unique_ptr<crypto_socket> server_socket;
+  std::unique_ptr<crypto_socket> client_socket;
+
+  crypto_socket::async_accept(
+    io
+  , acceptor
+  , server_pk
+  , server_sk
+  , [](auto const) { return true; }
+  , [&](auto&& socket) {
+      server_socket = std::make_unique<crypto_socket>(std::move(socket));
+      server_socket->async_read_with_provider(
+        [&](uint32_t length) {
+          requested.push_back(length);
+          target.emplace_back(length);
+          return gsl::as_span(target.back());
+        }
+      , [&](auto ec, gsl::span<byte> message) {
+          read_success =
+            !ec
+            && message.data() == target.back().data()
+            && static_cast<std::size_t>(message.size()) == original[0].size()
+          ;
+          // A provider that comes up short fails the read
+          server_socket->async_read_with_provider(
+            [&](uint32_t length) {
+              requested.push_back(length);
+              target.emplace_back(length / 2);
+              return gsl::as_span(target.back());
+            }
+          , [&](auto short_ec, auto) { too_large = short_ec; }
+          );
+        }
+      );
+    }
+  , [](auto ec, auto) {
+      std::cout << "ACCEPT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  crypto_socket::async_connect(
+    asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 58008)
+  , io
+  , server_pk
+  , client_pk
+  , client_sk
+  , [&](auto&& socket) {
+      client_socket = std::make_unique<crypto_socket>(std::move(socket));
+      streaming_writer(*client_socket, source)();
+    }
+  , [](auto ec) {
+      std::cout << "CONNECT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  io.run();
+
+  REQUIRE( read_success );
+  REQUIRE( target[0] == original[0] );
+  REQUIRE( requested.size() == 2 );
+  REQUIRE( requested[0] == original[0].size() );
+  REQUIRE( requested[1] == original[1].size() );
+  REQUIRE( too_large == error::message_too_large );
+}
+
+SCENARIO("pooled socket storage", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::ip::tcp::acceptor acceptor{
+    io
+  , asio::ip::tcp::endpoint{asio::ip::tcp::v4(), 58008}
+  };
+
+  std::vector<pool_statistics> statistics;
+  auto connect_once = [&] {
+    std::unique_ptr<pooled_crypto_socket> server_socket;
+    std::unique_ptr<pooled_crypto_socket> client_socket;
+    pooled_crypto_socket::async_accept(
+      io
+    , acceptor
+    , server_pk
+    , server_sk
+    , [](auto const) { return true; }
+    , [&](auto&& socket) {
+        server_socket =
+          std::make_unique<pooled_crypto_socket>(std::move(socket))
+        ;
+      }
+    , [](auto ec, auto) {
+        std::cout << "ACCEPT ERROR: " << ec.message() << std::endl;
+      }
+    );
+    pooled_crypto_socket::async_connect(
+      asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 58008)
+    , io
+    , server_pk
+    , client_pk
+    , client_sk
+    , [&](auto&& socket) {
+        client_socket =
+          std::make_unique<pooled_crypto_socket>(std::move(socket))
+        ;
+      }
+    , [](auto ec) {
+        std::cout << "CONNECT ERROR: " << ec.message() << std::endl;
+      }
+    );
+    io.run();
+    io.reset();
+    REQUIRE( server_socket );
+    REQUIRE( client_socket );
+    statistics.push_back(pooled_crypto_socket::statistics(io));
+  };
+
+  connect_once();
+  statistics.push_back(pooled_crypto_socket::statistics(io));
+  connect_once();
+  statistics.push_back(pooled_crypto_socket::statistics(io));
+
+  // Both ends live while connected, and nothing is held once they close
+  REQUIRE( statistics[0].in_use == 2 );
+  REQUIRE( statistics[1].in_use == 0 );
+  REQUIRE( statistics[2].in_use == 2 );
+  REQUIRE( statistics[3].in_use == 0 );
+  // The second connection reused the first one's slots
+  REQUIRE( statistics[0].capacity > 0 );
+  REQUIRE( statistics[3].capacity == statistics[0].capacity );
+}
@@ -0,0 +1,1160 @@
+/*
+ * Copyright 2016 Zachary Michaels
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "asio_sodium/bound_stream.hpp"
+#include "asio_sodium/crypto_pool.hpp"
+#include "asio_sodium/crypto_stream.hpp"
+
+#include <asio/io_service.hpp>
+#include <asio/read.hpp>
+#include <asio/use_future.hpp>
+#include <asio/write.hpp>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated"
+#pragma clang diagnostic ignored "-Wunused-local-typedef"
+#include <asio/local/connect_pair.hpp>
+#include <asio/local/stream_protocol.hpp>
+#pragma clang diagnostic pop
+
+#include <catch.hpp>
+#include <sodium.h>
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace asio_sodium;
+
+namespace {
+  using local_stream = crypto_stream<asio::local::stream_protocol::socket>;
+  using strand_local_stream =
+    crypto_stream<strand_stream<asio::local::stream_protocol::socket>>
+  ;
+}
+
+SCENARIO("crypto stream over a local socket", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+
+  std::vector<byte> original(1000);
+  randombytes_buf(original.data(), original.size());
+  std::vector<byte> reply(original.size());
+  std::vector<byte> echoed;
+
+  std::unique_ptr<local_stream> server_stream;
+  std::unique_ptr<local_stream> client_stream;
+
+  local_stream::async_server_handshake(
+    std::move(server_local)
+  , server_pk
+  , server_sk
+  , [](auto const) { return true; }
+  , [&](auto&& stream) {
+      server_stream = std::make_unique<local_stream>(std::move(stream));
+      // Echo the first message back
+      server_stream->async_read(
+        [&](auto ec, pooled_message message) {
+          if (ec) {
+            std::cout << "SERVER ERROR: " << ec.message() << std::endl;
+            return;
+          }
+          std::copy(
+            message.data()
+          , message.data() + message.size()
+          , reply.begin()
+          );
+          server_stream->async_write(
+            gsl::as_span(reply)
+          , [](auto write_ec, auto) {
+              if (write_ec) {
+                std::cout
+                  << "SERVER ERROR: " << write_ec.message() << std::endl
+                ;
+              }
+            }
+          );
+        }
+      );
+    }
+  , [](auto ec, auto) {
+      std::cout << "SERVER ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  local_stream::async_client_handshake(
+    std::move(client_local)
+  , server_pk
+  , client_pk
+  , client_sk
+  , [&](auto&& stream) {
+      client_stream = std::make_unique<local_stream>(std::move(stream));
+      client_stream->async_write(
+        gsl::as_span(original)
+      , [&](auto ec, auto) {
+          if (ec) {
+            std::cout << "CLIENT ERROR: " << ec.message() << std::endl;
+            return;
+          }
+          client_stream->async_read(
+            [&](auto read_ec, pooled_message message) {
+              if (read_ec) {
+                std::cout << "CLIENT ERROR: " << read_ec.message() << std::endl;
+                return;
+              }
+              echoed.assign(message.data(), message.data() + message.size());
+            }
+          );
+        }
+      );
+    }
+  , [](auto ec) {
+      std::cout << "CLIENT ERROR: " << ec.message() << std::endl;
+    }
+  );
+
+  io.run();
+
+  REQUIRE( client_stream );
+  REQUIRE( server_stream );
+  REQUIRE( client_stream->next_layer().is_open() );
+  REQUIRE( echoed == original );
+}
+
+SCENARIO("crypto stream on a strand with a multi-threaded io_service", "[integration]") {
+  using next_layer_type = strand_local_stream::next_layer_type;
+  using strand_type = next_layer_type::executor_type;
+
+  std::size_t const message_count = 200;
+
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+
+  std::vector<std::vector<byte>> messages(message_count);
+  for (auto& message : messages) {
+    message.resize(512);
+    randombytes_buf(message.data(), message.size());
+  }
+
+  std::unique_ptr<strand_local_stream> server_stream;
+  std::unique_ptr<strand_local_stream> client_stream;
+  std::atomic<std::size_t> echoed(0);
+  std::atomic<std::size_t> matched(0);
+  std::atomic<std::size_t> errors(0);
+
+  // The server echoes every message while its earlier echoes are still being
+  // written, so reads and queued writes complete concurrently unless the
+  // strand serializes them
+  std::function<void()> echo_next = [&] {
+    server_stream->async_read(
+      [&](auto ec, pooled_message message) {
+        if (ec) {
+          ++errors;
+          return;
+        }
+        auto const data = message.data();
+        auto const size = message.size();
+        server_stream->async_write(
+          gsl::span<byte const>(data, size)
+        , [&, message = std::move(message)](auto write_ec, auto) {
+            if (write_ec) {
+              ++errors;
+            }
+            ++echoed;
+          }
+        );
+        echo_next();
+      }
+    );
+  };
+
+  std::function<void(std::size_t)> read_echo = [&](std::size_t index) {
+    client_stream->async_read(
+      [&, index](auto ec, pooled_message message) {
+        if (ec) {
+          ++errors;
+          return;
+        }
+        if (
+          std::equal(
+            message.data()
+          , message.data() + message.size()
+          , messages[index].begin()
+          , messages[index].end()
+          )
+        ) {
+          ++matched;
+        }
+        if (index + 1 < message_count) {
+          read_echo(index + 1);
+        } else {
+          client_stream->next_layer().lowest_layer().close();
+        }
+      }
+    );
+  };
+
+  strand_local_stream::async_server_handshake(
+    next_layer_type(std::move(server_local), strand_type(io.get_executor()))
+  , server_pk
+  , server_sk
+  , [](auto const) { return true; }
+  , [&](auto&& stream) {
+      server_stream =
+        std::make_unique<strand_local_stream>(std::move(stream));
+      echo_next();
+    }
+  , [&](auto, auto) { ++errors; }
+  );
+
+  strand_local_stream::async_client_handshake(
+    next_layer_type(std::move(client_local), strand_type(io.get_executor()))
+  , server_pk
+  , client_pk
+  , client_sk
+  , [&](auto&& stream) {
+      client_stream =
+        std::make_unique<strand_local_stream>(std::move(stream));
+      for (auto const& message : messages) {
+        client_stream->async_write(
+          gsl::as_span(message)
+        , [&](auto ec, auto) {
+            if (ec) {
+              ++errors;
+            }
+          }
+        );
+      }
+      read_echo(0);
+    }
+  , [&](auto) { ++errors; }
+  );
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 3; ++i) {
+    threads.emplace_back([&io] { io.run(); });
+  }
+  io.run();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  REQUIRE( client_stream );
+  REQUIRE( server_stream );
+  REQUIRE( matched == message_count );
+  REQUIRE( echoed == message_count );
+  // The server's last read fails once the client closes
+  REQUIRE( errors == 1 );
+}
+
+SCENARIO("crypto stream operations with completion tokens", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+
+  auto work = std::make_unique<asio::io_service::work>(io);
+  std::thread runner([&io] { io.run(); });
+
+  GIVEN("futures") {
+    auto server_handshake = local_stream::async_server_handshake(
+      std::move(server_local)
+    , make_identity(server_pk, server_sk)
+    , [](auto const) { return true; }
+    , asio::use_future
+    );
+    auto client_handshake = local_stream::async_client_handshake(
+      std::move(client_local)
+    , server_pk
+    , make_identity(client_pk, client_sk)
+    , asio::use_future
+    );
+    auto server_stream = server_handshake.get();
+    auto client_stream = client_handshake.get();
+
+    std::vector<byte> original(1000);
+    randombytes_buf(original.data(), original.size());
+
+    auto written = client_stream.async_write(
+      gsl::as_span(original)
+    , asio::use_future
+    );
+    auto message = server_stream.async_read(asio::use_future).get();
+    REQUIRE( written.get() == original.size() );
+    REQUIRE(
+      std::vector<byte>(message.data(), message.data() + message.size())
+      == original
+    );
+
+    std::vector<byte> reply(original);
+    auto reply_written = server_stream.async_write_destructive(
+      gsl::as_span(reply)
+    , asio::use_future
+    );
+    std::vector<byte> echoed(original.size());
+    auto read = client_stream.async_read(
+      gsl::as_span(echoed)
+    , asio::use_future
+    );
+    REQUIRE( reply_written.get() == original.size() );
+    REQUIRE( read.get() == original.size() );
+    REQUIRE( echoed == original );
+
+    THEN("errors surface as exceptions") {
+      client_stream.next_layer().close();
+      auto failed = server_stream.async_read(asio::use_future);
+      REQUIRE_THROWS_AS( failed.get(), std::system_error );
+    }
+  }
+
+  work.reset();
+  runner.join();
+}
+
+SCENARIO("a queued write's handler may destroy the stream", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+
+  std::vector<byte> first(100);
+  std::vector<byte> second(100);
+  std::unique_ptr<local_stream> server_stream;
+  std::unique_ptr<local_stream> client_stream;
+  std::size_t completed = 0;
+
+  local_stream::async_server_handshake(
+    std::move(server_local)
+  , server_pk
+  , server_sk
+  , [](auto const) { return true; }
+  , [&](auto&& stream) {
+      server_stream = std::make_unique<local_stream>(std::move(stream));
+    }
+  , [](auto, auto) {}
+  );
+
+  local_stream::async_client_handshake(
+    std::move(client_local)
+  , server_pk
+  , client_pk
+  , client_sk
+  , [&](auto&& stream) {
+      client_stream = std::make_unique<local_stream>(std::move(stream));
+      // The first message goes straight out, so the next two are sent
+      // together once it completes. The first handler of that batch drops the
+      // stream before the second runs.
+      client_stream->async_write(
+        gsl::as_span(first)
+      , [&](auto ec, auto) {
+          REQUIRE( !ec );
+          ++completed;
+        }
+      );
+      client_stream->async_write(
+        gsl::as_span(first)
+      , [&](auto ec, auto) {
+          REQUIRE( !ec );
+          ++completed;
+          client_stream.reset();
+        }
+      );
+      client_stream->async_write(
+        gsl::as_span(second)
+      , [&](auto ec, auto) {
+          REQUIRE( !ec );
+          ++completed;
+        }
+      );
+    }
+  , [](auto) {}
+  );
+
+  io.run();
+
+  REQUIRE( !client_stream );
+  REQUIRE( completed == 3 );
+}
+
+SCENARIO("chunked messages", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+
+  auto work = std::make_unique<asio::io_service::work>(io);
+  std::thread runner([&io] { io.run(); });
+
+  auto server_handshake = local_stream::async_server_handshake(
+    std::move(server_local)
+  , make_identity(server_pk, server_sk)
+  , [](auto const) { return true; }
+  , asio::use_future
+  );
+  auto client_handshake = local_stream::async_client_handshake(
+    std::move(client_local)
+  , server_pk
+  , make_identity(client_pk, client_sk)
+  , asio::use_future
+  );
+  auto server_stream = server_handshake.get();
+  auto client_stream = client_handshake.get();
+
+  // Several full chunks and a partial one
+  std::vector<byte> original(detail::message_chunk_size * 5 + 123);
+  randombytes_buf(original.data(), original.size());
+
+  // Sends a chunked message, an empty chunked message, and then an ordinary
+  // one, which only decrypts if both sides agree on the nonces the chunks used
+  auto const exchange = [&]() {
+    std::vector<byte> source(original);
+    auto written = client_stream.async_write_chunked(
+      gsl::as_span(source)
+    , asio::use_future
+    );
+    auto message = server_stream.async_read(asio::use_future).get();
+    REQUIRE( written.get() == original.size() );
+    REQUIRE(
+      std::vector<byte>(message.data(), message.data() + message.size())
+      == original
+    );
+
+    auto empty_written = client_stream.async_write_chunked(
+      gsl::span<byte>()
+    , asio::use_future
+    );
+    std::vector<byte> target(original.size());
+    auto empty_read = server_stream.async_read(
+      gsl::as_span(target)
+    , asio::use_future
+    );
+    REQUIRE( empty_written.get() == 0 );
+    REQUIRE( empty_read.get() == 0 );
+
+    std::vector<byte> reply(100, 42);
+    auto reply_written = client_stream.async_write(
+      gsl::as_span(reply)
+    , asio::use_future
+    );
+    auto reply_read = server_stream.async_read(asio::use_future).get();
+    REQUIRE( reply_written.get() == reply.size() );
+    REQUIRE( reply_read.size() == reply.size() );
+  };
+
+  // Every chunk of the message goes through the pool on each end that has one
+  std::size_t const chunk_count = 6;
+
+  GIVEN("crypto pools on both ends") {
+    crypto_pool client_pool{2};
+    crypto_pool server_pool{2};
+    client_stream.set_crypto_pool(&client_pool);
+    server_stream.set_crypto_pool(&server_pool);
+    exchange();
+    REQUIRE( client_pool.jobs_posted() == chunk_count );
+    REQUIRE( server_pool.jobs_posted() == chunk_count );
+  }
+
+  GIVEN("no crypto pools") {
+    exchange();
+  }
+
+  GIVEN("a crypto pool on the writing end only") {
+    crypto_pool pool{2};
+    client_stream.set_crypto_pool(&pool);
+    exchange();
+    REQUIRE( pool.jobs_posted() == chunk_count );
+  }
+
+  GIVEN("a crypto pool on the reading end only") {
+    crypto_pool pool{2};
+    server_stream.set_crypto_pool(&pool);
+    exchange();
+    REQUIRE( pool.jobs_posted() == chunk_count );
+  }
+
+  work.reset();
+  runner.join();
+}
+
+SCENARIO("streams", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+
+  auto work = std::make_unique<asio::io_service::work>(io);
+  std::thread runner([&io] { io.run(); });
+
+  auto server_handshake = local_stream::async_server_handshake(
+    std::move(server_local)
+  , make_identity(server_pk, server_sk)
+  , [](auto const) { return true; }
+  , asio::use_future
+  );
+  auto client_handshake = local_stream::async_client_handshake(
+    std::move(client_local)
+  , server_pk
+  , make_identity(client_pk, client_sk)
+  , asio::use_future
+  );
+  auto server_stream = server_handshake.get();
+  auto client_stream = client_handshake.get();
+
+  // Produces length bytes of a counting pattern, a few hundred at a time
+  // more than one chunk holds, so the sink sees different chunk boundaries
+  auto const counting_source = [](uint64_t length) {
+    return [length, produced = uint64_t(0)](gsl::span<byte> target) mutable {
+      auto const count = std::min<uint64_t>(
+        length - produced
+      , static_cast<uint64_t>(target.size()) - produced % 300
+      );
+      for (uint64_t i = 0; i < count; ++i) {
+        target[static_cast<std::ptrdiff_t>(i)] =
+          static_cast<byte>((produced + i) % 251)
+        ;
+      }
+      produced += count;
+      return static_cast<std::size_t>(count);
+    };
+  };
+
+  // Checks that the payload follows the pattern, in chunks no larger than
+  // stream_chunk_size
+  std::size_t largest_chunk = 0;
+  bool intact = true;
+  auto const checking_sink = [&largest_chunk, &intact]() {
+    return [&, received = uint64_t(0)](gsl::span<byte> chunk) mutable {
+      largest_chunk = std::max(
+        largest_chunk
+      , static_cast<std::size_t>(chunk.size())
+      );
+      for (auto const value : chunk) {
+        intact = intact && value == static_cast<byte>(received++ % 251);
+      }
+    };
+  };
+
+  // An ordinary message only decrypts if both sides agree on the nonces the
+  // stream used
+  auto const exchange_message = [&]() {
+    std::vector<byte> reply(100, 42);
+    auto reply_written = client_stream.async_write(
+      gsl::as_span(reply)
+    , asio::use_future
+    );
+    auto reply_read = server_stream.async_read(asio::use_future).get();
+    REQUIRE( reply_written.get() == reply.size() );
+    REQUIRE( reply_read.size() == reply.size() );
+  };
+
+  GIVEN("a stream several chunks long") {
+    uint64_t const length = detail::stream_chunk_size * 4 + 4321;
+    auto written = client_stream.async_write_stream(
+      counting_source(length)
+    , asio::use_future
+    );
+    auto read = server_stream.async_read_stream(
+      checking_sink()
+    , asio::use_future
+    );
+    REQUIRE( written.get() == length );
+    REQUIRE( read.get() == length );
+    REQUIRE( intact );
+    REQUIRE( largest_chunk <= detail::stream_chunk_size );
+    exchange_message();
+  }
+
+  GIVEN("an empty stream") {
+    auto written = client_stream.async_write_stream(
+      counting_source(0)
+    , asio::use_future
+    );
+    auto read = server_stream.async_read_stream(
+      checking_sink()
+    , asio::use_future
+    );
+    REQUIRE( written.get() == 0 );
+    REQUIRE( read.get() == 0 );
+    REQUIRE( largest_chunk == 0 );
+    exchange_message();
+  }
+
+  GIVEN("a reader expecting an ordinary message") {
+    auto written = client_stream.async_write_stream(
+      counting_source(1000)
+    , asio::use_future
+    );
+    std::promise<std::error_code> read_result;
+    server_stream.async_read(
+      [&read_result](std::error_code const& ec, pooled_message) {
+        read_result.set_value(ec);
+      }
+    );
+    REQUIRE( written.get() == 1000 );
+    REQUIRE( read_result.get_future().get() == error::message_kind );
+  }
+
+  GIVEN("a stream reader given an ordinary message") {
+    std::vector<byte> message(100, 42);
+    auto written = client_stream.async_write(
+      gsl::as_span(message)
+    , asio::use_future
+    );
+    std::promise<std::error_code> read_result;
+    server_stream.async_read_stream(
+      checking_sink()
+    , [&read_result](std::error_code const& ec, uint64_t) {
+        read_result.set_value(ec);
+      }
+    );
+    REQUIRE( written.get() == message.size() );
+    REQUIRE( read_result.get_future().get() == error::message_kind );
+  }
+
+  work.reset();
+  runner.join();
+}
+
+SCENARIO("server handshake on a crypto pool", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+
+  auto work = std::make_unique<asio::io_service::work>(io);
+  std::thread runner([&io] { io.run(); });
+  crypto_pool pool{2};
+
+  std::atomic<bool> authenticated_on_runner{false};
+  auto const client_handshake = [&]() {
+    return local_stream::async_client_handshake(
+      std::move(client_local)
+    , server_pk
+    , make_identity(client_pk, client_sk)
+    , asio::use_future
+    );
+  };
+
+  GIVEN("an authorized client") {
+    auto server_handshake = local_stream::async_server_handshake(
+      pool
+    , std::move(server_local)
+    , make_identity(server_pk, server_sk)
+    , [&](auto const) {
+        authenticated_on_runner =
+          std::this_thread::get_id() == runner.get_id()
+        ;
+        return true;
+      }
+    , asio::use_future
+    );
+    auto client_future = client_handshake();
+    auto server_stream = server_handshake.get();
+    auto client_stream = client_future.get();
+    REQUIRE( authenticated_on_runner );
+    // Opening the hello and making the response each ran on the pool
+    REQUIRE( pool.jobs_posted() == 2 );
+
+    std::vector<byte> message(100, 42);
+    auto written = server_stream.async_write(
+      gsl::as_span(message)
+    , asio::use_future
+    );
+    auto read = client_stream.async_read(asio::use_future).get();
+    REQUIRE( written.get() == message.size() );
+    REQUIRE(
+      std::vector<byte>(read.data(), read.data() + read.size()) == message
+    );
+  }
+
+  GIVEN("an unauthorized client") {
+    std::promise<std::error_code> server_result;
+    local_stream::async_server_handshake(
+      pool
+    , std::move(server_local)
+    , make_identity(server_pk, server_sk)
+    , [&](auto const) {
+        authenticated_on_runner =
+          std::this_thread::get_id() == runner.get_id()
+        ;
+        return false;
+      }
+    , [&server_result](local_stream&&) {
+        server_result.set_value(std::error_code());
+      }
+    , [&server_result](std::error_code const& ec, std::size_t) {
+        server_result.set_value(ec);
+      }
+    );
+    auto client_future = client_handshake();
+    REQUIRE(
+      server_result.get_future().get() == error::handshake_authentication
+    );
+    REQUIRE( authenticated_on_runner );
+    // Only the hello was opened on the pool
+    REQUIRE( pool.jobs_posted() == 1 );
+    // The server closes the connection without responding
+    REQUIRE_THROWS( client_future.get() );
+  }
+
+  work.reset();
+  runner.join();
+}
+
+SCENARIO("session resumption", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  auto const server_identity =
+    make_identity(server_pk, server_sk, make_ticket_key())
+  ;
+  auto const client_identity = make_identity(client_pk, client_sk);
+
+  asio::io_service io;
+  auto work = std::make_unique<asio::io_service::work>(io);
+  std::thread runner([&io] { io.run(); });
+
+  std::atomic<int> authenticated{0};
+  auto const connect = [&](
+    shared_identity server
+  , resumption_ticket const* ticket
+  ) {
+    asio::local::stream_protocol::socket client_local(io);
+    asio::local::stream_protocol::socket server_local(io);
+    asio::local::connect_pair(client_local, server_local);
+    auto server_future = local_stream::async_server_handshake(
+      std::move(server_local)
+    , std::move(server)
+    , [&authenticated, &client_pk](auto const& key) {
+        ++authenticated;
+        return std::equal(key.begin(), key.end(), client_pk.begin());
+      }
+    , asio::use_future
+    );
+    auto client_future =
+      ticket
+      ? local_stream::async_client_resume(
+          std::move(client_local)
+        , server_pk
+        , client_identity
+        , *ticket
+        , asio::use_future
+        )
+      : local_stream::async_client_handshake(
+          std::move(client_local)
+        , server_pk
+        , client_identity
+        , asio::use_future
+        )
+    ;
+    return std::make_pair(std::move(client_future), std::move(server_future));
+  };
+
+  auto first = connect(server_identity, nullptr);
+  auto first_client = first.first.get();
+  first.second.get();
+  REQUIRE( first_client.get_resumption_ticket() != nullptr );
+  auto const ticket = *first_client.get_resumption_ticket();
+  REQUIRE( ticket.expiry > std::chrono::system_clock::now() );
+
+  GIVEN("the server that issued the ticket") {
+    auto resumed = connect(server_identity, &ticket);
+    auto client_stream = resumed.first.get();
+    auto server_stream = resumed.second.get();
+    // The server still authenticates the client named in the ticket
+    REQUIRE( authenticated == 2 );
+
+    std::vector<byte> message(100, 42);
+    auto written = client_stream.async_write(
+      gsl::as_span(message)
+    , asio::use_future
+    );
+    auto read = server_stream.async_read(asio::use_future).get();
+    REQUIRE( written.get() == message.size() );
+    REQUIRE(
+      std::vector<byte>(read.data(), read.data() + read.size()) == message
+    );
+
+    // Each resumption issues a fresh ticket
+    auto const renewed = client_stream.get_resumption_ticket();
+    REQUIRE( renewed != nullptr );
+    REQUIRE( renewed->sealed != ticket.sealed );
+    REQUIRE( renewed->secret != ticket.secret );
+  }
+
+  GIVEN("a server with a different ticket key") {
+    auto resumed = connect(
+      make_identity(server_pk, server_sk, make_ticket_key())
+    , &ticket
+    );
+    try {
+      resumed.second.get();
+      FAIL( "the server accepted a foreign ticket" );
+    } catch (std::system_error const& e) {
+      REQUIRE( e.code() == error::handshake_ticket );
+    }
+    REQUIRE_THROWS( resumed.first.get() );
+  }
+
+  GIVEN("a server without a ticket key") {
+    auto resumed = connect(make_identity(server_pk, server_sk), &ticket);
+    REQUIRE_THROWS( resumed.second.get() );
+    REQUIRE_THROWS( resumed.first.get() );
+  }
+
+  GIVEN("a replayed resume hello") {
+    // Capture the client's flight
+    asio::local::stream_protocol::socket client_local(io);
+    asio::local::stream_protocol::socket eavesdropper(io);
+    asio::local::connect_pair(client_local, eavesdropper);
+    auto client_future = local_stream::async_client_resume(
+      std::move(client_local)
+    , server_pk
+    , client_identity
+    , ticket
+    , asio::use_future
+    );
+    std::vector<byte> flight(1 + detail::resume_hello::buffer_size);
+    asio::read(eavesdropper, asio::buffer(flight));
+    eavesdropper.close();
+    REQUIRE_THROWS( client_future.get() );
+
+    // The server can't tell a replay apart, so it answers each one
+    auto const replay = [&]() {
+      asio::local::stream_protocol::socket attacker(io);
+      asio::local::stream_protocol::socket server_local(io);
+      asio::local::connect_pair(attacker, server_local);
+      auto server_future = local_stream::async_server_handshake(
+        std::move(server_local)
+      , server_identity
+      , [](auto const) { return true; }
+      , asio::use_future
+      );
+      asio::write(attacker, asio::buffer(flight));
+      std::pair<nonce, detail::handshake_response::buffer> response;
+      std::array<asio::mutable_buffer, 2> const buffers{{
+        asio::buffer(response.first)
+      , asio::buffer(response.second)
+      }};
+      asio::read(attacker, buffers);
+      server_future.get();
+      return response;
+    };
+    auto first_response = replay();
+    auto second_response = replay();
+
+    // Each response is encrypted under the same key, but with a fresh nonce
+    // from the server, so the replay doesn't reuse a key and nonce
+    REQUIRE( first_response.first != second_response.first );
+    shared_key response_key;
+    REQUIRE(
+      detail::derive_resumption_key(
+        ticket.secret
+      , detail::resumption_subkey::response
+      , response_key
+      )
+    );
+    auto mismatched = second_response.second;
+    REQUIRE(
+      !detail::handshake_response::decrypt(
+        mismatched, first_response.first, response_key
+      )
+    );
+    REQUIRE(
+      detail::handshake_response::decrypt(
+        first_response.second, first_response.first, response_key
+      )
+    );
+    REQUIRE(
+      detail::handshake_response::decrypt(
+        second_response.second, second_response.first, response_key
+      )
+    );
+  }
+
+  work.reset();
+  runner.join();
+}
+
+SCENARIO("early data in the handshake flight", "[integration]") {
+  private_key server_sk;
+  public_key server_pk;
+  crypto_box_keypair(&server_pk[0], &server_sk[0]);
+
+  private_key client_sk;
+  public_key client_pk;
+  crypto_box_keypair(&client_pk[0], &client_sk[0]);
+
+  auto const server_identity =
+    make_identity(server_pk, server_sk, make_ticket_key())
+  ;
+  auto const client_identity = make_identity(client_pk, client_sk);
+
+  asio::io_service io;
+  asio::local::stream_protocol::socket client_local(io);
+  asio::local::stream_protocol::socket server_local(io);
+  asio::local::connect_pair(client_local, server_local);
+
+  auto work = std::make_unique<asio::io_service::work>(io);
+  std::thread runner([&io] { io.run(); });
+
+  std::vector<byte> const request(100, 42);
+  auto const authenticator = [](auto const) { return true; };
+
+  GIVEN("a server without a responder") {
+    auto server_future = local_stream::async_server_handshake(
+      std::move(server_local)
+    , server_identity
+    , authenticator
+    , asio::use_future
+    );
+    auto client_future = local_stream::async_client_handshake_early(
+      std::move(client_local)
+    , server_pk
+    , client_identity
+    , nullptr
+    , gsl::as_span(request)
+    , asio::use_future
+    );
+    auto server_stream = server_future.get();
+    auto client_stream = client_future.get();
+
+    // The first read returns the early data, and later messages follow it
+    std::vector<byte> message(200, 7);
+    auto written = client_stream.async_write(
+      gsl::as_span(message)
+    , asio::use_future
+    );
+    auto early = server_stream.async_read(asio::use_future).get();
+    REQUIRE(
+      std::vector<byte>(early.data(), early.data() + early.size()) == request
+    );
+    auto later = server_stream.async_read(asio::use_future).get();
+    REQUIRE( written.get() == message.size() );
+    REQUIRE(
+      std::vector<byte>(later.data(), later.data() + later.size()) == message
+    );
+  }
+
+  GIVEN("a stream reader ahead of the early data") {
+    auto server_future = local_stream::async_server_handshake(
+      std::move(server_local)
+    , server_identity
+    , authenticator
+    , asio::use_future
+    );
+    auto client_future = local_stream::async_client_handshake_early(
+      std::move(client_local)
+    , server_pk
+    , client_identity
+    , nullptr
+    , gsl::as_span(request)
+    , asio::use_future
+    );
+    auto server_stream = server_future.get();
+    auto client_stream = client_future.get();
+
+    // The stream read is rejected, and the early data waits for an ordinary
+    // read
+    std::promise<std::error_code> stream_result;
+    server_stream.async_read_stream(
+      [](gsl::span<byte>) {}
+    , [&stream_result](std::error_code const& ec, uint64_t) {
+        stream_result.set_value(ec);
+      }
+    );
+    REQUIRE( stream_result.get_future().get() == error::message_kind );
+    auto early = server_stream.async_read(asio::use_future).get();
+    REQUIRE(
+      std::vector<byte>(early.data(), early.data() + early.size()) == request
+    );
+  }
+
+  GIVEN("a server with a responder") {
+    std::vector<byte> const reply(300, 9);
+    std::vector<byte> received;
+    auto server_future = local_stream::async_server_handshake_early(
+      std::move(server_local)
+    , server_identity
+    , authenticator
+    , [&received, &reply](gsl::span<byte const> early_data) {
+        received.assign(early_data.begin(), early_data.end());
+        return reply;
+      }
+    , asio::use_future
+    );
+    auto client_future = local_stream::async_client_handshake_early(
+      std::move(client_local)
+    , server_pk
+    , client_identity
+    , nullptr
+    , gsl::as_span(request)
+    , asio::use_future
+    );
+    auto server_stream = server_future.get();
+    auto client_stream = client_future.get();
+    REQUIRE( received == request );
+
+    // The reply arrived with the handshake response
+    auto first = client_stream.async_read(asio::use_future).get();
+    REQUIRE(
+      std::vector<byte>(first.data(), first.data() + first.size()) == reply
+    );
+
+    // The early data went to the responder, so the server's first read waits
+    // for the client's first message
+    std::vector<byte> message(200, 7);
+    auto written = client_stream.async_write(
+      gsl::as_span(message)
+    , asio::use_future
+    );
+    auto next = server_stream.async_read(asio::use_future).get();
+    REQUIRE( written.get() == message.size() );
+    REQUIRE(
+      std::vector<byte>(next.data(), next.data() + next.size()) == message
+    );
+
+    WHEN("the client resumes with early data") {
+      auto const ticket = *client_stream.get_resumption_ticket();
+      asio::local::stream_protocol::socket client_resumed(io);
+      asio::local::stream_protocol::socket server_resumed(io);
+      asio::local::connect_pair(client_resumed, server_resumed);
+      received.clear();
+      auto resumed_server = local_stream::async_server_handshake_early(
+        std::move(server_resumed)
+      , server_identity
+      , authenticator
+      , [&received, &reply](gsl::span<byte const> early_data) {
+          received.assign(early_data.begin(), early_data.end());
+          return reply;
+        }
+      , asio::use_future
+      );
+      auto resumed_client = local_stream::async_client_handshake_early(
+        std::move(client_resumed)
+      , server_pk
+      , client_identity
+      , &ticket
+      , gsl::as_span(request)
+      , asio::use_future
+      );
+      resumed_server.get();
+      auto resumed_stream = resumed_client.get();
+      REQUIRE( received == request );
+      auto resumed_first = resumed_stream.async_read(asio::use_future).get();
+      REQUIRE(
+        std::vector<byte>(
+          resumed_first.data()
+        , resumed_first.data() + resumed_first.size()
+        )
+        == reply
+      );
+    }
+  }
+
+  GIVEN("too much early data") {
+    std::vector<byte> const oversized(16 * 1024 + 1);
+    auto client_future = local_stream::async_client_handshake_early(
+      std::move(client_local)
+    , server_pk
+    , client_identity
+    , nullptr
+    , gsl::as_span(oversized)
+    , asio::use_future
+    );
+    try {
+      client_future.get();
+      FAIL( "the client sent oversized early data" );
+    } catch (std::system_error const& e) {
+      REQUIRE( e.code() == error::handshake_early_data );
+    }
+  }
+
+  work.reset();
+  runner.join();
+}